@@ -0,0 +1,425 @@
+#define _POSIX_C_SOURCE 200809L
+#include "capture.h"
+#include <string.h>
+
+#include <pthread.h>
+#include <unistd.h>
+#include <linux/videodev2.h>
+
+/*
+ * raw Bayer demosaicing: each band of output rows runs on its own thread
+ * over a ring of 5 source rows unpacked to 8 bits and mirrored by 2 pixels
+ * on every side (so the CFA phase holds at the borders); row kernels run
+ * at unit stride into planar rows with a masked select of the phase, for
+ * the vectorizer at -O3 (the final RGB interleave and the 12P unpack need
+ * a byte shuffle: SSSE3 or NEON)
+ */
+
+typedef enum {
+  BAYER_8, /* one byte per sample */
+  BAYER_16, /* little endian, the value in the low bits */
+  BAYER_10P, /* MIPI packed: 4 msb bytes then one byte of their lsbs */
+  BAYER_12P, /* MIPI packed: 2 msb bytes then one byte of their lsbs */
+} bayer_packing_t;
+
+typedef struct {
+  uint32_t format;
+  uint8_t red; /* position of R in the 2x2 tile, as y * 2 + x */
+  uint8_t packing;
+  uint8_t shift; /* to 8 bits */
+} bayer_format_t;
+
+static const bayer_format_t bayer_formats[] = {
+  {V4L2_PIX_FMT_SBGGR8, 3, BAYER_8, 0},
+  {V4L2_PIX_FMT_SGBRG8, 2, BAYER_8, 0},
+  {V4L2_PIX_FMT_SGRBG8, 1, BAYER_8, 0},
+  {V4L2_PIX_FMT_SRGGB8, 0, BAYER_8, 0},
+  {V4L2_PIX_FMT_SBGGR10, 3, BAYER_16, 2},
+  {V4L2_PIX_FMT_SGBRG10, 2, BAYER_16, 2},
+  {V4L2_PIX_FMT_SGRBG10, 1, BAYER_16, 2},
+  {V4L2_PIX_FMT_SRGGB10, 0, BAYER_16, 2},
+  {V4L2_PIX_FMT_SBGGR12, 3, BAYER_16, 4},
+  {V4L2_PIX_FMT_SGBRG12, 2, BAYER_16, 4},
+  {V4L2_PIX_FMT_SGRBG12, 1, BAYER_16, 4},
+  {V4L2_PIX_FMT_SRGGB12, 0, BAYER_16, 4},
+  {V4L2_PIX_FMT_SBGGR16, 3, BAYER_16, 8},
+#ifdef V4L2_PIX_FMT_SGBRG16
+  {V4L2_PIX_FMT_SGBRG16, 2, BAYER_16, 8},
+  {V4L2_PIX_FMT_SGRBG16, 1, BAYER_16, 8},
+  {V4L2_PIX_FMT_SRGGB16, 0, BAYER_16, 8},
+#endif
+#ifdef V4L2_PIX_FMT_SBGGR10P
+  {V4L2_PIX_FMT_SBGGR10P, 3, BAYER_10P, 0},
+  {V4L2_PIX_FMT_SGBRG10P, 2, BAYER_10P, 0},
+  {V4L2_PIX_FMT_SGRBG10P, 1, BAYER_10P, 0},
+  {V4L2_PIX_FMT_SRGGB10P, 0, BAYER_10P, 0},
+#endif
+#ifdef V4L2_PIX_FMT_SBGGR12P
+  {V4L2_PIX_FMT_SBGGR12P, 3, BAYER_12P, 0},
+  {V4L2_PIX_FMT_SGBRG12P, 2, BAYER_12P, 0},
+  {V4L2_PIX_FMT_SGRBG12P, 1, BAYER_12P, 0},
+  {V4L2_PIX_FMT_SRGGB12P, 0, BAYER_12P, 0},
+#endif
+};
+
+static const bayer_format_t* bayer_format(uint32_t format)
+{
+  const size_t count = sizeof bayer_formats / sizeof (bayer_format_t);
+  for (size_t i = 0; i < count; i++) {
+    if (bayer_formats[i].format == format) return &bayer_formats[i];
+  }
+  return NULL;
+}
+
+bool camera_format_bayer(uint32_t format)
+{
+  return bayer_format(format) != NULL;
+}
+
+typedef struct {
+  const bayer_format_t* bayer;
+  camera_demosaic_t method;
+  camera_pixel_t pixel;
+  const uint8_t* source; /* first row */
+  uint32_t stride;
+  uint32_t width;
+  uint32_t height;
+  uint8_t* out;
+  uint32_t out_width;
+  uint32_t out_height;
+  camera_orientation_t orientation;
+  camera_orient_t* orient; /* of the band's thread */
+  uint32_t y0, y1; /* output rows of the band */
+  bool ok;
+} bayer_band_t;
+
+static inline uint8_t clamp8i(int v)
+{
+  return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+/* a where site, else b; masked for the vectorizer's if-conversion */
+static inline int select_site(bool site, int a, int b)
+{
+  const int mask = -(int) site;
+  return (a & mask) | (b & ~mask);
+}
+
+/* line holds width + 4 samples: row y (mirrored) at line[2..] */
+static void bayer_unpack(const bayer_band_t* band, int y, uint8_t* line)
+{
+  const int height = band->height;
+  if (y < 0) y = -y;
+  if (y >= height) y = 2 * height - 2 - y;
+  const uint8_t* restrict row = band->source + (size_t) y * band->stride;
+  const size_t width = band->width;
+  const unsigned shift = band->bayer->shift;
+  uint8_t* restrict px = line + 2;
+  size_t x = 0;
+  switch (band->bayer->packing) {
+  case BAYER_8:
+    memcpy(px, row, width);
+    break;
+  case BAYER_16:
+    for (; x < width; x++) {
+      px[x] = (row[2 * x] | row[2 * x + 1] << 8) >> shift;
+    }
+    break;
+  case BAYER_10P:
+    /* whole groups of 4 first, their lsb byte skipped */
+    for (; x < width / 4; x++) {
+      px[4 * x] = row[5 * x];
+      px[4 * x + 1] = row[5 * x + 1];
+      px[4 * x + 2] = row[5 * x + 2];
+      px[4 * x + 3] = row[5 * x + 3];
+    }
+    for (x *= 4; x < width; x++) px[x] = row[x / 4 * 5 + x % 4];
+    break;
+  case BAYER_12P:
+    /* pairs of groups, as 4 of 6 bytes like 10P */
+    for (; x < width / 4; x++) {
+      px[4 * x] = row[6 * x];
+      px[4 * x + 1] = row[6 * x + 1];
+      px[4 * x + 2] = row[6 * x + 3];
+      px[4 * x + 3] = row[6 * x + 4];
+    }
+    for (x *= 4; x < width; x++) px[x] = row[x / 2 * 3 + x % 2];
+    break;
+  }
+  line[0] = px[2];
+  line[1] = px[1];
+  line[width + 2] = px[width - 2];
+  line[width + 3] = px[width - 3];
+}
+
+/*
+ * r[0..4] are rows y-2..y+2 at their first sample, first is the x parity
+ * of the row's R (or B) samples; every pixel computes both phases and
+ * keeps its own, so the loops run at unit stride into planar rows: own
+ * of the row's R or B, green, and other of the B or R it lacks
+ */
+static void bilinear_row(const uint8_t* const r[5], uint32_t first,
+                         uint32_t width, uint8_t* restrict own,
+                         uint8_t* restrict green, uint8_t* restrict other)
+{
+  const uint8_t* up = r[1];
+  const uint8_t* row = r[2];
+  const uint8_t* down = r[3];
+  for (int x = 0; x < (int) width; x++) {
+    const bool site = ((x ^ first) & 1) == 0;
+    const int center = row[x];
+    const int h = row[x - 1] + row[x + 1], v = up[x] + down[x];
+    const int diagonal = up[x - 1] + up[x + 1] + down[x - 1] + down[x + 1];
+    const int across = (diagonal + 2) >> 2, cross = (h + v + 2) >> 2;
+    const int sides = (h + 1) >> 1, ends = (v + 1) >> 1;
+    own[x] = select_site(site, center, sides);
+    green[x] = select_site(site, cross, center);
+    other[x] = select_site(site, across, ends);
+  }
+}
+
+/*
+ * green is interpolated along the smoother of the two directions with a
+ * second-order correction (Hamilton-Adams), red and blue with the
+ * gradient-corrected kernels of Malvar, He and Cutler
+ */
+static void edge_row(const uint8_t* const r[5], uint32_t first,
+                     uint32_t width, uint8_t* restrict own,
+                     uint8_t* restrict green, uint8_t* restrict other)
+{
+  const uint8_t* up2 = r[0];
+  const uint8_t* up = r[1];
+  const uint8_t* row = r[2];
+  const uint8_t* down = r[3];
+  const uint8_t* down2 = r[4];
+  for (int x = 0; x < (int) width; x++) {
+    const bool site = ((x ^ first) & 1) == 0;
+    const int center = row[x];
+    const int left = row[x - 1], right = row[x + 1];
+    const int above = up[x], below = down[x];
+    const int hs = row[x - 2] + row[x + 2], vs = up2[x] + down2[x];
+    const int diagonal = up[x - 1] + up[x + 1] + down[x - 1] + down[x + 1];
+    /* at R or B */
+    const int lh = 2 * center - hs, lv = 2 * center - vs;
+    const int dh = abs(left - right) + abs(lh);
+    const int dv = abs(above - below) + abs(lv);
+    const int gh = 2 * (left + right) + lh, gv = 2 * (above + below) + lv;
+    const int g = dh < dv ? gh : dv < dh ? gv : (gh + gv) / 2;
+    const int across = 12 * center + 4 * diagonal - 3 * (hs + vs) + 8;
+    /* at G */
+    const int h = 8 * (left + right) - 2 * hs + vs;
+    const int v = 8 * (above + below) - 2 * vs + hs;
+    const int base = 10 * center - 2 * diagonal + 8;
+    own[x] = select_site(site, center, clamp8i((base + h) >> 4));
+    green[x] = select_site(site, clamp8i((g + 2) >> 2), center);
+    other[x] = select_site(site, clamp8i(across >> 4),
+                           clamp8i((base + v) >> 4));
+  }
+}
+
+/* planar rgb rows to the output pixel, GRAY as BT.601 luma */
+static void bayer_pack(const uint8_t* restrict red,
+                       const uint8_t* restrict green,
+                       const uint8_t* restrict blue, size_t width,
+                       camera_pixel_t pixel, uint8_t* restrict out)
+{
+  switch (pixel) {
+  case CAMERA_PIXEL_RGB:
+    for (size_t x = 0; x < width; x++) {
+      out[x * 3] = red[x];
+      out[x * 3 + 1] = green[x];
+      out[x * 3 + 2] = blue[x];
+    }
+    break;
+  case CAMERA_PIXEL_RGBA:
+    for (size_t x = 0; x < width; x++) {
+      out[x * 4] = red[x];
+      out[x * 4 + 1] = green[x];
+      out[x * 4 + 2] = blue[x];
+      out[x * 4 + 3] = 255;
+    }
+    break;
+  case CAMERA_PIXEL_GRAY:
+    for (size_t x = 0; x < width; x++) {
+      out[x] = (77 * red[x] + 150 * green[x] + 29 * blue[x] + 128) >> 8;
+    }
+    break;
+  }
+}
+
+static void bayer_full(bayer_band_t* band)
+{
+  const uint32_t width = band->width;
+  const size_t line = width + 4;
+  uint8_t* ring = malloc(line * 5 + width * 3);
+  if (!ring) return;
+  uint8_t* own = ring + line * 5;
+  uint8_t* green = own + width;
+  uint8_t* other = green + width;
+  const int y0 = band->y0;
+  for (int k = -2; k <= 2; k++) {
+    bayer_unpack(band, y0 + k, ring + (size_t) ((y0 + k + 10) % 5) * line);
+  }
+  const uint32_t rx = band->bayer->red & 1, ry = band->bayer->red >> 1;
+  for (int y = y0; y < (int) band->y1; y++) {
+    if (y > y0) {
+      bayer_unpack(band, y + 2, ring + (size_t) ((y + 2) % 5) * line);
+    }
+    const uint8_t* const r[5] = {
+      ring + (size_t) ((y + 8) % 5) * line + 2,
+      ring + (size_t) ((y + 9) % 5) * line + 2,
+      ring + (size_t) (y % 5) * line + 2,
+      ring + (size_t) ((y + 1) % 5) * line + 2,
+      ring + (size_t) ((y + 2) % 5) * line + 2,
+    };
+    const bool red_row = (uint32_t) (y & 1) == ry;
+    const uint32_t first = red_row ? rx : 1 - rx;
+    if (band->method == CAMERA_DEMOSAIC_EDGE) {
+      edge_row(r, first, width, own, green, other);
+    } else {
+      bilinear_row(r, first, width, own, green, other);
+    }
+    bayer_pack(red_row ? own : other, green, red_row ? other : own, width,
+               band->pixel, camera_orient_row(band->orient, y));
+  }
+  free(ring);
+  band->ok = true;
+}
+
+/* rs and bs are the rows of R and B from the tile's first column, rx
+ * the x parity of R */
+static void binning_row(const uint8_t* restrict rs,
+                        const uint8_t* restrict bs, size_t rx, size_t width,
+                        uint8_t* restrict red, uint8_t* restrict green,
+                        uint8_t* restrict blue)
+{
+  for (size_t x = 0; x < width; x++) {
+    red[x] = rs[x * 2 + rx];
+    green[x] = (rs[x * 2 + 1 - rx] + bs[x * 2 + rx] + 1) >> 1;
+    blue[x] = bs[x * 2 + 1 - rx];
+  }
+}
+
+/* each 2x2 tile becomes one pixel: its R, B and the mean of its Gs */
+static void bayer_binning(bayer_band_t* band)
+{
+  const uint32_t width = band->width, out_width = band->out_width;
+  const size_t line = width + 4;
+  uint8_t* buffer = malloc(line * 2 + out_width * 3);
+  if (!buffer) return;
+  uint8_t* red = buffer + line * 2;
+  uint8_t* green = red + out_width;
+  uint8_t* blue = green + out_width;
+  const uint32_t rx = band->bayer->red & 1, ry = band->bayer->red >> 1;
+  for (uint32_t y = band->y0; y < band->y1; y++) {
+    bayer_unpack(band, y * 2 + ry, buffer);
+    bayer_unpack(band, y * 2 + 1 - ry, buffer + line);
+    binning_row(buffer + 2, buffer + line + 2, rx, out_width,
+                red, green, blue);
+    bayer_pack(red, green, blue, out_width, band->pixel,
+               camera_orient_row(band->orient, y));
+  }
+  free(buffer);
+  band->ok = true;
+}
+
+static void* bayer_band_main(void* pointer)
+{
+  bayer_band_t* band = pointer;
+  camera_orient_t orient;
+  if (!camera_orient_init(&orient, band->orientation, band->out_width,
+                          band->out_height, band->pixel, band->out)) {
+    return NULL;
+  }
+  band->orient = &orient;
+  if (band->method == CAMERA_DEMOSAIC_BINNING) {
+    bayer_binning(band);
+  } else {
+    bayer_full(band);
+  }
+  camera_orient_end(&orient);
+  return NULL;
+}
+
+#define BAYER_MAX_BANDS 16
+#define BAYER_BAND_ROWS 32
+
+uint8_t* camera_image_demosaic(const camera_image_t* image,
+                               const uint8_t* start,
+                               const camera_demosaic_config_t* config,
+                               uint32_t* width, uint32_t* height)
+{
+  const bayer_format_t* bayer = bayer_format(image->format);
+  if (!bayer || image->plane_count < 1) return NULL;
+  if (image->width < 4 || image->height < 4) return NULL;
+  bayer_band_t base = {
+    .bayer = bayer, .method = config->method, .pixel = config->pixel,
+    .source = start + image->planes[0].offset,
+    .stride = image->planes[0].stride,
+    .width = image->width, .height = image->height,
+  };
+  if (base.pixel != CAMERA_PIXEL_GRAY && base.pixel != CAMERA_PIXEL_RGBA) {
+    base.pixel = CAMERA_PIXEL_RGB;
+  }
+  if (base.stride == 0) {
+    switch (bayer->packing) {
+    case BAYER_8: base.stride = base.width; break;
+    case BAYER_16: base.stride = base.width * 2; break;
+    case BAYER_10P: base.stride = (base.width + 3) / 4 * 5; break;
+    case BAYER_12P: base.stride = (base.width + 1) / 2 * 3; break;
+    }
+  }
+  const bool binning = base.method == CAMERA_DEMOSAIC_BINNING;
+  base.out_width = binning ? base.width / 2 : base.width;
+  const uint32_t out_height = binning ? base.height / 2 : base.height;
+  base.out_height = out_height;
+  base.orientation = image->orientation;
+  const size_t size = (size_t) base.out_width * out_height * base.pixel;
+  if (image->planes[0].length &&
+      image->planes[0].length < (size_t) base.stride * base.height) {
+    return NULL;
+  }
+  base.out = malloc(size);
+  if (!base.out) return NULL;
+
+  size_t count = config->threads;
+  if (count == 0) {
+    const long online = sysconf(_SC_NPROCESSORS_ONLN);
+    count = online > 0 ? (size_t) online : 1;
+  }
+  if (count > BAYER_MAX_BANDS) count = BAYER_MAX_BANDS;
+  const size_t most = out_height / BAYER_BAND_ROWS;
+  if (count > most) count = most;
+  if (count == 0) count = 1;
+  bayer_band_t bands[BAYER_MAX_BANDS];
+  pthread_t threads[BAYER_MAX_BANDS];
+  bool started[BAYER_MAX_BANDS] = {false};
+  for (size_t i = 0; i < count; i++) {
+    bands[i] = base;
+    bands[i].y0 = out_height * i / count;
+    bands[i].y1 = out_height * (i + 1) / count;
+  }
+  for (size_t i = 1; i < count; i++) {
+    started[i] =
+      pthread_create(&threads[i], NULL, bayer_band_main, &bands[i]) == 0;
+  }
+  bayer_band_main(&bands[0]);
+  bool ok = true;
+  for (size_t i = 0; i < count; i++) {
+    if (i > 0) {
+      if (started[i]) pthread_join(threads[i], NULL);
+      else bayer_band_main(&bands[i]);
+    }
+    ok = ok && bands[i].ok;
+  }
+  if (!ok) {
+    free(base.out);
+    return NULL;
+  }
+  uint32_t oriented_width, oriented_height;
+  camera_orientation_size(base.orientation, base.out_width, out_height,
+                          &oriented_width, &oriented_height);
+  if (width) *width = oriented_width;
+  if (height) *height = oriented_height;
+  return base.out;
+}
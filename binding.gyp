@@ -2,10 +2,13 @@
 {
     "targets": [{
         "target_name": "v4l2camera", 
-        "sources": ["capture.c", "v4l2camera.cc"],
+        "sources": ["capture.c", "record.c", "realtime.c", "bayer.c", "mono.c",
+                    "png.c", "remap.c", "orient.c", "sync.c", "denoise.c",
+                    "v4l2camera.cc"],
         "include_dirs" : [
  	    "<!(node -e \"require('nan')\")"
 	],
+        "libraries": ["-lz", "-lm"],
         "cflags": ["-Wall", "-Wextra", "-pedantic", "-O3"],
         "xcode_settings": {
     	    "OTHER_CPLUSPLUSFLAGS": ["-std=c++14"],
@@ -87,15 +87,15 @@ int main(int argc, char* argv[])
     goto error;
   }
 
+  /* skip 5 frames for booting a cam */
+  camera->warmup = 5;
   if (!camera_start(camera)) goto error;
   struct timeval timeout;
   timeout.tv_sec = 1;
   timeout.tv_usec = 0;
-  /* skip 5 frames for booting a cam */
-  for (int i = 0; i < 5; i++) {
+  for (int i = 0; i <= 5 && camera->generation == 0; i++) {
     camera_frame(camera, timeout);
   }
-  camera_frame(camera, timeout);
 
   FILE* out = fopen(output, "w");
   if (strcmp(name, "YUYV") == 0) {
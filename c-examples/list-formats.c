@@ -35,11 +35,37 @@ int main(int argc, char* argv[])
   puts("[available formats]");
   camera_formats_t* formats = camera_formats_new(camera);
   for (size_t i = 0; i < formats->length; i++) {
+    camera_format_range_t* range = &formats->ranges[i];
     camera_format_name(formats->head[i].format, name);
+    if (range->size.type == CAMERA_RANGE_DISCRETE) {
+      printf("- [%s] w: %d, h: %d", 
+             name, formats->head[i].width, formats->head[i].height);
+    } else {
+      printf("- [%s] w: %d-%d (step %d), h: %d-%d (step %d)", name, 
+             range->size.min_width, range->size.max_width, 
+             range->size.step_width, range->size.min_height, 
+             range->size.max_height, range->size.step_height);
+    }
+    if (range->interval.type == CAMERA_RANGE_DISCRETE) {
+      printf(", fps: %d/%d\n",
+             formats->head[i].interval.denominator,
+             formats->head[i].interval.numerator);
+    } else {
+      printf(", fps: %d/%d-%d/%d\n",
+             range->interval.max.denominator, range->interval.max.numerator,
+             range->interval.min.denominator, range->interval.min.numerator);
+    }
+  }
+  
+  camera_mode_request_t request = {0};
+  request.min_fps = 15;
+  if (camera_formats_select(formats, &request, &format)) {
+    camera_format_name(format.format, name);
+    puts("[largest mode at 15fps or more]");
     printf("- [%s] w: %d, h: %d, fps: %d/%d\n",
-           name, formats->head[i].width, formats->head[i].height,
-           formats->head[i].interval.denominator,
-           formats->head[i].interval.numerator);
+           name, format.width, format.height,
+           format.interval.denominator,
+           format.interval.numerator);
   }
   camera_formats_delete(formats);
   camera_close(camera);
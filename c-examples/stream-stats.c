@@ -0,0 +1,83 @@
+/*
+ * streaming example: frames are read in their mapped buffers and released
+ * one frame later, as a consumer handing them to another stage would
+ * build:
+ *   make -f c-examples.makefile stream-stats
+ * usage:
+ *   ./stream-stats [device] [width] [height] [frames]
+ */
+
+#include "../capture.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+typedef struct {
+  size_t frames;
+  size_t limit;
+  uint32_t next_sequence;
+  size_t dropped;
+  uint64_t first;
+  uint64_t bytes;
+  const camera_stream_frame_t* previous;
+} stream_state_t;
+
+static void on_frame(camera_stream_t* stream,
+                     const camera_stream_frame_t* frame, void* pointer)
+{
+  stream_state_t* state = pointer;
+  if (!frame) {
+    fprintf(stderr, "stream ended: %s\n",
+            strerror(camera_stream_error(stream)));
+    return;
+  }
+  if (state->frames == 0) state->first = frame->frame.timestamp;
+  else if (frame->frame.sequence > state->next_sequence)
+    state->dropped += frame->frame.sequence - state->next_sequence;
+  state->next_sequence = frame->frame.sequence + 1;
+  state->bytes += camera_frame_size(&frame->frame);
+  state->frames++;
+  if (state->previous) camera_stream_release(stream, state->previous);
+  state->previous = frame;
+  if (state->frames == state->limit) {
+    printf("%zu frames, %zu dropped, %.1f fps, %.1f KiB per frame\n",
+           state->frames, state->dropped,
+           (state->frames - 1) * 1e9 /
+           (frame->frame.timestamp - state->first + 1),
+           state->bytes / 1024.0 / state->frames);
+    camera_stream_release(stream, frame);
+    state->previous = NULL;
+    camera_stream_stop(stream);
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  char* device = argc > 1 ? argv[1] : "/dev/video0";
+  uint32_t width = argc > 2 ? atoi(argv[2]) : 640;
+  uint32_t height = argc > 3 ? atoi(argv[3]) : 480;
+  size_t limit = argc > 4 ? (size_t) atoi(argv[4]) : 100;
+
+  camera_t* camera = camera_open(device);
+  if (!camera) {
+    fprintf(stderr, "[%s] %s\n", device, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  camera_format_t config = {0, width, height, {0, 0}};
+  if (!camera_config_set(camera, &config)) goto error;
+  camera->warmup = 5;
+
+  stream_state_t state = {0, limit ? limit : 1, 0, 0, 0, 0, NULL};
+  camera_stream_config_t stream_config = {false, 2000};
+  camera_stream_t* stream =
+    camera_stream_start(camera, on_frame, &state, &stream_config);
+  if (!stream) goto error;
+  camera_stream_run(stream);
+  if (!camera_stream_end(stream)) goto error;
+  camera_close(camera);
+  return 0;
+ error:
+  camera_close(camera);
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,73 @@
+/*
+ * synchronizer example: frames of two cameras matched by driver timestamp
+ * build:
+ *   make -f c-examples.makefile sync-stats
+ * usage:
+ *   ./sync-stats [device] [device] [tolerance ms] [sets]
+ */
+
+#include "../capture.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+static camera_t* open_started(const char* device)
+{
+  camera_t* camera = camera_open(device);
+  if (!camera) {
+    fprintf(stderr, "[%s] %s\n", device, strerror(errno));
+    return NULL;
+  }
+  camera_format_t config = {0, 640, 480, {0, 0}};
+  if (camera_config_set(camera, &config) && camera_start(camera))
+    return camera;
+  fprintf(stderr, "[%s] %s\n", device, strerror(errno));
+  camera_close(camera);
+  return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+  char* devices[2] = {
+    argc > 1 ? argv[1] : "/dev/video0", argc > 2 ? argv[2] : "/dev/video1",
+  };
+  double tolerance = argc > 3 ? atof(argv[3]) : 5;
+  size_t limit = argc > 4 ? (size_t) atoi(argv[4]) : 100;
+
+  camera_t* cameras[2] = {open_started(devices[0]), NULL};
+  if (cameras[0]) cameras[1] = open_started(devices[1]);
+  if (!cameras[1]) {
+    if (cameras[0]) camera_close(cameras[0]);
+    return EXIT_FAILURE;
+  }
+  camera_sync_config_t config = {tolerance * 1e6, 0};
+  camera_sync_t* sync = camera_sync_new(cameras, 2, &config);
+  int status = EXIT_SUCCESS;
+  camera_sync_set_t set;
+  for (size_t i = 0; sync && i < limit; i++) {
+    if (!camera_sync_wait(sync, &set, 2000)) {
+      fprintf(stderr, "sync: %s\n", strerror(errno));
+      status = EXIT_FAILURE;
+      break;
+    }
+    camera_sync_release(sync, &set);
+  }
+  if (sync) {
+    camera_sync_stats_t stats;
+    camera_sync_stats(sync, &stats);
+    printf("%llu sets, %llu frames dropped in %llu incomplete sets, "
+           "skew p50 %.3f ms max %.3f ms\n",
+           (unsigned long long) stats.sets,
+           (unsigned long long) stats.dropped,
+           (unsigned long long) stats.incomplete,
+           camera_histogram_quantile(&stats.skew, 0.5) / 1e6,
+           stats.skew.max / 1e6);
+    camera_sync_delete(sync);
+  } else {
+    status = EXIT_FAILURE;
+  }
+  camera_close(cameras[0]);
+  camera_close(cameras[1]);
+  return status;
+}
@@ -1,8 +1,11 @@
+#define _POSIX_C_SOURCE 200809L
 #include "capture.h"
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 
+#include <time.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
@@ -45,8 +48,20 @@ static int xioctl(int fd, unsigned long int request, void* arg)
   return -1;
 }
 
+uint64_t camera_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
 
+
+static bool camera_mplane(const camera_t* camera)
+{
+  return camera->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+}
+
 camera_t* camera_open(const char * device)
 {
   int fd = open(device, O_RDWR | O_NONBLOCK, 0);
@@ -54,22 +69,55 @@ camera_t* camera_open(const char * device)
   
   camera_t* camera = malloc(sizeof (camera_t));
   camera->fd = fd;
+  camera->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
   camera->initialized = false;
+  camera->streaming = false;
   camera->width = 0;
   camera->height = 0;
   camera->buffer_count = 0;
+  camera->plane_count = 1;
   camera->buffers = NULL;
   camera->head.length = 0;
   camera->head.start = NULL;
+  camera->head_capacity = 0;
+  memset(&camera->image, 0, sizeof camera->image);
+  camera->timestamp = 0;
+  camera->sequence = 0;
+  camera->generation = 0;
+  camera->config_latency = 0;
+  camera->warmup = 0;
+  camera->warming = 0;
+  camera->stream_on = 0;
+  camera->streams = 0;
+  camera_rate_init(&camera->rate, 0, 0);
+  camera->orientation = CAMERA_ORIENT_NONE;
+  camera->denoise = NULL;
+  camera->sinks = NULL;
+  camera_stats_reset(camera);
+  camera->formats = NULL;
+  camera->controls = NULL;
   camera->context.pointer = NULL;
   camera->context.log = &log_stderr;
+  
+  /* the buffer type is needed before init to enumerate formats */
+  struct v4l2_capability cap;
+  if (xioctl(camera->fd, VIDIOC_QUERYCAP, &cap) == 0) {
+    uint32_t caps = cap.capabilities & V4L2_CAP_DEVICE_CAPS ?
+      cap.device_caps : cap.capabilities;
+    if (!(caps & V4L2_CAP_VIDEO_CAPTURE) && 
+        (caps & V4L2_CAP_VIDEO_CAPTURE_MPLANE))
+      camera->type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  }
   return camera;
 }
 
-static void free_buffers(camera_t* camera, size_t count)
+static void free_buffers(camera_t* camera)
 {
-  for (size_t i = 0; i < count; i++) {
-    munmap(camera->buffers[i].start, camera->buffers[i].length);
+  const size_t count = camera->buffer_count * camera->plane_count;
+  for (size_t i = 0; camera->buffers && i < count; i++) {
+    camera_buffer_t* buffer = &camera->buffers[i];
+    if (buffer->start == NULL || buffer->start == MAP_FAILED) continue;
+    munmap(buffer->start, buffer->length);
   }
   free(camera->buffers);
   camera->buffers = NULL;
@@ -80,17 +128,19 @@ static bool camera_init(camera_t* camera) {
   struct v4l2_capability cap;
   if (xioctl(camera->fd, VIDIOC_QUERYCAP, &cap) == -1)
     return error(camera, "VIDIOC_QUERYCAP");
-  if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE))
+  uint32_t caps = cap.capabilities & V4L2_CAP_DEVICE_CAPS ?
+    cap.device_caps : cap.capabilities;
+  if (!(caps & (V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_VIDEO_CAPTURE_MPLANE)))
     return failure(camera, "no capture");
-  if (!(cap.capabilities & V4L2_CAP_STREAMING))
+  if (!(caps & V4L2_CAP_STREAMING))
     return failure(camera, "no streaming");
 
   struct v4l2_cropcap cropcap;
   memset(&cropcap, 0, sizeof cropcap);
-  cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  cropcap.type = camera->type;
   if (xioctl(camera->fd, VIDIOC_CROPCAP, &cropcap) == 0) {
     struct v4l2_crop crop;
-    crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    crop.type = camera->type;
     crop.c = cropcap.defrect;
     if (xioctl(camera->fd, VIDIOC_S_CROP, &crop) == -1) {
       // cropping not supported
@@ -100,60 +150,233 @@ static bool camera_init(camera_t* camera) {
   return true;
 }
 
-static bool camera_buffer_prepare(camera_t* camera)
+/* chroma planes of the planar formats packed in a single buffer */
+static void camera_image_layout(camera_image_t* image)
+{
+  uint32_t hdiv = 0, vdiv = 0;
+  size_t count = 3;
+  switch (image->format) {
+  case V4L2_PIX_FMT_NV12: case V4L2_PIX_FMT_NV21:
+    hdiv = 1; vdiv = 2; count = 2;
+    break;
+  case V4L2_PIX_FMT_NV16: case V4L2_PIX_FMT_NV61:
+    hdiv = 1; vdiv = 1; count = 2;
+    break;
+  case V4L2_PIX_FMT_YUV420: case V4L2_PIX_FMT_YVU420:
+    hdiv = 2; vdiv = 2;
+    break;
+  case V4L2_PIX_FMT_YUV422P:
+    hdiv = 2; vdiv = 1;
+    break;
+  default:
+    return;
+  }
+  const uint32_t stride = image->planes[0].stride;
+  const size_t luma = (size_t) stride * image->height;
+  const size_t chroma = (size_t) (stride / hdiv) * (image->height / vdiv);
+  if (luma + chroma * (count - 1) > image->planes[0].length) return;
+  image->plane_count = count;
+  for (size_t i = 0; i < count; i++) {
+    image->planes[i].offset = i == 0 ? 0 : luma + chroma * (i - 1);
+    image->planes[i].length = i == 0 ? luma : chroma;
+    image->planes[i].stride = i == 0 ? stride : stride / hdiv;
+  }
+}
+
+/* resolves the DEFAULT encodings the way the driver would */
+static void camera_image_colorimetry(camera_image_t* image, 
+                                     uint32_t colorspace, uint32_t ycbcr_enc,
+                                     uint32_t quantization)
+{
+  image->colorspace = colorspace;
+#ifdef V4L2_MAP_YCBCR_ENC_DEFAULT
+  if (ycbcr_enc == V4L2_YCBCR_ENC_DEFAULT)
+    ycbcr_enc = V4L2_MAP_YCBCR_ENC_DEFAULT(colorspace);
+  if (quantization == V4L2_QUANTIZATION_DEFAULT)
+    quantization = 
+      V4L2_MAP_QUANTIZATION_DEFAULT(false, colorspace, ycbcr_enc);
+  image->ycbcr_enc = ycbcr_enc;
+  image->quantization = quantization;
+#else
+  (void) ycbcr_enc; (void) quantization;
+#endif
+}
+
+static void camera_vformat_image(const camera_t* camera, 
+                                 const struct v4l2_format* vformat,
+                                 camera_image_t* image)
 {
+  memset(image, 0, sizeof *image);
+  if (camera_mplane(camera)) {
+    const struct v4l2_pix_format_mplane* pix = &vformat->fmt.pix_mp;
+    image->format = pix->pixelformat;
+    image->width = pix->width;
+    image->height = pix->height;
+    image->plane_count = pix->num_planes < CAMERA_MAX_PLANES ? 
+      pix->num_planes : CAMERA_MAX_PLANES;
+    size_t offset = 0;
+    for (size_t i = 0; i < image->plane_count; i++) {
+      image->planes[i].offset = offset;
+      image->planes[i].length = pix->plane_fmt[i].sizeimage;
+      image->planes[i].stride = pix->plane_fmt[i].bytesperline;
+      offset += pix->plane_fmt[i].sizeimage;
+    }
+#ifdef V4L2_MAP_YCBCR_ENC_DEFAULT
+    camera_image_colorimetry(image, pix->colorspace, pix->ycbcr_enc, 
+                             pix->quantization);
+#else
+    camera_image_colorimetry(image, pix->colorspace, 0, 0);
+#endif
+  } else {
+    const struct v4l2_pix_format* pix = &vformat->fmt.pix;
+    image->format = pix->pixelformat;
+    image->width = pix->width;
+    image->height = pix->height;
+    image->plane_count = 1;
+    image->planes[0].length = pix->sizeimage;
+    image->planes[0].stride = pix->bytesperline;
+    camera_image_layout(image);
+#ifdef V4L2_MAP_YCBCR_ENC_DEFAULT
+    /* the extended fields are only valid with the magic in priv */
+    const bool extended = pix->priv == V4L2_PIX_FMT_PRIV_MAGIC;
+    camera_image_colorimetry(image, pix->colorspace, 
+                             extended ? pix->ycbcr_enc : 0,
+                             extended ? pix->quantization : 0);
+#else
+    camera_image_colorimetry(image, pix->colorspace, 0, 0);
+#endif
+  }
+  image->orientation = camera->orientation;
+}
+
+static void camera_buf_init(const camera_t* camera, struct v4l2_buffer* buf,
+                            struct v4l2_plane* planes, uint32_t index)
+{
+  memset(buf, 0, sizeof *buf);
+  buf->type = camera->type;
+  buf->memory = V4L2_MEMORY_MMAP;
+  buf->index = index;
+  if (camera_mplane(camera)) {
+    memset(planes, 0, sizeof (struct v4l2_plane) * VIDEO_MAX_PLANES);
+    buf->m.planes = planes;
+    buf->length = VIDEO_MAX_PLANES;
+  }
+}
+
+static bool 
+camera_buffer_request(camera_t* camera, const size_t* min_lengths)
+{
+#ifdef VIDIOC_CREATE_BUFS
+  if (min_lengths) {
+    /* sized for the largest format seen, so later switches may reuse */
+    struct v4l2_create_buffers create;
+    memset(&create, 0, sizeof create);
+    create.count = 4;
+    create.memory = V4L2_MEMORY_MMAP;
+    create.format.type = camera->type;
+    if (xioctl(camera->fd, VIDIOC_G_FMT, &create.format) == 0) {
+      if (camera_mplane(camera)) {
+        struct v4l2_pix_format_mplane* pix = &create.format.fmt.pix_mp;
+        for (size_t i = 0; i < pix->num_planes && i < CAMERA_MAX_PLANES; 
+             i++) {
+          if (pix->plane_fmt[i].sizeimage < min_lengths[i])
+            pix->plane_fmt[i].sizeimage = min_lengths[i];
+        }
+      } else if (create.format.fmt.pix.sizeimage < min_lengths[0]) {
+        create.format.fmt.pix.sizeimage = min_lengths[0];
+      }
+      if (xioctl(camera->fd, VIDIOC_CREATE_BUFS, &create) == 0 &&
+          create.count > 0) {
+        camera->buffer_count = create.count;
+        return true;
+      }
+    }
+  }
+#else
+  (void) min_lengths;
+#endif
   struct v4l2_requestbuffers req;
   memset(&req, 0, sizeof req);
   req.count = 4;
-  req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  req.type = camera->type;
   req.memory = V4L2_MEMORY_MMAP;
   if (xioctl(camera->fd, VIDIOC_REQBUFS, &req) == -1)
     return error(camera, "VIDIOC_REQBUFS");
   camera->buffer_count = req.count;
-  camera->buffers = calloc(req.count, sizeof (camera_buffer_t));
+  return true;
+}
+
+static bool 
+camera_buffer_prepare(camera_t* camera, const size_t* min_lengths)
+{
+  if (!camera_buffer_request(camera, min_lengths)) return false;
+  const size_t planes = camera->plane_count;
+  camera->buffers = 
+    calloc(camera->buffer_count * planes, sizeof (camera_buffer_t));
+  if (!camera->buffers) {
+    camera->buffer_count = 0;
+    return error(camera, "calloc");
+  }
 
-  size_t buf_max = 0;
+  size_t plane_max[VIDEO_MAX_PLANES] = {0};
   for (size_t i = 0; i < camera->buffer_count; i++) {
     struct v4l2_buffer buf;
-    memset(&buf, 0, sizeof buf);
-    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buf.memory = V4L2_MEMORY_MMAP;
-    buf.index = i;
+    struct v4l2_plane vplanes[VIDEO_MAX_PLANES];
+    camera_buf_init(camera, &buf, vplanes, i);
     if (xioctl(camera->fd, VIDIOC_QUERYBUF, &buf) == -1) {
-      free_buffers(camera, i);
+      free_buffers(camera);
       return error(camera, "VIDIOC_QUERYBUF");
     }
-    if (buf.length > buf_max) buf_max = buf.length;
-    camera->buffers[i].length = buf.length;
-    camera->buffers[i].start = 
-      mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, 
-           camera->fd, buf.m.offset);
-    if (camera->buffers[i].start == MAP_FAILED) {
-      free_buffers(camera, i);
-      return error(camera, "mmap");
+    for (size_t p = 0; p < planes; p++) {
+      size_t length = camera_mplane(camera) ? 
+        vplanes[p].length : buf.length;
+      off_t offset = camera_mplane(camera) ? 
+        vplanes[p].m.mem_offset : buf.m.offset;
+      camera_buffer_t* buffer = &camera->buffers[i * planes + p];
+      if (length > plane_max[p]) plane_max[p] = length;
+      buffer->length = length;
+      buffer->start = 
+        mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, 
+             camera->fd, offset);
+      if (buffer->start == MAP_FAILED) {
+        free_buffers(camera);
+        return error(camera, "mmap");
+      }
     }
   }
-  camera->head.start = calloc(buf_max, sizeof (uint8_t));
+  size_t head_max = 0;
+  for (size_t p = 0; p < planes; p++) head_max += plane_max[p];
+  camera->head.start = calloc(head_max, sizeof (uint8_t));
+  camera->head_capacity = camera->head.start ? head_max : 0;
   return true;
 }
 
 static void camera_buffer_finish(camera_t* camera)
 {
-  free_buffers(camera, camera->buffer_count);
+  free_buffers(camera);
   free(camera->head.start);
   camera->head.length = 0;
   camera->head.start = NULL;
+  camera->head_capacity = 0;
 }
 
 static bool camera_load_settings(camera_t* camera)
 {
   struct v4l2_format format;
   memset(&format, 0, sizeof format);
-  format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  format.type = camera->type;
   if (xioctl(camera->fd, VIDIOC_G_FMT, &format) == -1)
     return error(camera, "VIDIOC_G_FMT");
-  camera->width = format.fmt.pix.width;
-  camera->height = format.fmt.pix.height;
+  camera_vformat_image(camera, &format, &camera->image);
+  camera->width = camera->image.width;
+  camera->height = camera->image.height;
+  if (camera_mplane(camera)) {
+    if (format.fmt.pix_mp.num_planes > CAMERA_MAX_PLANES)
+      return failure(camera, "too many planes");
+    camera->plane_count = format.fmt.pix_mp.num_planes;
+  } else {
+    camera->plane_count = 1;
+  }
   return true;
 }
 
@@ -164,46 +387,70 @@ static bool camera_load(camera_t* camera)
   }
   if (camera->buffer_count == 0) {
     if (!camera_load_settings(camera)) return false;
-    if (!camera_buffer_prepare(camera)) return false;
+    if (!camera_buffer_prepare(camera, NULL)) return false;
   }
   return true;
 }
 
-bool camera_stop(camera_t* camera)
+static bool camera_stream_off(camera_t* camera)
 {
-  enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  enum v4l2_buf_type type = camera->type;
   if (xioctl(camera->fd, VIDIOC_STREAMOFF, &type) == -1) 
     return error(camera, "VIDIOC_STREAMOFF");
+  camera->streaming = false;
+  return true;
+}
+
+static bool camera_stream_on(camera_t* camera)
+{
+  for (size_t i = 0; i < camera->buffer_count; i++) {
+    struct v4l2_buffer buf;
+    struct v4l2_plane planes[VIDEO_MAX_PLANES];
+    camera_buf_init(camera, &buf, planes, i);
+    if (xioctl(camera->fd, VIDIOC_QBUF, &buf) == -1) 
+      return error(camera, "VIDIOC_QBUF");
+  }
+  
+  enum v4l2_buf_type type = camera->type;
+  if (xioctl(camera->fd, VIDIOC_STREAMON, &type) == -1) 
+    return error(camera, "VIDIOC_STREAMON");
+  camera->streaming = true;
+  camera->streams++;
+  camera->warming = camera->warmup;
+  camera->stream_on = camera_now();
+  return true;
+}
+
+static bool camera_buffer_release(camera_t* camera)
+{
   camera_buffer_finish(camera);
   
   struct v4l2_requestbuffers req;
   memset(&req, 0, sizeof req);
   req.count = 0;
-  req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  req.type = camera->type;
   req.memory = V4L2_MEMORY_MMAP;
   if (xioctl(camera->fd, VIDIOC_REQBUFS, &req) == -1)
     return error(camera, "VIDIOC_REQBUFS 0");
   return true;
 }
 
+bool camera_stop(camera_t* camera)
+{
+  if (!camera_stream_off(camera)) return false;
+  return camera_buffer_release(camera);
+}
+
+bool camera_pause(camera_t* camera)
+{
+  if (!camera->streaming) return true;
+  return camera_stream_off(camera);
+}
+
 bool camera_start(camera_t* camera)
 {
   if (!camera_load(camera)) return false;
-
-  for (size_t i = 0; i < camera->buffer_count; i++) {
-    struct v4l2_buffer buf;
-    memset(&buf, 0, sizeof buf);
-    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buf.memory = V4L2_MEMORY_MMAP;
-    buf.index = i;
-    if (xioctl(camera->fd, VIDIOC_QBUF, &buf) == -1) 
-      return error(camera, "VIDIOC_QBUF");
-  }
-  
-  enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  if (xioctl(camera->fd, VIDIOC_STREAMON, &type) == -1) 
-    return error(camera, "VIDIOC_STREAMON");
-  return true;
+  return camera_stream_on(camera);
 }
 
 
@@ -212,6 +459,13 @@ bool camera_close(camera_t* camera)
   if (camera->buffer_count > 0) {
     camera_stop(camera);
   }
+  camera_formats_invalidate(camera);
+  camera_controls_invalidate(camera);
+  while (camera->sinks) {
+    camera_sink_t* sink = camera->sinks;
+    camera->sinks = sink->next;
+    free(sink);
+  }
   for (int i = 0; i < 10; i++) {
     if (close(camera->fd) != -1) break;
   }
@@ -221,55 +475,471 @@ bool camera_close(camera_t* camera)
 
 
 //[[capturing]
-bool camera_capture(camera_t* camera)
+bool camera_dequeue(camera_t* camera, camera_frame_t* frame, int* index)
 {
   struct v4l2_buffer buf;
-  memset(&buf, 0, sizeof buf);
-  buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  buf.memory = V4L2_MEMORY_MMAP;
-  if (xioctl(camera->fd, VIDIOC_DQBUF, &buf) == -1) return false;
-  memcpy(camera->head.start, camera->buffers[buf.index].start, buf.bytesused);
-  camera->head.length = buf.bytesused;
-  if (xioctl(camera->fd, VIDIOC_QBUF, &buf) == -1) return false;
+  struct v4l2_plane vplanes[VIDEO_MAX_PLANES];
+  camera_buf_init(camera, &buf, vplanes, 0);
+  *index = -1;
+  uint64_t begin = camera_now();
+  if (xioctl(camera->fd, VIDIOC_DQBUF, &buf) == -1) {
+    camera->stats.errors++;
+    return false;
+  }
+  const uint64_t dequeued = camera_now();
+  camera_histogram_record(&camera->stats.stages[CAMERA_STAGE_DQBUF], 
+                          dequeued - begin);
+  if (camera->warming > 0) {
+    camera->warming--;
+    camera->stats.skipped++;
+    if (xioctl(camera->fd, VIDIOC_QBUF, &buf) == -1) return false;
+    return true;
+  }
+  if (camera->stream_on) {
+    camera_histogram_record(&camera->stats.stages[CAMERA_STAGE_START], 
+                            dequeued - camera->stream_on);
+    camera->stream_on = 0;
+  }
+  const camera_buffer_t* buffers = 
+    &camera->buffers[buf.index * camera->plane_count];
+  if (camera_mplane(camera)) {
+    frame->plane_count = camera->plane_count;
+    for (size_t p = 0; p < frame->plane_count; p++) {
+      const uint32_t skip = vplanes[p].data_offset < vplanes[p].bytesused ?
+        vplanes[p].data_offset : vplanes[p].bytesused;
+      frame->planes[p].start = buffers[p].start + skip;
+      frame->planes[p].length = vplanes[p].bytesused - skip;
+    }
+    frame->start = frame->planes[0].start;
+    frame->length = frame->planes[0].length;
+  } else {
+    frame->start = buffers[0].start;
+    frame->length = buf.bytesused;
+    camera_frame_packed(frame);
+  }
+  frame->timestamp = 
+    (uint64_t) buf.timestamp.tv_sec * 1000000000 + 
+    (uint64_t) buf.timestamp.tv_usec * 1000;
+  frame->sequence = buf.sequence;
+  if ((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == 
+      V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC && frame->timestamp <= dequeued) {
+    camera_histogram_record(&camera->stats.stages[CAMERA_STAGE_WAIT],
+                            dequeued - frame->timestamp);
+  }
+  camera->stats.frames++;
+  camera->stats.bytes += camera_frame_size(frame);
+  camera->stats.dequeued = dequeued;
+  if (camera->sinks) {
+    begin = camera_now();
+    for (camera_sink_t* sink = camera->sinks; sink; sink = sink->next) {
+      sink->func(frame, sink->pointer);
+    }
+    camera_stage_record(camera, CAMERA_STAGE_SINKS, begin);
+  }
+  *index = buf.index;
   return true;
 }
 
+bool camera_requeue(camera_t* camera, int index)
+{
+  struct v4l2_buffer buf;
+  struct v4l2_plane vplanes[VIDEO_MAX_PLANES];
+  camera_buf_init(camera, &buf, vplanes, index);
+  return xioctl(camera->fd, VIDIOC_QBUF, &buf) != -1;
+}
 
-static inline int minmax(int min, int v, int max)
+void camera_retrieve(camera_t* camera, const camera_frame_t* frame)
 {
-  return (v < min) ? min : (max < v) ? max : v;
+  const uint64_t begin = camera_now();
+  size_t offset = 0;
+  for (size_t p = 0; p < frame->plane_count; p++) {
+    memcpy(camera->head.start + offset, frame->planes[p].start, 
+           frame->planes[p].length);
+    if (camera_mplane(camera)) {
+      camera->image.planes[p].offset = offset;
+      camera->image.planes[p].length = frame->planes[p].length;
+    }
+    offset += frame->planes[p].length;
+  }
+  camera_stage_record(camera, CAMERA_STAGE_COPY, begin);
+  if (camera->image.plane_count == 1) 
+    camera->image.planes[0].length = offset;
+  camera->head.length = offset;
+  if (camera->denoise) {
+    const uint64_t filtered = camera_now();
+    camera_denoise_frame(camera->denoise, &camera->image, frame->sequence,
+                         camera->head.start, offset);
+    camera_stage_record(camera, CAMERA_STAGE_DENOISE, filtered);
+  }
+  camera->timestamp = frame->timestamp;
+  camera->sequence = frame->sequence;
+  camera->generation++;
+}
+
+bool camera_grab(camera_t* camera, bool retrieve)
+{
+  camera_frame_t frame;
+  int index;
+  if (!camera_dequeue(camera, &frame, &index)) return false;
+  if (index < 0) return true;
+  if (retrieve && 
+      camera_rate_take(&camera->rate, camera_frame_time(camera, &frame))) {
+    camera_retrieve(camera, &frame);
+  }
+  return camera_requeue(camera, index);
+}
+
+bool camera_capture(camera_t* camera)
+{
+  return camera_grab(camera, true);
+}
+
+void camera_rate_init(camera_rate_t* rate, double target_fps, uint32_t every)
+{
+  memset(rate, 0, sizeof *rate);
+  rate->target_fps = target_fps > 0 ? target_fps : 0;
+  rate->every = every;
+}
+
+bool camera_rate_take(camera_rate_t* rate, uint64_t timestamp)
+{
+  if (rate->last && timestamp > rate->last) {
+    const uint64_t delta = timestamp - rate->last;
+    rate->period = rate->period ? (rate->period * 7 + delta) / 8 : delta;
+  }
+  rate->last = timestamp;
+  bool take = true;
+  if (rate->every > 1) take = rate->count++ % rate->every == 0;
+  if (take && rate->target_fps > 0) {
+    const uint64_t interval = 1000000000 / rate->target_fps;
+    if (rate->due && timestamp + rate->period / 2 < rate->due) {
+      take = false;
+    } else if (rate->due && timestamp < rate->due + interval) {
+      rate->due += interval;
+    } else {
+      /* first frame, or fallen behind by a whole interval */
+      rate->due = timestamp + interval;
+    }
+  }
+  if (take) rate->taken++;
+  else rate->dropped++;
+  return take;
+}
+
+bool camera_sink_add(camera_t* camera, camera_sink_func_t func, void* pointer)
+{
+  camera_sink_t* sink = malloc(sizeof (camera_sink_t));
+  if (!sink) return error(camera, "malloc");
+  sink->func = func;
+  sink->pointer = pointer;
+  sink->next = camera->sinks;
+  camera->sinks = sink;
+  return true;
+}
+
+void 
+camera_sink_remove(camera_t* camera, camera_sink_func_t func, void* pointer)
+{
+  for (camera_sink_t** link = &camera->sinks; *link; link = &(*link)->next) {
+    camera_sink_t* sink = *link;
+    if (sink->func == func && sink->pointer == pointer) {
+      *link = sink->next;
+      free(sink);
+      return;
+    }
+  }
+}
+
+
+//[[statistics]
+static inline unsigned histogram_bucket(uint64_t value)
+{
+  if (value < 16) return value;
+  int msb = 63 - __builtin_clzll(value);
+  if (msb > 39) return CAMERA_HISTOGRAM_BUCKETS - 1;
+  return (msb - 3) * 16 + ((value >> (msb - 4)) & 15);
+}
+
+static inline uint64_t histogram_low(unsigned bucket)
+{
+  if (bucket < 16) return bucket;
+  const unsigned msb = bucket / 16 + 3;
+  return (uint64_t) (16 + bucket % 16) << (msb - 4);
+}
+
+void camera_histogram_record(camera_histogram_t* histogram, uint64_t value)
+{
+  if (histogram->count == 0 || value < histogram->min) histogram->min = value;
+  if (value > histogram->max) histogram->max = value;
+  histogram->count++;
+  histogram->sum += value;
+  histogram->buckets[histogram_bucket(value)]++;
+}
+
+uint64_t camera_histogram_quantile(const camera_histogram_t* histogram, 
+                                   double quantile)
+{
+  if (histogram->count == 0) return 0;
+  if (quantile <= 0) return histogram->min;
+  if (quantile >= 1) return histogram->max;
+  const uint64_t rank = (uint64_t) (quantile * histogram->count);
+  uint64_t seen = 0;
+  for (unsigned i = 0; i < CAMERA_HISTOGRAM_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if (seen <= rank) continue;
+    if (i == CAMERA_HISTOGRAM_BUCKETS - 1) return histogram->max;
+    const uint64_t low = histogram_low(i), high = histogram_low(i + 1);
+    uint64_t value = low + (high - low) / 2;
+    if (value < histogram->min) value = histogram->min;
+    if (value > histogram->max) value = histogram->max;
+    return value;
+  }
+  return histogram->max;
+}
+
+void camera_stats_reset(camera_t* camera)
+{
+  memset(&camera->stats, 0, sizeof camera->stats);
+}
+
+
+/*
+ * YCbCr to RGB by table lookup: R = Y' + Cr * 2(1 - Kr),
+ * G = Y' - Cb * 2Kb(1 - Kb)/Kg - Cr * 2Kr(1 - Kr)/Kg, B = Y' + Cb * 2(1 - Kb)
+ * with the range scaling folded in, 16.16 fixed point; one table per 
+ * matrix and range is built once, so every combination costs the same
+ */
+typedef struct {
+  int32_t y[256]; /* incl. rounding */
+  int32_t rv[256];
+  int32_t gu[256];
+  int32_t gv[256];
+  int32_t bu[256];
+} yuv_table_t;
+static const double yuv_k[CAMERA_MATRIX_COUNT][2] = { /* Kr, Kb */
+  {0.299, 0.114}, {0.2126, 0.0722}, {0.2627, 0.0593},
+};
+static yuv_table_t yuv_tables[CAMERA_MATRIX_COUNT][2]; /* [matrix][full] */
+static pthread_once_t yuv_tables_once = PTHREAD_ONCE_INIT;
+
+static inline int32_t fixed16(double v)
+{
+  return (int32_t) (v < 0 ? v * 65536 - 0.5 : v * 65536 + 0.5);
 }
-static inline uint8_t yuv2r(int y, int u, int v)
+static void yuv_tables_init(void)
 {
-  (void) u; return minmax(0, (y + 359 * v) >> 8, 255);
+  for (int m = 0; m < CAMERA_MATRIX_COUNT; m++) {
+    const double kr = yuv_k[m][0], kb = yuv_k[m][1], kg = 1 - kr - kb;
+    for (int full = 0; full < 2; full++) {
+      yuv_table_t* table = &yuv_tables[m][full];
+      const double ys = full ? 1.0 : 255.0 / 219.0;
+      const double cs = full ? 1.0 : 255.0 / 224.0;
+      const int yoff = full ? 0 : 16;
+      for (int i = 0; i < 256; i++) {
+        const double c = (i - 128) * cs;
+        table->y[i] = fixed16((i - yoff) * ys) + (1 << 15);
+        table->rv[i] = fixed16(c * 2 * (1 - kr));
+        table->gu[i] = fixed16(-c * 2 * kb * (1 - kb) / kg);
+        table->gv[i] = fixed16(-c * 2 * kr * (1 - kr) / kg);
+        table->bu[i] = fixed16(c * 2 * (1 - kb));
+      }
+    }
+  }
 }
-static inline uint8_t yuv2g(int y, int u, int v)
+camera_matrix_t camera_image_matrix(const camera_image_t* image)
 {
-  return minmax(0, (y + 88 * v - 183 * u) >> 8, 255);
+#ifdef V4L2_MAP_YCBCR_ENC_DEFAULT
+  switch (image->ycbcr_enc) {
+  case V4L2_YCBCR_ENC_709: case V4L2_YCBCR_ENC_XV709:
+  case V4L2_YCBCR_ENC_SMPTE240M:
+    return CAMERA_MATRIX_BT709;
+  case V4L2_YCBCR_ENC_BT2020: case V4L2_YCBCR_ENC_BT2020_CONST_LUM:
+    return CAMERA_MATRIX_BT2020;
+  }
+#else
+  (void) image;
+#endif
+  return CAMERA_MATRIX_BT601;
 }
-static inline uint8_t yuv2b(int y, int u, int v)
+static const yuv_table_t* yuv_table(const camera_image_t* image)
 {
-  (void) v; return minmax(0, (y + 454 * u) >> 8, 255);
+  pthread_once(&yuv_tables_once, yuv_tables_init);
+  bool full = image->colorspace == V4L2_COLORSPACE_JPEG;
+#ifdef V4L2_MAP_YCBCR_ENC_DEFAULT
+  full = image->quantization == V4L2_QUANTIZATION_FULL_RANGE;
+#endif
+  return &yuv_tables[camera_image_matrix(image)][full];
 }
+
+static inline uint8_t clamp8(int32_t v)
+{
+  return v < 0 ? 0 : 255 < v ? 255 : v;
+}
+static inline void 
+yuv2rgb(const yuv_table_t* table, int y, int u, int v, uint8_t* out)
+{
+  const int32_t luma = table->y[y];
+  out[0] = clamp8((luma + table->rv[v]) >> 16);
+  out[1] = clamp8((luma + table->gu[u] + table->gv[v]) >> 16);
+  out[2] = clamp8((luma + table->bu[u]) >> 16);
+}
+
 uint8_t* yuyv2rgb(const uint8_t* yuyv, uint32_t width, uint32_t height)
 {
+  camera_image_t image;
+  memset(&image, 0, sizeof image);
+  image.format = V4L2_PIX_FMT_YUYV;
+  image.width = width;
+  image.height = height;
+  image.plane_count = 1;
+  image.planes[0].length = (size_t) width * height * 2;
+  image.planes[0].stride = width * 2;
+  camera_image_colorimetry(&image, V4L2_COLORSPACE_JPEG, 0, 0);
+  return camera_image_rgb(&image, yuyv);
+}
+
+void camera_yuv_pixels(const camera_image_t* image, const uint8_t* yuv,
+                       size_t count, camera_pixel_t pixel, uint8_t* out)
+{
+  const yuv_table_t* table = yuv_table(image);
+  switch (pixel) {
+  case CAMERA_PIXEL_GRAY:
+    for (size_t i = 0; i < count; i++) {
+      out[i] = clamp8(table->y[yuv[i * 3]] >> 16);
+    }
+    break;
+  case CAMERA_PIXEL_RGBA:
+    for (size_t i = 0; i < count; i++) {
+      const uint8_t* s = yuv + i * 3;
+      yuv2rgb(table, s[0], s[1], s[2], out + i * 4);
+      out[i * 4 + 3] = 255;
+    }
+    break;
+  default:
+    for (size_t i = 0; i < count; i++) {
+      const uint8_t* s = yuv + i * 3;
+      yuv2rgb(table, s[0], s[1], s[2], out + i * 3);
+    }
+  }
+}
+
+static uint8_t* packed_rgb(const camera_image_t* image, const uint8_t* start)
+{
+  const uint32_t width = image->width, height = image->height;
+  const uint32_t stride = image->planes[0].stride ? 
+    image->planes[0].stride : width * 3;
+  if (image->planes[0].length && 
+      image->planes[0].length < (size_t) stride * height) return NULL;
+  const size_t r = image->format == V4L2_PIX_FMT_RGB24 ? 0 : 2;
+  uint8_t* rgb = malloc((size_t) width * height * 3);
+  if (!rgb) return NULL;
+  camera_orient_t orient;
+  if (!camera_orient_init(&orient, image->orientation, width, height, 3, 
+                          rgb)) {
+    free(rgb);
+    return NULL;
+  }
+  const uint8_t* plane = start + image->planes[0].offset;
+  for (uint32_t i = 0; i < height; i++) {
+    const uint8_t* row = plane + (size_t) i * stride;
+    uint8_t* out = camera_orient_row(&orient, i);
+    for (uint32_t j = 0; j < width; j++) {
+      out[j * 3] = row[j * 3 + r];
+      out[j * 3 + 1] = row[j * 3 + 1];
+      out[j * 3 + 2] = row[j * 3 + 2 - r];
+    }
+  }
+  camera_orient_end(&orient);
+  return rgb;
+}
+
+/* packed, planar and semi-planar YUV read through the plane layout; 
+ * Bayer goes to bayer.c and single channel formats to mono.c; rows are
+ * placed in the image's orientation as they are converted */
+uint8_t* camera_image_rgb(const camera_image_t* image, const uint8_t* start)
+{
+  const camera_plane_t* planes = image->planes;
+  size_t u = 1, v = 2, ystep = 1, step = 1, needed = 3;
+  uint32_t hdiv = 2, vdiv = 2;
+  switch (image->format) {
+  case V4L2_PIX_FMT_YUYV:
+    u = 0; v = 0; ystep = 2; step = 4; vdiv = 1; needed = 1;
+    break;
+  case V4L2_PIX_FMT_NV12: case V4L2_PIX_FMT_NV12M:
+  case V4L2_PIX_FMT_NV21: case V4L2_PIX_FMT_NV21M:
+    v = 1; step = 2; needed = 2;
+    break;
+  case V4L2_PIX_FMT_NV16: case V4L2_PIX_FMT_NV16M:
+  case V4L2_PIX_FMT_NV61: case V4L2_PIX_FMT_NV61M:
+    v = 1; step = 2; vdiv = 1; needed = 2;
+    break;
+  case V4L2_PIX_FMT_YUV420: case V4L2_PIX_FMT_YUV420M:
+    break;
+  case V4L2_PIX_FMT_YVU420: case V4L2_PIX_FMT_YVU420M:
+    u = 2; v = 1;
+    break;
+  case V4L2_PIX_FMT_YUV422P:
+#ifdef V4L2_PIX_FMT_YUV422M
+  case V4L2_PIX_FMT_YUV422M:
+#endif
+    vdiv = 1;
+    break;
+  case V4L2_PIX_FMT_RGB24: case V4L2_PIX_FMT_BGR24:
+    return packed_rgb(image, start);
+  default:
+    if (camera_format_bayer(image->format)) {
+      const camera_demosaic_config_t config = {
+        CAMERA_DEMOSAIC_BILINEAR, CAMERA_PIXEL_RGB, 0,
+      };
+      return camera_image_demosaic(image, start, &config, NULL, NULL);
+    }
+    if (camera_format_mono(image->format)) {
+      const camera_normalize_config_t config = {
+        CAMERA_SCALE_MINMAX, 0, 0, false, 
+        camera_colormap(CAMERA_COLORMAP_GRAY),
+      };
+      return camera_image_normalize(image, start, &config, NULL);
+    }
+    return NULL;
+  }
+  if (image->plane_count < needed) return NULL;
+  const uint8_t* yp = start + planes[0].offset;
+  const uint8_t* up = start + planes[u].offset;
+  const uint8_t* vp = start + planes[v].offset;
+  switch (image->format) {
+  case V4L2_PIX_FMT_YUYV:
+    up += 1; vp += 3;
+    break;
+  case V4L2_PIX_FMT_NV21: case V4L2_PIX_FMT_NV21M:
+  case V4L2_PIX_FMT_NV61: case V4L2_PIX_FMT_NV61M:
+    up++;
+    break;
+  default:
+    if (step == 2) vp++;
+  }
+  const yuv_table_t* table = yuv_table(image);
+  const size_t width = image->width, height = image->height;
+  const uint32_t ystride = planes[0].stride ? planes[0].stride : 
+    width * ystep;
+  const uint32_t cstride = planes[u].stride ? planes[u].stride : ystride;
   uint8_t* rgb = calloc(width * height * 3, sizeof (uint8_t));
+  if (!rgb) return NULL;
+  camera_orient_t orient;
+  if (!camera_orient_init(&orient, image->orientation, width, height, 3, 
+                          rgb)) {
+    free(rgb);
+    return NULL;
+  }
   for (size_t i = 0; i < height; i++) {
-    for (size_t j = 0; j < width; j += 2) {
-      size_t index = i * width + j;
-      size_t index2 = index * 2, index3 = index * 3;
-      int y0 = yuyv[index2 + 0] << 8;
-      int u = yuyv[index2 + 1] - 128;
-      int y1 = yuyv[index2 + 2] << 8;
-      int v = yuyv[index2 + 3] - 128;
-      rgb[index3 + 0] = yuv2r(y0, u, v);
-      rgb[index3 + 1] = yuv2g(y0, u, v);
-      rgb[index3 + 2] = yuv2b(y0, u, v);
-      rgb[index3 + 3] = yuv2r(y1, u, v);
-      rgb[index3 + 4] = yuv2g(y1, u, v);
-      rgb[index3 + 5] = yuv2b(y1, u, v);
+    const uint8_t* yrow = yp + i * ystride;
+    const size_t crow = (i / vdiv) * cstride;
+    uint8_t* out = camera_orient_row(&orient, i);
+    for (size_t j = 0; j < width; j++) {
+      const size_t c = crow + (j / hdiv) * step;
+      yuv2rgb(table, yrow[j * ystep], up[c], vp[c], out + j * 3);
     }
   }
+  camera_orient_end(&orient);
   return rgb;
 }
 
@@ -290,24 +960,33 @@ void camera_format_name(uint32_t format_id, char* name)
   name[4] = '\0';
 }
 
-static bool camera_format_set(camera_t* camera, const camera_format_t* format)
+static void 
+camera_format_fill(const camera_t* camera, const camera_format_t* format, 
+                   struct v4l2_format* vformat)
 {
-  if (format->width > 0 && format->height > 0) {
-    uint32_t pixformat = format->format ? format->format : V4L2_PIX_FMT_YUYV;
-    struct v4l2_format vformat;
-    memset(&vformat, 0, sizeof vformat);
-    vformat.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    vformat.fmt.pix.width = format->width;
-    vformat.fmt.pix.height = format->height;
-    vformat.fmt.pix.pixelformat = pixformat;
-    vformat.fmt.pix.field = V4L2_FIELD_NONE;
-    if (xioctl(camera->fd, VIDIOC_S_FMT, &vformat) == -1)
-      return error(camera, "VIDIOC_S_FMT");
+  uint32_t pixformat = format->format ? format->format : V4L2_PIX_FMT_YUYV;
+  memset(vformat, 0, sizeof *vformat);
+  vformat->type = camera->type;
+  if (camera_mplane(camera)) {
+    vformat->fmt.pix_mp.width = format->width;
+    vformat->fmt.pix_mp.height = format->height;
+    vformat->fmt.pix_mp.pixelformat = pixformat;
+    vformat->fmt.pix_mp.field = V4L2_FIELD_NONE;
+  } else {
+    vformat->fmt.pix.width = format->width;
+    vformat->fmt.pix.height = format->height;
+    vformat->fmt.pix.pixelformat = pixformat;
+    vformat->fmt.pix.field = V4L2_FIELD_NONE;
   }
+}
+
+static bool 
+camera_interval_set(camera_t* camera, const camera_format_t* format)
+{
   if (format->interval.numerator != 0 && format->interval.denominator != 0) {
     struct v4l2_streamparm parm;
     memset(&parm, 0, sizeof parm);
-    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    parm.type = camera->type;
     parm.parm.capture.timeperframe.numerator = format->interval.numerator;
     parm.parm.capture.timeperframe.denominator = format->interval.denominator;
     if (xioctl(camera->fd, VIDIOC_S_PARM, &parm) == -1)
@@ -316,21 +995,34 @@ static bool camera_format_set(camera_t* camera, const camera_format_t* format)
   return true;
 }
 
+static bool camera_format_set(camera_t* camera, const camera_format_t* format)
+{
+  if (format->width > 0 && format->height > 0) {
+    struct v4l2_format vformat;
+    camera_format_fill(camera, format, &vformat);
+    if (xioctl(camera->fd, VIDIOC_S_FMT, &vformat) == -1)
+      return error(camera, "VIDIOC_S_FMT");
+  }
+  return camera_interval_set(camera, format);
+}
+
 static bool camera_format_get(camera_t* camera, camera_format_t* format)
 {
   struct v4l2_format vformat;
   memset(&vformat, 0, sizeof vformat);
-  vformat.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  vformat.type = camera->type;
   if (xioctl(camera->fd, VIDIOC_G_FMT, &vformat) == -1)
     return error(camera, "VIDIOC_G_FMT");
   
-  format->format = vformat.fmt.pix.pixelformat;
-  format->width = vformat.fmt.pix.width;
-  format->height = vformat.fmt.pix.height;
+  camera_image_t image;
+  camera_vformat_image(camera, &vformat, &image);
+  format->format = image.format;
+  format->width = image.width;
+  format->height = image.height;
   
   struct v4l2_streamparm parm;
   memset(&parm, 0, sizeof parm);
-  parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  parm.type = camera->type;
   if (xioctl(camera->fd, VIDIOC_G_PARM, &parm) == -1)
     return error(camera, "VIDIOC_G_PARM");
   format->interval.numerator = parm.parm.capture.timeperframe.numerator;
@@ -342,17 +1034,178 @@ bool camera_config_get(camera_t* camera, camera_format_t* format)
 {
   return camera_format_get(camera, format);
 }
-bool camera_config_set(camera_t* camera, const camera_format_t* format)
+
+static size_t camera_buffer_min_length(const camera_t* camera, size_t plane)
 {
-  if (camera->buffer_count > 0) {
-    if (!camera_stop(camera)) return false;
+  size_t length = SIZE_MAX;
+  for (size_t i = 0; i < camera->buffer_count; i++) {
+    const camera_buffer_t* buffer = 
+      &camera->buffers[i * camera->plane_count + plane];
+    if (buffer->length < length) length = buffer->length;
+  }
+  return length;
+}
+
+static bool camera_buffer_fits(const camera_t* camera, 
+                               const struct v4l2_format* vformat)
+{
+  if (!camera_mplane(camera))
+    return vformat->fmt.pix.sizeimage <= camera_buffer_min_length(camera, 0);
+  const struct v4l2_pix_format_mplane* pix = &vformat->fmt.pix_mp;
+  if (pix->num_planes != camera->plane_count) return false;
+  for (size_t p = 0; p < camera->plane_count; p++) {
+    if (pix->plane_fmt[p].sizeimage > camera_buffer_min_length(camera, p))
+      return false;
   }
+  return true;
+}
+
+/* 
+ * switch format while buffers are mapped: validate with VIDIOC_TRY_FMT
+ * before touching the stream, keep the mapped buffers when the driver
+ * accepts the format with them and the image fits, and resume streaming
+ */
+static bool 
+camera_config_switch(camera_t* camera, const camera_format_t* format)
+{
+  struct v4l2_format current;
+  memset(&current, 0, sizeof current);
+  current.type = camera->type;
+  if (xioctl(camera->fd, VIDIOC_G_FMT, &current) == -1)
+    return error(camera, "VIDIOC_G_FMT");
+  
+  bool resize = false;
+  struct v4l2_format vformat;
+  if (format->width > 0 && format->height > 0) {
+    camera_format_fill(camera, format, &vformat);
+    if (xioctl(camera->fd, VIDIOC_TRY_FMT, &vformat) == -1)
+      return error(camera, "VIDIOC_TRY_FMT");
+    camera_image_t next, now;
+    camera_vformat_image(camera, &vformat, &next);
+    camera_vformat_image(camera, &current, &now);
+    resize = next.width != now.width || next.height != now.height ||
+      next.format != now.format;
+  }
+  bool interval = 
+    format->interval.numerator != 0 && format->interval.denominator != 0;
+  if (!resize && !interval) return true;
+  
+  bool streaming = camera->streaming;
+  if (streaming && !camera_stream_off(camera)) return false;
+  if (resize) {
+    bool reuse = camera_buffer_fits(camera, &vformat) &&
+      xioctl(camera->fd, VIDIOC_S_FMT, &vformat) == 0 &&
+      camera_buffer_fits(camera, &vformat);
+    if (!reuse) {
+      size_t lengths[CAMERA_MAX_PLANES] = {0};
+      for (size_t i = 0; i < camera->buffer_count; i++) {
+        for (size_t p = 0; p < camera->plane_count; p++) {
+          const camera_buffer_t* buffer = 
+            &camera->buffers[i * camera->plane_count + p];
+          if (buffer->length > lengths[p]) lengths[p] = buffer->length;
+        }
+      }
+      if (!camera_buffer_release(camera)) return false;
+      camera_format_fill(camera, format, &vformat);
+      if (xioctl(camera->fd, VIDIOC_S_FMT, &vformat) == -1)
+        return error(camera, "VIDIOC_S_FMT");
+      if (!camera_load_settings(camera)) return false;
+      if (!camera_buffer_prepare(camera, lengths)) return false;
+    }
+  }
+  if (!camera_interval_set(camera, format)) return false;
+  if (!camera_load_settings(camera)) return false;
+  if (streaming) return camera_stream_on(camera);
+  return true;
+}
+
+bool camera_config_set(camera_t* camera, const camera_format_t* format)
+{
+  uint64_t begin = camera_now();
   if (!camera->initialized) {
     if (!camera_init(camera)) return false;
   }
-  if (!camera_format_set(camera, format)) return false;
-  if (!camera_load_settings(camera)) return false;
-  return camera_buffer_prepare(camera);
+  if (camera->buffer_count > 0) {
+    if (!camera_config_switch(camera, format)) return false;
+  } else {
+    if (!camera_format_set(camera, format)) return false;
+    if (!camera_load_settings(camera)) return false;
+    if (!camera_buffer_prepare(camera, NULL)) return false;
+  }
+  camera->config_latency = camera_now() - begin;
+  return true;
+}
+
+typedef struct {
+  camera_formats_t* formats;
+  size_t capacity;
+  uint32_t pixelformat;
+  camera_format_range_t range;
+} camera_formats_builder_t;
+
+static void camera_formats_push(camera_formats_builder_t* builder)
+{
+  camera_formats_t* formats = builder->formats;
+  if (formats->length == builder->capacity) {
+    builder->capacity = builder->capacity ? builder->capacity * 2 : 16;
+    formats->head = 
+      realloc(formats->head, builder->capacity * sizeof (camera_format_t));
+    formats->ranges = realloc(formats->ranges, 
+      builder->capacity * sizeof (camera_format_range_t));
+  }
+  camera_format_t* format = &formats->head[formats->length];
+  format->format = builder->pixelformat;
+  format->width = builder->range.size.max_width;
+  format->height = builder->range.size.max_height;
+  format->interval = builder->range.interval.min;
+  formats->ranges[formats->length] = builder->range;
+  formats->length++;
+}
+
+static void 
+camera_formats_intervals(const camera_t* camera, 
+                         camera_formats_builder_t* builder)
+{
+  /* intervals of a size range are queried at its largest size */
+  bool found = false;
+  for (uint32_t k = 0; ; k++) {
+    struct v4l2_frmivalenum frmival;
+    memset(&frmival, 0, sizeof frmival);
+    frmival.index = k;
+    frmival.pixel_format = builder->pixelformat;
+    frmival.width = builder->range.size.max_width;
+    frmival.height = builder->range.size.max_height;
+    if (xioctl(camera->fd, VIDIOC_ENUM_FRAMEINTERVALS, &frmival) == -1) 
+      break;
+    found = true;
+    builder->range.interval.type = frmival.type;
+    if (frmival.type == V4L2_FRMIVAL_TYPE_DISCRETE) {
+      builder->range.interval.min.numerator = frmival.discrete.numerator;
+      builder->range.interval.min.denominator = frmival.discrete.denominator;
+      builder->range.interval.max = builder->range.interval.min;
+      builder->range.interval.step = builder->range.interval.min;
+      camera_formats_push(builder);
+    } else {
+      builder->range.interval.min.numerator = frmival.stepwise.min.numerator;
+      builder->range.interval.min.denominator = 
+        frmival.stepwise.min.denominator;
+      builder->range.interval.max.numerator = frmival.stepwise.max.numerator;
+      builder->range.interval.max.denominator = 
+        frmival.stepwise.max.denominator;
+      builder->range.interval.step.numerator = 
+        frmival.stepwise.step.numerator;
+      builder->range.interval.step.denominator = 
+        frmival.stepwise.step.denominator;
+      camera_formats_push(builder);
+      break;
+    }
+  }
+  if (!found) {
+    /* driver without interval enumeration: keep the size, interval 0/0 */
+    memset(&builder->range.interval, 0, sizeof builder->range.interval);
+    builder->range.interval.type = CAMERA_RANGE_DISCRETE;
+    camera_formats_push(builder);
+  }
 }
 
 camera_formats_t*  camera_formats_new(const camera_t* camera)
@@ -360,70 +1213,364 @@ camera_formats_t*  camera_formats_new(const camera_t* camera)
   camera_formats_t* ret = malloc(sizeof (camera_formats_t));
   ret->length = 0;
   ret->head = NULL;
+  ret->ranges = NULL;
+  camera_formats_builder_t builder;
+  memset(&builder, 0, sizeof builder);
+  builder.formats = ret;
   for (uint32_t i = 0; ; i++) {
     struct v4l2_fmtdesc fmt;
     memset(&fmt, 0, sizeof fmt);
     fmt.index = i;
-    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (ioctl(camera->fd, VIDIOC_ENUM_FMT, &fmt) == -1) break;
-    //printf("[%s]\n", fmt.description);
+    fmt.type = camera->type;
+    if (xioctl(camera->fd, VIDIOC_ENUM_FMT, &fmt) == -1) break;
+    builder.pixelformat = fmt.pixelformat;
     for (uint32_t j = 0; ; j++) {
       struct v4l2_frmsizeenum frmsize;
       memset(&frmsize, 0, sizeof frmsize);
       frmsize.index = j;
       frmsize.pixel_format = fmt.pixelformat;
-      if (ioctl(camera->fd, VIDIOC_ENUM_FRAMESIZES, &frmsize) == -1) break;
+      if (xioctl(camera->fd, VIDIOC_ENUM_FRAMESIZES, &frmsize) == -1) break;
+      builder.range.size.type = frmsize.type;
       if (frmsize.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
-        //printf("- w: %d, h: %d\n", 
-        //       frmsize.discrete.width, frmsize.discrete.height);
-        for (uint32_t k = 0; ; k++) {
-          struct v4l2_frmivalenum frmival;
-          memset(&frmival, 0, sizeof frmival);
-          frmival.index = k;
-          frmival.pixel_format = fmt.pixelformat;
-          frmival.width = frmsize.discrete.width;
-          frmival.height = frmsize.discrete.height;
-          if (ioctl(camera->fd, VIDIOC_ENUM_FRAMEINTERVALS, &frmival) == -1) 
-            break;
-          if (frmival.type == V4L2_FRMIVAL_TYPE_DISCRETE) {
-            //printf("  - fps: %d/%d\n", 
-            //       frmival.discrete.denominator,frmival.discrete.numerator);
-            ret->head = 
-              realloc(ret->head, (ret->length + 1) * sizeof (camera_format_t));
-            ret->head[ret->length].format = fmt.pixelformat;
-            ret->head[ret->length].width = frmsize.discrete.width;
-            ret->head[ret->length].height = frmsize.discrete.height;
-            ret->head[ret->length].interval.numerator =
-              frmival.discrete.numerator;
-            ret->head[ret->length].interval.denominator =
-              frmival.discrete.denominator;
-            ret->length++;
-          } else {
-            //printf("  - fps: %d/%d-%d/%d\n", 
-            //       frmival.stepwise.min.denominator,
-            //       frmival.stepwise.min.numerator,
-            //       frmival.stepwise.max.denominator,
-            //       frmival.stepwise.max.numerator);
-            // TBD: when stepwize
-          }
-        }
+        builder.range.size.min_width = frmsize.discrete.width;
+        builder.range.size.max_width = frmsize.discrete.width;
+        builder.range.size.step_width = 0;
+        builder.range.size.min_height = frmsize.discrete.height;
+        builder.range.size.max_height = frmsize.discrete.height;
+        builder.range.size.step_height = 0;
+        camera_formats_intervals(camera, &builder);
       } else {
-        //printf("- w: %d-%d, h: %d-%d\n", 
-        //       frmsize.stepwise.min_width, frmsize.stepwise.max_width,
-        //      frmsize.stepwise.min_height, frmsize.stepwise.max_height);
-        // TBD: when stepwize
+        builder.range.size.min_width = frmsize.stepwise.min_width;
+        builder.range.size.max_width = frmsize.stepwise.max_width;
+        builder.range.size.step_width = frmsize.stepwise.step_width;
+        builder.range.size.min_height = frmsize.stepwise.min_height;
+        builder.range.size.max_height = frmsize.stepwise.max_height;
+        builder.range.size.step_height = frmsize.stepwise.step_height;
+        camera_formats_intervals(camera, &builder);
+        break;
       }
     }
-    
   }
   return ret;
 }
 void camera_formats_delete(camera_formats_t* formats)
 {
   free(formats->head);
+  free(formats->ranges);
   free(formats);
 }
 
+const camera_formats_t* camera_formats(camera_t* camera)
+{
+  if (!camera->formats) camera->formats = camera_formats_new(camera);
+  return camera->formats;
+}
+void camera_formats_invalidate(camera_t* camera)
+{
+  if (!camera->formats) return;
+  camera_formats_delete(camera->formats);
+  camera->formats = NULL;
+}
+
+static const camera_format_cost_t camera_format_costs[] = {
+  {V4L2_PIX_FMT_YUYV, 2.0, 1.0},
+  {V4L2_PIX_FMT_UYVY, 2.0, 1.0},
+  {V4L2_PIX_FMT_MJPEG, 0.3, 4.0},
+  {V4L2_PIX_FMT_JPEG, 0.3, 4.0},
+  {V4L2_PIX_FMT_H264, 0.05, 8.0},
+  {V4L2_PIX_FMT_GREY, 1.0, 0.5},
+  {V4L2_PIX_FMT_RGB24, 3.0, 0.5},
+  {V4L2_PIX_FMT_BGR24, 3.0, 0.5},
+  {V4L2_PIX_FMT_NV12, 1.5, 1.0},
+  {V4L2_PIX_FMT_YUV420, 1.5, 1.0},
+  {V4L2_PIX_FMT_SBGGR8, 1.0, 1.5},
+  {V4L2_PIX_FMT_SGBRG8, 1.0, 1.5},
+  {V4L2_PIX_FMT_SGRBG8, 1.0, 1.5},
+  {V4L2_PIX_FMT_SRGGB8, 1.0, 1.5},
+};
+
+static camera_format_cost_t 
+camera_format_cost(const camera_mode_request_t* request, uint32_t format)
+{
+  for (size_t i = 0; i < request->cost_length; i++) {
+    if (request->costs[i].format == format) return request->costs[i];
+  }
+  const size_t count = 
+    sizeof camera_format_costs / sizeof (camera_format_cost_t);
+  for (size_t i = 0; i < count; i++) {
+    if (camera_format_costs[i].format == format) return camera_format_costs[i];
+  }
+  camera_format_cost_t unknown = {format, 2.0, 1.0};
+  return unknown;
+}
+
+static size_t 
+camera_format_rank(const camera_mode_request_t* request, uint32_t format)
+{
+  for (size_t i = 0; i < request->prefer_length; i++) {
+    if (request->prefer[i] == format) return i;
+  }
+  return request->prefer_length;
+}
+
+static double camera_interval_seconds(camera_interval_t interval)
+{
+  if (interval.numerator == 0 || interval.denominator == 0) return 0;
+  return (double) interval.numerator / interval.denominator;
+}
+
+static uint64_t gcd64(uint64_t a, uint64_t b)
+{
+  while (b) {
+    uint64_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+static camera_interval_t camera_interval_make(uint64_t num, uint64_t den)
+{
+  uint64_t g = gcd64(num, den);
+  if (g > 1) {
+    num /= g;
+    den /= g;
+  }
+  while (num > UINT32_MAX || den > UINT32_MAX) {
+    num = (num + 1) / 2;
+    den /= 2;
+  }
+  camera_interval_t interval = {num, den};
+  return interval;
+}
+
+/* largest value of [min, max] on the step grid not above limit (0: max) */
+static uint32_t 
+camera_range_pick(uint32_t min, uint32_t max, uint32_t step, uint32_t limit)
+{
+  if (limit == 0 || limit > max) limit = max;
+  if (limit < min) return 0;
+  if (step <= 1) return limit;
+  return min + (limit - min) / step * step;
+}
+
+/* the slowest interval of the range which still reaches min_fps */
+static bool 
+camera_interval_pick(const camera_format_range_t* range, double min_fps,
+                     camera_interval_t* interval)
+{
+  const double slack = 1e-6;
+  if (range->interval.type == CAMERA_RANGE_DISCRETE) {
+    *interval = range->interval.min;
+    if (min_fps <= 0) return true;
+    double t = camera_interval_seconds(*interval);
+    return t > 0 && t <= (1 + slack) / min_fps;
+  }
+  if (min_fps <= 0) {
+    *interval = range->interval.max;
+    return true;
+  }
+  const camera_interval_t min = range->interval.min;
+  const camera_interval_t step = range->interval.step;
+  double target = 1 / min_fps;
+  double tmin = camera_interval_seconds(min);
+  if (tmin > target * (1 + slack)) return false;
+  if (target >= camera_interval_seconds(range->interval.max)) {
+    *interval = range->interval.max;
+    return true;
+  }
+  double tstep = camera_interval_seconds(step);
+  if (range->interval.type == CAMERA_RANGE_STEPWISE && tstep > 0) {
+    /* min + k * step as a single fraction */
+    uint64_t k = (uint64_t) ((target - tmin) / tstep + slack);
+    *interval = camera_interval_make(
+      (uint64_t) min.numerator * step.denominator +
+      k * step.numerator * min.denominator,
+      (uint64_t) min.denominator * step.denominator);
+  } else {
+    *interval = camera_interval_make(1000, (uint64_t) (min_fps * 1000 + 0.5));
+  }
+  return true;
+}
+
+bool camera_formats_select(const camera_formats_t* formats, 
+                           const camera_mode_request_t* request,
+                           camera_format_t* mode)
+{
+  bool found = false;
+  uint64_t best_area = 0;
+  size_t best_rank = 0;
+  double best_cost = 0;
+  for (size_t i = 0; i < formats->length; i++) {
+    const camera_format_range_t* range = &formats->ranges[i];
+    const uint32_t format = formats->head[i].format;
+    uint32_t width = 
+      camera_range_pick(range->size.min_width, range->size.max_width,
+                        range->size.step_width, request->max_width);
+    uint32_t height = 
+      camera_range_pick(range->size.min_height, range->size.max_height,
+                        range->size.step_height, request->max_height);
+    if (width == 0 || height == 0) continue;
+    if (width < request->min_width || height < request->min_height) continue;
+    camera_interval_t interval;
+    if (!camera_interval_pick(range, request->min_fps, &interval)) continue;
+    
+    double t = camera_interval_seconds(interval);
+    double fps = t > 0 ? 1 / t : 30;
+    double pixels = (double) width * height;
+    camera_format_cost_t cost = camera_format_cost(request, format);
+    if (request->bandwidth > 0 && 
+        cost.bytes_per_pixel * pixels * fps > request->bandwidth) continue;
+    
+    uint64_t area = (uint64_t) width * height;
+    size_t rank = camera_format_rank(request, format);
+    double total = cost.cost_per_pixel * pixels * fps;
+    if (found) {
+      if (area < best_area) continue;
+      if (area == best_area) {
+        if (rank > best_rank) continue;
+        if (rank == best_rank && total >= best_cost) continue;
+      }
+    }
+    found = true;
+    best_area = area;
+    best_rank = rank;
+    best_cost = total;
+    mode->format = format;
+    mode->width = width;
+    mode->height = height;
+    mode->interval = interval;
+  }
+  return found;
+}
+
+
+//[cropping]
+static void rect_from_v4l2(camera_rect_t* rect, const struct v4l2_rect* r)
+{
+  rect->left = r->left;
+  rect->top = r->top;
+  rect->width = r->width;
+  rect->height = r->height;
+}
+static void rect_to_v4l2(struct v4l2_rect* r, const camera_rect_t* rect)
+{
+  r->left = rect->left;
+  r->top = rect->top;
+  r->width = rect->width;
+  r->height = rect->height;
+}
+
+#ifdef VIDIOC_G_SELECTION
+static bool 
+camera_selection_get(camera_t* camera, uint32_t target, camera_rect_t* rect)
+{
+  struct v4l2_selection sel;
+  memset(&sel, 0, sizeof sel);
+  sel.type = camera->type;
+  sel.target = target;
+  if (xioctl(camera->fd, VIDIOC_G_SELECTION, &sel) == -1) return false;
+  rect_from_v4l2(rect, &sel.r);
+  return true;
+}
+#endif
+
+bool camera_crop_bounds(camera_t* camera, camera_rect_t* bounds, 
+                        camera_rect_t* defrect)
+{
+#ifdef VIDIOC_G_SELECTION
+  if (camera_selection_get(camera, V4L2_SEL_TGT_CROP_BOUNDS, bounds) &&
+      camera_selection_get(camera, V4L2_SEL_TGT_CROP_DEFAULT, defrect))
+    return true;
+#endif
+  struct v4l2_cropcap cropcap;
+  memset(&cropcap, 0, sizeof cropcap);
+  cropcap.type = camera->type;
+  if (xioctl(camera->fd, VIDIOC_CROPCAP, &cropcap) == -1)
+    return error(camera, "VIDIOC_CROPCAP");
+  rect_from_v4l2(bounds, &cropcap.bounds);
+  rect_from_v4l2(defrect, &cropcap.defrect);
+  return true;
+}
+
+bool camera_crop_get(camera_t* camera, camera_rect_t* rect)
+{
+#ifdef VIDIOC_G_SELECTION
+  if (camera_selection_get(camera, V4L2_SEL_TGT_CROP, rect)) return true;
+#endif
+  struct v4l2_crop crop;
+  memset(&crop, 0, sizeof crop);
+  crop.type = camera->type;
+  if (xioctl(camera->fd, VIDIOC_G_CROP, &crop) == -1)
+    return error(camera, "VIDIOC_G_CROP");
+  rect_from_v4l2(rect, &crop.c);
+  return true;
+}
+
+static bool camera_crop_apply(camera_t* camera, camera_rect_t* rect)
+{
+#ifdef VIDIOC_S_SELECTION
+  struct v4l2_selection sel;
+  memset(&sel, 0, sizeof sel);
+  sel.type = camera->type;
+  sel.target = V4L2_SEL_TGT_CROP;
+  rect_to_v4l2(&sel.r, rect);
+  if (xioctl(camera->fd, VIDIOC_S_SELECTION, &sel) == 0) {
+    rect_from_v4l2(rect, &sel.r);
+    return true;
+  }
+  if (errno != ENOTTY && errno != EINVAL) return false;
+#endif
+  struct v4l2_crop crop;
+  memset(&crop, 0, sizeof crop);
+  crop.type = camera->type;
+  rect_to_v4l2(&crop.c, rect);
+  if (xioctl(camera->fd, VIDIOC_S_CROP, &crop) == -1) return false;
+  /* S_CROP is write-only, read back what the driver chose */
+  if (xioctl(camera->fd, VIDIOC_G_CROP, &crop) == 0) 
+    rect_from_v4l2(rect, &crop.c);
+  return true;
+}
+
+bool camera_crop_set(camera_t* camera, camera_rect_t* rect)
+{
+  if (!camera->initialized) {
+    if (!camera_init(camera)) return false;
+  }
+  const bool streaming = camera->streaming;
+  const bool prepared = camera->buffer_count > 0;
+  if (!camera_crop_apply(camera, rect)) {
+    if (errno != EBUSY) return error(camera, "VIDIOC_S_CROP");
+    /* a crop that changes the format may need the buffers freed */
+    if (streaming && !camera_stream_off(camera)) return false;
+    if (prepared && !camera_buffer_release(camera)) return false;
+    if (!camera_crop_apply(camera, rect)) 
+      return error(camera, "VIDIOC_S_CROP");
+  }
+  /* the driver may have changed the format to the cropped size; without
+   * buffers yet only the size is reloaded, they are allocated on start */
+  if (!prepared) return camera_load_settings(camera);
+  struct v4l2_format vformat;
+  memset(&vformat, 0, sizeof vformat);
+  vformat.type = camera->type;
+  if (xioctl(camera->fd, VIDIOC_G_FMT, &vformat) == -1)
+    return error(camera, "VIDIOC_G_FMT");
+  if (camera->buffer_count > 0) {
+    camera_image_t next;
+    camera_vformat_image(camera, &vformat, &next);
+    if (next.width == camera->width && next.height == camera->height &&
+        next.format == camera->image.format) return true;
+    if (streaming && !camera_stream_off(camera)) return false;
+    if (!camera_buffer_fits(camera, &vformat) && 
+        !camera_buffer_release(camera)) return false;
+  }
+  if (!camera_load_settings(camera)) return false;
+  if (camera->buffer_count == 0 && !camera_buffer_prepare(camera, NULL)) 
+    return false;
+  if (streaming) return camera_stream_on(camera);
+  return true;
+}
+
 
 //[controls]
 static void 
@@ -467,48 +1614,84 @@ camera_controls_menus(const camera_t* camera, camera_control_t* control)
     }
   }
 }
+static void
+camera_control_copy(camera_control_t* control, struct v4l2_queryctrl* qctrl)
+{
+  control->id = qctrl->id;
+  memcpy(control->name, qctrl->name, sizeof qctrl->name);
+  control->flags.disabled = (qctrl->flags & V4L2_CTRL_FLAG_DISABLED) != 0;
+  control->flags.grabbed = (qctrl->flags & V4L2_CTRL_FLAG_GRABBED) != 0;
+  control->flags.read_only = (qctrl->flags & V4L2_CTRL_FLAG_READ_ONLY) != 0;
+  control->flags.update = (qctrl->flags & V4L2_CTRL_FLAG_UPDATE) != 0;
+  control->flags.inactive = (qctrl->flags & V4L2_CTRL_FLAG_INACTIVE) != 0;
+  control->flags.slider = (qctrl->flags & V4L2_CTRL_FLAG_SLIDER) != 0;
+  control->flags.write_only = (qctrl->flags & V4L2_CTRL_FLAG_WRITE_ONLY) != 0;
+  control->flags.volatile_value = 
+    (qctrl->flags & V4L2_CTRL_FLAG_VOLATILE) != 0;
+  control->type = qctrl->type;
+  control->max = qctrl->maximum;
+  control->min = qctrl->minimum;
+  control->step = qctrl->step;
+  control->default_value = qctrl->default_value;
+}
 static camera_control_t* 
-camera_controls_query(const camera_t* camera, camera_control_t* control_list)
+camera_controls_push(const camera_t* camera, camera_controls_t* controls,
+                     size_t* capacity, struct v4l2_queryctrl* qctrl)
+{
+  if (controls->length == *capacity) {
+    *capacity = *capacity ? *capacity * 2 : 32;
+    controls->head = 
+      realloc(controls->head, *capacity * sizeof (camera_control_t));
+  }
+  camera_control_t* control = &controls->head[controls->length++];
+  camera_control_copy(control, qctrl);
+  camera_controls_menus(camera, control);
+  return control;
+}
+static bool 
+camera_controls_enum(const camera_t* camera, camera_controls_t* controls,
+                     size_t* capacity, uint32_t next)
 {
-  camera_control_t* control_list_last = control_list;
+  /* walk every control class (user, camera, vendor) in driver order */
+  uint32_t id = 0;
+  for (;;) {
+    struct v4l2_queryctrl qctrl;
+    memset(&qctrl, 0, sizeof qctrl);
+    qctrl.id = id | next;
+    if (xioctl(camera->fd, VIDIOC_QUERYCTRL, &qctrl) == -1) break;
+    id = qctrl.id;
+    if (qctrl.type == V4L2_CTRL_TYPE_CTRL_CLASS) continue;
+    camera_controls_push(camera, controls, capacity, &qctrl);
+  }
+  return id != 0;
+}
+static void 
+camera_controls_query(const camera_t* camera, camera_controls_t* controls)
+{
+  size_t capacity = 0;
+#ifdef V4L2_CTRL_FLAG_NEXT_COMPOUND
+  if (camera_controls_enum(camera, controls, &capacity, 
+                           V4L2_CTRL_FLAG_NEXT_CTRL | 
+                           V4L2_CTRL_FLAG_NEXT_COMPOUND)) return;
+#endif
+  if (camera_controls_enum(camera, controls, &capacity, 
+                           V4L2_CTRL_FLAG_NEXT_CTRL)) return;
   
+  // drivers without V4L2_CTRL_FLAG_NEXT_CTRL: probe user controls only
   for (uint32_t cid = V4L2_CID_USER_BASE; cid < V4L2_CID_LASTP1; cid++) {
     struct v4l2_queryctrl qctrl;
     memset(&qctrl, 0, sizeof qctrl);
     qctrl.id = cid;
-    if (ioctl(camera->fd, VIDIOC_QUERYCTRL, &qctrl) == -1) continue;
-    camera_control_t* control = control_list_last++;
-    control->id = qctrl.id;
-    memcpy(control->name, qctrl.name, sizeof qctrl.name);
-    control->flags.disabled = (qctrl.flags & V4L2_CTRL_FLAG_DISABLED) != 0;
-    control->flags.grabbed = (qctrl.flags & V4L2_CTRL_FLAG_GRABBED) != 0;
-    control->flags.read_only = (qctrl.flags & V4L2_CTRL_FLAG_READ_ONLY) != 0;
-    control->flags.update = (qctrl.flags & V4L2_CTRL_FLAG_UPDATE) != 0;
-    control->flags.inactive = (qctrl.flags & V4L2_CTRL_FLAG_INACTIVE) != 0;
-    control->flags.slider = (qctrl.flags & V4L2_CTRL_FLAG_SLIDER) != 0;
-    control->flags.write_only = (qctrl.flags & V4L2_CTRL_FLAG_WRITE_ONLY) != 0;
-    control->flags.volatile_value = 
-      (qctrl.flags & V4L2_CTRL_FLAG_VOLATILE) != 0;
-    control->type = qctrl.type;
-    control->max = qctrl.maximum;
-    control->min = qctrl.minimum;
-    control->step = qctrl.step;
-    control->default_value = qctrl.default_value;
-    camera_controls_menus(camera, control);
-  }
-  return control_list_last;
+    if (xioctl(camera->fd, VIDIOC_QUERYCTRL, &qctrl) == -1) continue;
+    camera_controls_push(camera, controls, &capacity, &qctrl);
+  }
 }
 camera_controls_t* camera_controls_new(const camera_t* camera)
 {
-  camera_control_t control_list[V4L2_CID_LASTP1 - V4L2_CID_USER_BASE];
-  camera_control_t* control_list_last = 
-    camera_controls_query(camera, control_list);
   camera_controls_t* controls = malloc(sizeof (camera_controls_t));
-  controls->length = control_list_last - control_list;
-  controls->head = calloc(controls->length, sizeof (camera_control_t));
-  for (size_t i = 0; i < controls->length; i++) {
-    controls->head[i] = control_list[i];
-  }
+  controls->length = 0;
+  controls->head = NULL;
+  camera_controls_query(camera, controls);
   return controls;
 }
 
@@ -517,9 +1700,22 @@ void camera_controls_delete(camera_controls_t* controls)
   for (size_t i = 0; i < controls->length; i++) {
     free(controls->head[i].menus.head);
   }
+  free(controls->head);
   free(controls);
 }
 
+const camera_controls_t* camera_controls(camera_t* camera)
+{
+  if (!camera->controls) camera->controls = camera_controls_new(camera);
+  return camera->controls;
+}
+void camera_controls_invalidate(camera_t* camera)
+{
+  if (!camera->controls) return;
+  camera_controls_delete(camera->controls);
+  camera->controls = NULL;
+}
+
 bool camera_control_get(camera_t* camera, uint32_t id, int32_t* value)
 {
   struct v4l2_control ctrl;
@@ -540,3 +1736,77 @@ bool camera_control_set(camera_t* camera, uint32_t id, int32_t value)
     return error(camera, "VIDIOC_S_CTRL");
   return true;
 }
+
+
+//[events]
+static bool camera_event_subscribe(camera_t* camera, uint32_t type, 
+                                   uint32_t id)
+{
+  struct v4l2_event_subscription sub;
+  memset(&sub, 0, sizeof sub);
+  sub.type = type;
+  sub.id = id;
+  return xioctl(camera->fd, VIDIOC_SUBSCRIBE_EVENT, &sub) == 0;
+}
+
+bool camera_events_subscribe(camera_t* camera)
+{
+  const camera_controls_t* controls = camera_controls(camera);
+  bool subscribed = false;
+  for (size_t i = 0; i < controls->length; i++) {
+    if (camera_event_subscribe(camera, V4L2_EVENT_CTRL, 
+                               controls->head[i].id)) subscribed = true;
+  }
+  // optional: most UVC devices support control events only
+  if (camera_event_subscribe(camera, V4L2_EVENT_SOURCE_CHANGE, 0))
+    subscribed = true;
+  if (camera_event_subscribe(camera, V4L2_EVENT_EOS, 0)) subscribed = true;
+  if (!subscribed) return error(camera, "VIDIOC_SUBSCRIBE_EVENT");
+  return true;
+}
+
+bool camera_events_unsubscribe(camera_t* camera)
+{
+  struct v4l2_event_subscription sub;
+  memset(&sub, 0, sizeof sub);
+  sub.type = V4L2_EVENT_ALL;
+  if (xioctl(camera->fd, VIDIOC_UNSUBSCRIBE_EVENT, &sub) == -1)
+    return error(camera, "VIDIOC_UNSUBSCRIBE_EVENT");
+  return true;
+}
+
+bool camera_event_dequeue(camera_t* camera, camera_event_t* event)
+{
+  struct v4l2_event ev;
+  memset(&ev, 0, sizeof ev);
+  if (xioctl(camera->fd, VIDIOC_DQEVENT, &ev) == -1) return false;
+  memset(event, 0, sizeof *event);
+  event->type = ev.type;
+  event->id = ev.id;
+  event->sequence = ev.sequence;
+  switch (ev.type) {
+  case V4L2_EVENT_CTRL:
+    event->changes.value = (ev.u.ctrl.changes & V4L2_EVENT_CTRL_CH_VALUE) != 0;
+    event->changes.flags = (ev.u.ctrl.changes & V4L2_EVENT_CTRL_CH_FLAGS) != 0;
+    event->changes.range = (ev.u.ctrl.changes & V4L2_EVENT_CTRL_CH_RANGE) != 0;
+    event->value = ev.u.ctrl.type == V4L2_CTRL_TYPE_INTEGER64 ?
+      ev.u.ctrl.value64 : ev.u.ctrl.value;
+    event->flags = ev.u.ctrl.flags;
+    event->max = ev.u.ctrl.maximum;
+    event->min = ev.u.ctrl.minimum;
+    event->step = ev.u.ctrl.step;
+    event->default_value = ev.u.ctrl.default_value;
+    if (event->changes.flags || event->changes.range) {
+      camera_controls_invalidate(camera);
+    }
+    break;
+  case V4L2_EVENT_SOURCE_CHANGE:
+    event->changes.resolution = 
+      (ev.u.src_change.changes & V4L2_EVENT_SRC_CH_RESOLUTION) != 0;
+    camera_formats_invalidate(camera);
+    camera_controls_invalidate(camera);
+    break;
+  default: break;
+  }
+  return true;
+}
@@ -31,39 +31,462 @@ typedef struct {
   size_t length;
 } camera_buffer_t;
 
+/* 
+ * image layout of head: multi-planar devices (V4L2_BUF_TYPE_VIDEO_CAPTURE_
+ * MPLANE) have each plane in its own buffer, copied one after another;
+ * planar formats in one buffer (e.g. NV12) are described the same way
+ */
+/* clockwise rotations, then mirrors and the two diagonal flips */
+typedef enum {
+  CAMERA_ORIENT_NONE = 0,
+  CAMERA_ORIENT_ROTATE_90 = 1,
+  CAMERA_ORIENT_ROTATE_180 = 2,
+  CAMERA_ORIENT_ROTATE_270 = 3,
+  CAMERA_ORIENT_FLIP_H = 4, /* left to right */
+  CAMERA_ORIENT_FLIP_V = 5, /* top to bottom */
+  CAMERA_ORIENT_TRANSPOSE = 6, /* over the main diagonal */
+  CAMERA_ORIENT_TRANSVERSE = 7, /* over the anti-diagonal */
+} camera_orientation_t;
+
+#define CAMERA_MAX_PLANES 4
+typedef struct {
+  size_t offset; /* in head */
+  size_t length;
+  uint32_t stride; /* bytes per line */
+} camera_plane_t;
+typedef struct {
+  uint32_t format;
+  uint32_t width;
+  uint32_t height;
+  size_t plane_count;
+  camera_plane_t planes[CAMERA_MAX_PLANES];
+  /* colorimetry as negotiated, defaults resolved: V4L2_COLORSPACE_*, 
+   * V4L2_YCBCR_ENC_* (601, 709 or BT2020 family) and V4L2_QUANTIZATION_* 
+   * (FULL_RANGE or LIM_RANGE) */
+  uint32_t colorspace;
+  uint32_t ycbcr_enc;
+  uint32_t quantization;
+  /* of the converted outputs, which are height x width when transposed */
+  camera_orientation_t orientation;
+} camera_image_t;
+
+typedef struct {
+  const uint8_t* start;
+  size_t length;
+  uint64_t timestamp; /* driver timestamp in ns */
+  uint32_t sequence;
+  /* memory planes, planes[0] is start; plane_count > 1 only for MPLANE */
+  size_t plane_count;
+  struct {
+    const uint8_t* start;
+    size_t length;
+  } planes[CAMERA_MAX_PLANES];
+} camera_frame_t;
+
+static inline void camera_frame_packed(camera_frame_t* frame)
+{
+  frame->plane_count = 1;
+  frame->planes[0].start = frame->start;
+  frame->planes[0].length = frame->length;
+}
+static inline size_t camera_frame_size(const camera_frame_t* frame)
+{
+  size_t size = 0;
+  for (size_t i = 0; i < frame->plane_count; i++) 
+    size += frame->planes[i].length;
+  return size;
+}
+
+typedef void (*camera_sink_func_t)(const camera_frame_t* frame, void* pointer);
+typedef struct camera_sink_s {
+  camera_sink_func_t func;
+  void* pointer;
+  struct camera_sink_s* next;
+} camera_sink_t;
+
+/* 
+ * log-linear latency histogram in ns: 16 linear sub-buckets per power of 2
+ * (within 6.25%), values above 2^40 ns fall into the last bucket
+ */
+#define CAMERA_HISTOGRAM_BUCKETS 592
+typedef struct {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+  uint64_t buckets[CAMERA_HISTOGRAM_BUCKETS];
+} camera_histogram_t;
+
+typedef enum {
+  CAMERA_STAGE_WAIT = 0, /* driver timestamp to dequeued */
+  CAMERA_STAGE_DQBUF = 1, /* VIDIOC_DQBUF */
+  CAMERA_STAGE_SINKS = 2, /* recorders and other sinks */
+  CAMERA_STAGE_COPY = 3, /* into head */
+  CAMERA_STAGE_CONVERT = 4, /* pixel format conversion */
+  CAMERA_STAGE_FRAME = 5, /* frame handed out to the caller */
+  CAMERA_STAGE_DELIVER = 6, /* loop woken to the first capture callback */
+  CAMERA_STAGE_START = 7, /* stream on to the first frame after warm-up */
+  CAMERA_STAGE_DENOISE = 8, /* temporal filter of the frames retrieved */
+  CAMERA_STAGE_COUNT = 9,
+} camera_stage_t;
+
+typedef struct {
+  uint64_t frames;
+  uint64_t bytes;
+  uint64_t errors; /* failed dequeues */
+  uint64_t skipped; /* warm-up frames */
+  uint64_t dequeued; /* CLOCK_MONOTONIC of the last dequeue */
+  camera_histogram_t stages[CAMERA_STAGE_COUNT];
+} camera_stats_t;
+
+/* 
+ * software rate control: frames are taken at target_fps, paced by their
+ * timestamps with the remainder carried so the average holds, and/or
+ * every Nth one; a frame due within half a source period counts as due
+ */
+typedef struct {
+  double target_fps; /* 0 for any rate */
+  uint32_t every; /* 0 or 1 for every frame */
+  uint64_t due; /* ns */
+  uint64_t last; /* timestamp of the last frame seen */
+  uint64_t period; /* of the source, smoothed */
+  uint32_t count;
+  uint64_t taken;
+  uint64_t dropped;
+} camera_rate_t;
+void camera_rate_init(camera_rate_t* rate, double target_fps, uint32_t every);
+bool camera_rate_take(camera_rate_t* rate, uint64_t timestamp);
+
+struct camera_formats_s;
+struct camera_controls_s;
+struct camera_denoise_s;
+
 typedef struct {
   int fd;
+  uint32_t type; /* V4L2_BUF_TYPE_VIDEO_CAPTURE or its _MPLANE */
   bool initialized;
+  bool streaming;
   uint32_t width;
   uint32_t height;
   size_t buffer_count;
-  camera_buffer_t* buffers;
+  size_t plane_count; /* memory planes per buffer */
+  camera_buffer_t* buffers; /* [buffer * plane_count + plane] */
   camera_buffer_t head;
+  size_t head_capacity; /* allocated for the largest frame of the buffers */
+  camera_image_t image; /* of head */
+  uint64_t timestamp; /* of head */
+  uint32_t sequence; /* of head */
+  uint64_t generation; /* of head, counts the frames retrieved into it */
+  uint64_t config_latency; /* ns spent in the last camera_config_set() */
+  uint32_t warmup; /* frames dropped after each stream on */
+  uint32_t warming; /* of them still to drop */
+  uint64_t stream_on; /* CLOCK_MONOTONIC until the first frame after it */
+  uint32_t streams; /* stream ons, buffers dequeued before one are stale */
+  camera_rate_t rate; /* of frames retrieved into head */
+  camera_orientation_t orientation; /* kept in image across formats */
+  /* run on each frame retrieved, owned by the caller; NULL for none */
+  struct camera_denoise_s* denoise;
+  struct camera_formats_s* formats;
+  struct camera_controls_s* controls;
+  camera_sink_t* sinks;
+  camera_stats_t stats;
   camera_context_t context;
 } camera_t;
 
 camera_t* camera_open(const char * device);
 bool camera_start(camera_t* camera);
 bool camera_stop(camera_t* camera);
+/* stream off keeping the format and the mapped buffers; 
+ * camera_start() restarts without allocating them again */
+bool camera_pause(camera_t* camera);
 bool camera_close(camera_t* camera);
 
 bool camera_capture(camera_t* camera);
+/* dequeue a frame for the sinks; copied into head only when retrieve and
+ * camera->rate takes it; warm-up and decimated frames are requeued 
+ * untouched (generation stays unchanged) */
+bool camera_grab(camera_t* camera, bool retrieve);
+/* dequeue a frame for the sinks, left in mapped buffer *index until 
+ * camera_requeue(); *index is -1 for warm-up frames (requeued already) */
+bool camera_dequeue(camera_t* camera, camera_frame_t* frame, int* index);
+bool camera_requeue(camera_t* camera, int index);
+/* copies a dequeued frame into head */
+void camera_retrieve(camera_t* camera, const camera_frame_t* frame);
+/* driver timestamp, or the dequeue time without one */
+static inline uint64_t 
+camera_frame_time(const camera_t* camera, const camera_frame_t* frame)
+{
+  return frame->timestamp ? frame->timestamp : camera->stats.dequeued;
+}
+/* sinks see each dequeued frame in its mapped buffer before requeueing */
+bool camera_sink_add(camera_t* camera, camera_sink_func_t func, void* pointer);
+void 
+camera_sink_remove(camera_t* camera, camera_sink_func_t func, void* pointer);
+/* 
+ * orientation fused into the conversions: each converted source row is
+ * written at camera_orient_row(orient, y), which is the output line when
+ * the row keeps its pixel order, else a block placed when it is full or 
+ * rows stop following on; one per thread
+ */
+typedef struct {
+  camera_orientation_t orientation;
+  uint32_t width; /* of the source */
+  uint32_t height;
+  size_t bpp;
+  uint8_t* out;
+  uint8_t* rows;
+  uint32_t first;
+  uint32_t count;
+} camera_orient_t;
+void camera_orientation_size(camera_orientation_t orientation,
+                             uint32_t width, uint32_t height,
+                             uint32_t* out_width, uint32_t* out_height);
+bool camera_orient_init(camera_orient_t* orient,
+                        camera_orientation_t orientation,
+                        uint32_t width, uint32_t height, size_t bpp,
+                        uint8_t* out);
+uint8_t* camera_orient_row(camera_orient_t* orient, uint32_t y);
+/* places the rows still held */
+void camera_orient_end(camera_orient_t* orient);
+/* turns the converted outputs of head */
+void camera_orientation_set(camera_t* camera, 
+                            camera_orientation_t orientation);
+
+/* BT.601 full range (JPEG) */
 uint8_t* yuyv2rgb(const uint8_t* yuyv, uint32_t width, uint32_t height);
+/* YUYV, NV12/21/16/61 and YUV420/YVU420/YUV422P incl. their MPLANE 
+ * variants with the matrix and range of image->ycbcr_enc/quantization; 
+ * RGB24/BGR24 reordered, raw Bayer formats demosaiced bilinearly and 
+ * single channel ones scaled over their min..max; NULL for other formats.
+ * The outputs of this and the conversions below are in image->orientation
+ */
+uint8_t* camera_image_rgb(const camera_image_t* image, const uint8_t* start);
+
+typedef enum {
+  CAMERA_DEMOSAIC_BILINEAR = 0,
+  /* directional green, gradient-corrected red and blue */
+  CAMERA_DEMOSAIC_EDGE = 1,
+  /* half width and height, one pixel per 2x2 tile: for previews */
+  CAMERA_DEMOSAIC_BINNING = 2,
+} camera_demosaic_t;
+/* bytes per output pixel; GRAY is BT.601 luma */
+typedef enum {
+  CAMERA_PIXEL_GRAY = 1,
+  CAMERA_PIXEL_RGB = 3,
+  CAMERA_PIXEL_RGBA = 4,
+} camera_pixel_t;
+/* count Y'CbCr triples to pixels by the matrix and range of image */
+void camera_yuv_pixels(const camera_image_t* image, const uint8_t* yuv,
+                       size_t count, camera_pixel_t pixel, uint8_t* out);
+/* the matrix the conversions use for image->ycbcr_enc: XV709 and 
+ * SMPTE240M as BT.709, BT2020_CONST_LUM as BT.2020, others as BT.601 */
+typedef enum {
+  CAMERA_MATRIX_BT601 = 0,
+  CAMERA_MATRIX_BT709 = 1,
+  CAMERA_MATRIX_BT2020 = 2,
+  CAMERA_MATRIX_COUNT = 3,
+} camera_matrix_t;
+camera_matrix_t camera_image_matrix(const camera_image_t* image);
+typedef struct {
+  camera_demosaic_t method;
+  camera_pixel_t pixel;
+  size_t threads; /* row bands run in parallel, 0 for the online cpus */
+} camera_demosaic_config_t;
+/* SBGGR8 and its GBRG/GRBG/RGGB orders in 8, 10, 12 and 16 bits, and the
+ * MIPI packed 10P/12P variants */
+bool camera_format_bayer(uint32_t format);
+/* samples are reduced to their 8 msbs; NULL for other formats */
+uint8_t* camera_image_demosaic(const camera_image_t* image, 
+                               const uint8_t* start,
+                               const camera_demosaic_config_t* config,
+                               uint32_t* width, uint32_t* height);
 
+/* bits per sample of GREY, Y10, Y12, Y14, Y16(_BE), Z16 and the packed
+ * Y10P/Y10BPACK; 0 for the other formats */
+unsigned camera_format_mono(uint32_t format);
+/* width * height samples in the low bits, rows without padding; NULL for
+ * other formats */
+uint16_t* camera_image_samples(const camera_image_t* image, 
+                               const uint8_t* start);
+typedef enum {
+  CAMERA_COLORMAP_GRAY = 0,
+  CAMERA_COLORMAP_JET = 1,
+  CAMERA_COLORMAP_TURBO = 2,
+} camera_colormap_t;
+/* 256 RGB entries, built on first use */
+const uint8_t* camera_colormap(camera_colormap_t map);
+typedef enum {
+  CAMERA_SCALE_FIXED = 0, /* low..high as sample values */
+  CAMERA_SCALE_MINMAX = 1, /* the frame's min..max */
+  CAMERA_SCALE_PERCENTILE = 2, /* low..high as fractions of the samples */
+} camera_scale_t;
+typedef struct {
+  camera_scale_t scale;
+  double low;
+  double high;
+  bool ignore_zero; /* e.g. no depth in Z16: left out and kept black */
+  const uint8_t* colormap; /* 256 RGB entries, NULL for 8 bit gray */
+} camera_normalize_config_t;
+typedef struct {
+  uint16_t min; /* of the frame */
+  uint16_t max;
+  uint32_t low; /* mapped to 0 */
+  uint32_t high; /* mapped to 255 */
+} camera_normalize_result_t;
+/* width * height gray or RGB pixels; result may be NULL */
+uint8_t* camera_image_normalize(const camera_image_t* image, 
+                                const uint8_t* start,
+                                const camera_normalize_config_t* config,
+                                camera_normalize_result_t* result);
+
+/* 
+ * PNG encoder for 8 bit gray (1 channel), gray+alpha (2), RGB (3) or RGBA
+ * (4); bands of rows are filtered and deflated in parallel. The encoder 
+ * keeps its deflate states and buffers between images, not thread-safe
+ */
+typedef struct {
+  int level; /* zlib 0-9, -1 for its default */
+  size_t threads; /* 0 for the online cpus */
+} camera_png_config_t;
+typedef struct camera_png_s camera_png_t;
+camera_png_t* camera_png_new(void);
+/* stride 0 for packed rows; the result is valid until the next encode */
+const uint8_t* camera_png_encode(camera_png_t* png, const uint8_t* pixels,
+                                 uint32_t width, uint32_t height,
+                                 size_t channels, uint32_t stride,
+                                 const camera_png_config_t* config,
+                                 size_t* length);
+void camera_png_delete(camera_png_t* png);
+
+/* 
+ * remapping, e.g. lens undistortion: the source position of each output
+ * pixel is precomputed in fixed point for one source and output size, 
+ * then frames are sampled bilinearly straight from their planes
+ */
+typedef enum {
+  CAMERA_LENS_PINHOLE = 0, /* k: k1, k2, p1, p2, k3 (Brown-Conrady) */
+  CAMERA_LENS_FISHEYE = 1, /* k: k1, k2, k3, k4 (equidistant) */
+} camera_lens_model_t;
+typedef struct {
+  camera_lens_model_t model;
+  uint32_t width; /* calibrated frame size, 0 for the source's */
+  uint32_t height;
+  double fx, fy, cx, cy; /* in pixels */
+  double k[5];
+  double zoom; /* output focal length over the lens', 0 for 1 */
+} camera_lens_t;
+typedef struct camera_remap_s camera_remap_t;
+camera_remap_t* camera_remap_lens(const camera_lens_t* lens,
+                                  uint32_t src_width, uint32_t src_height,
+                                  uint32_t width, uint32_t height);
+/* xs, ys: width * height source positions in pixels; outside is black */
+camera_remap_t* camera_remap_map(uint32_t src_width, uint32_t src_height,
+                                 uint32_t width, uint32_t height,
+                                 const float* xs, const float* ys);
+void camera_remap_delete(camera_remap_t* remap);
+typedef struct {
+  camera_pixel_t pixel;
+  size_t threads; /* row bands run in parallel, 0 for the online cpus */
+} camera_remap_config_t;
+/* YUYV, NV12/21/16/61, YUV420/YVU420/YUV422P, RGB24, BGR24 and GREY are
+ * sampled directly, formats of camera_image_rgb() through it; NULL when
+ * the frame size is not the map's source size. The map keeps its points
+ * reordered for the last oriented output */
+uint8_t* camera_image_remap(camera_remap_t* remap,
+                            const camera_image_t* image,
+                            const uint8_t* start,
+                            const camera_remap_config_t* config);
+
+/* 
+ * temporal denoise of the raw 8 bit samples (YUV, RGB24/BGR24, GREY and
+ * 8 bit bayer) in place, before any conversion: a recursive average per
+ * sample whose weight rises with the difference to it, so still areas
+ * are smoothed over frames and moving ones follow at once; optionally
+ * the frames are also summed for a long exposure. It restarts whenever
+ * the format or size changes
+ */
+typedef struct {
+  uint32_t frames; /* a still sample takes 1/frames of a new one (<= 256),
+                    * 0 or 1 leaves frames unfiltered */
+  uint32_t threshold; /* difference (1-255) from which a sample is taken 
+                       * as is, 0 weighs every sample alike */
+  bool stack; /* sum the unfiltered frames for camera_denoise_stacked() */
+} camera_denoise_config_t;
+typedef struct camera_denoise_s camera_denoise_t;
+
+bool camera_denoise_supported(uint32_t format);
+camera_denoise_t* camera_denoise_new(const camera_denoise_config_t* config);
+void camera_denoise_delete(camera_denoise_t* denoise);
+/* false leaving pixels unchanged for other formats; after a gap in the
+ * sequence, still samples weigh what the frames missed would have given
+ * them, so a long gap starts over instead of ghosting the old content */
+bool camera_denoise_frame(camera_denoise_t* denoise,
+                          const camera_image_t* image, uint32_t sequence,
+                          uint8_t* pixels, size_t length);
+/* the mean of the frames summed so far into out, of their layout and 
+ * length; returns their count, 0 when none (out is unchanged) */
+size_t camera_denoise_stacked(camera_denoise_t* denoise, uint8_t* out,
+                              size_t length, bool reset);
+
+/* CLOCK_MONOTONIC in ns */
+uint64_t camera_now(void);
+void camera_histogram_record(camera_histogram_t* histogram, uint64_t value);
+/* value at quantile (0.0-1.0), the midpoint of its bucket */
+uint64_t camera_histogram_quantile(const camera_histogram_t* histogram, 
+                                   double quantile);
+static inline void 
+camera_stage_record(camera_t* camera, camera_stage_t stage, uint64_t begin)
+{
+  camera_histogram_record(&camera->stats.stages[stage], camera_now() - begin);
+}
+void camera_stats_reset(camera_t* camera);
+
+
+typedef struct {
+  uint32_t numerator;
+  uint32_t denominator;
+} camera_interval_t;
 
 typedef struct {
   uint32_t format;
   uint32_t width;
   uint32_t height;
-  struct {
-    uint32_t numerator;
-    uint32_t denominator;
-  } interval;
+  camera_interval_t interval;
 } camera_format_t;
 
+/* same values as V4L2_FRMSIZE_TYPE_* and V4L2_FRMIVAL_TYPE_* */
+typedef enum {
+  CAMERA_RANGE_DISCRETE = 1,
+  CAMERA_RANGE_CONTINUOUS = 2,
+  CAMERA_RANGE_STEPWISE = 3,
+} camera_range_type_t;
+
 typedef struct {
+  struct {
+    camera_range_type_t type;
+    uint32_t min_width;
+    uint32_t max_width;
+    uint32_t step_width;
+    uint32_t min_height;
+    uint32_t max_height;
+    uint32_t step_height;
+  } size;
+  struct {
+    camera_range_type_t type;
+    camera_interval_t min;
+    camera_interval_t max;
+    camera_interval_t step;
+  } interval;
+} camera_format_range_t;
+
+/* 
+ * head[i] is a configurable mode; for stepwise or continuous entries it is
+ * the largest size at the shortest interval and ranges[i] holds the range
+ */
+typedef struct camera_formats_s {
   size_t length;
   camera_format_t* head;
+  camera_format_range_t* ranges;
 } camera_formats_t;
 
 /* convert 4 char name and id. e.g. "YUYV" */
@@ -72,9 +495,63 @@ void camera_format_name(uint32_t format_id, char* name);
 
 camera_formats_t* camera_formats_new(const camera_t* camera);
 void camera_formats_delete(camera_formats_t* formats);
+/* cached on the camera: built on first use, freed by camera_close() */
+const camera_formats_t* camera_formats(camera_t* camera);
+void camera_formats_invalidate(camera_t* camera);
 bool camera_config_get(camera_t* camera, camera_format_t* format);
+/* 
+ * while buffers are prepared, the format is validated before the stream is
+ * touched, mapped buffers are reused when the driver allows, and a 
+ * streaming camera keeps streaming in the new format
+ */
 bool camera_config_set(camera_t* camera, const camera_format_t* format);
 
+typedef struct {
+  uint32_t format;
+  double bytes_per_pixel; /* transfer size, an estimate when compressed */
+  double cost_per_pixel; /* relative host cost to decode or convert */
+} camera_format_cost_t;
+
+typedef struct {
+  double min_fps;
+  uint32_t min_width;
+  uint32_t min_height;
+  uint32_t max_width; /* 0 as unlimited */
+  uint32_t max_height; /* 0 as unlimited */
+  const uint32_t* prefer; /* format ids ordered by preference */
+  size_t prefer_length;
+  double bandwidth; /* bytes per second, 0 as unlimited */
+  const camera_format_cost_t* costs; /* overrides of the built-in costs */
+  size_t cost_length;
+} camera_mode_request_t;
+
+/* 
+ * picks the largest mode satisfying the request, then by preference order
+ * and lowest cost (pixels * fps * cost_per_pixel); the slowest interval 
+ * reaching min_fps is used. false when no mode satisfies it
+ */
+bool camera_formats_select(const camera_formats_t* formats, 
+                           const camera_mode_request_t* request,
+                           camera_format_t* mode);
+
+/* sensor area in pixels, as struct v4l2_rect */
+typedef struct {
+  int32_t left;
+  int32_t top;
+  uint32_t width;
+  uint32_t height;
+} camera_rect_t;
+/* VIDIOC_G_SELECTION or the legacy VIDIOC_CROPCAP; false without cropping */
+bool camera_crop_bounds(camera_t* camera, camera_rect_t* bounds, 
+                        camera_rect_t* defrect);
+bool camera_crop_get(camera_t* camera, camera_rect_t* rect);
+/* 
+ * rect is updated to the crop the driver chose; the stream is restarted 
+ * only when the driver refuses to crop while streaming, and buffers are
+ * reallocated only when the resulting format does not fit them
+ */
+bool camera_crop_set(camera_t* camera, camera_rect_t* rect);
+
 
 typedef enum {
   CAMERA_CTRL_INTEGER = 1,
@@ -119,17 +596,272 @@ typedef struct {
   camera_menus_t menus;
 } camera_control_t;
 
-typedef struct {
+typedef struct camera_controls_s {
   size_t length;
   camera_control_t* head;
 } camera_controls_t;
   
+/* enumerates all control classes via V4L2_CTRL_FLAG_NEXT_CTRL */
 camera_controls_t* camera_controls_new(const camera_t* camera);
 void camera_controls_delete(camera_controls_t* controls);
+/* cached on the camera: built on first use, freed by camera_close() */
+const camera_controls_t* camera_controls(camera_t* camera);
+void camera_controls_invalidate(camera_t* camera);
 bool camera_control_get(camera_t* camera, uint32_t id, int32_t* value);
 bool camera_control_set(camera_t* camera, uint32_t id, int32_t value);
 
 
+typedef enum {
+  CAMERA_EVENT_EOS = 2,
+  CAMERA_EVENT_CONTROL = 3,
+  CAMERA_EVENT_SOURCE_CHANGE = 5,
+} camera_event_type_t;
+
+typedef struct {
+  camera_event_type_t type;
+  uint32_t id;
+  uint32_t sequence;
+  struct {
+    unsigned value: 1;
+    unsigned flags: 1;
+    unsigned range: 1;
+    unsigned resolution: 1;
+  } changes;
+  /* CAMERA_EVENT_CONTROL only */
+  int64_t value;
+  uint32_t flags;
+  int32_t max;
+  int32_t min;
+  int32_t step;
+  int32_t default_value;
+} camera_event_t;
+
+/* events are signaled as POLLPRI on camera->fd */
+bool camera_events_subscribe(camera_t* camera);
+bool camera_events_unsubscribe(camera_t* camera);
+/* false when no event is pending; drops cached tables the event outdates */
+bool camera_event_dequeue(camera_t* camera, camera_event_t* event);
+
+
+/* 
+ * recorder: appends sink frames to rotated segment files from a writer
+ * thread; "<path>/<prefix>-<epoch ms>.seg" holds the frames and ".idx"
+ * holds their timestamp index
+ */
+typedef struct {
+  const char* path; /* directory, default "." */
+  const char* prefix; /* default "camera" */
+  uint64_t segment_bytes; /* rotate size, default 256MiB */
+  uint64_t segment_ns; /* rotate duration, 0 for size only */
+  size_t queue_bytes; /* frames in flight, default 64MiB */
+} camera_recorder_config_t;
+typedef struct {
+  uint64_t frames;
+  uint64_t bytes;
+  uint64_t dropped; /* queue full */
+  uint64_t segments;
+  int error; /* errno of the first write failure */
+} camera_recorder_stats_t;
+typedef struct camera_recorder_s camera_recorder_t;
+
+camera_recorder_t* camera_recorder_new(const camera_recorder_config_t* config);
+bool camera_recorder_push(camera_recorder_t* recorder, 
+                          const camera_frame_t* frame);
+/* camera_sink_func_t for camera_sink_add(camera, camera_recorder_sink, r) */
+void camera_recorder_sink(const camera_frame_t* frame, void* pointer);
+void camera_recorder_stats(camera_recorder_t* recorder, 
+                           camera_recorder_stats_t* stats);
+/* flushes queued frames to disk and joins the writer; stats may be NULL */
+bool camera_recorder_delete(camera_recorder_t* recorder, 
+                            camera_recorder_stats_t* stats);
+
+/* 
+ * pre-event ring: keeps the latest sink frames within a preallocated
+ * arena, optionally deflated; dumps may run on another thread while
+ * frames keep coming, the ones being dumped are never overwritten
+ */
+typedef struct {
+  size_t arena_bytes; /* default 64MiB */
+  uint64_t max_ns; /* retention, default 10s */
+  bool compress; /* zlib at its fastest level, worth it for YUYV */
+} camera_preevent_config_t;
+typedef struct {
+  uint64_t frames;
+  uint64_t bytes; /* in the arena */
+  uint64_t raw_bytes;
+  uint64_t duration; /* ns from the first to the last frame */
+  uint64_t dropped; /* a dump held the space */
+} camera_preevent_stats_t;
+typedef struct camera_preevent_s camera_preevent_t;
+/* frames are passed oldest first and decompressed */
+typedef bool (*camera_preevent_func_t)(const camera_frame_t* frame, 
+                                       void* pointer);
+
+camera_preevent_t* camera_preevent_new(const camera_preevent_config_t* config);
+bool camera_preevent_push(camera_preevent_t* ring, 
+                          const camera_frame_t* frame);
+void camera_preevent_sink(const camera_frame_t* frame, void* pointer);
+void camera_preevent_stats(camera_preevent_t* ring, 
+                           camera_preevent_stats_t* stats);
+bool camera_preevent_dump(camera_preevent_t* ring, 
+                          camera_preevent_func_t func, void* pointer);
+/* as a segment file (and its .idx) for camera_segment_open() */
+bool camera_preevent_write(camera_preevent_t* ring, const char* path,
+                           camera_preevent_stats_t* stats);
+/* waits for a running dump */
+void camera_preevent_delete(camera_preevent_t* ring);
+
+/* replay: the segment is memory-mapped, frames point into the mapping */
+typedef struct camera_segment_s camera_segment_t;
+camera_segment_t* camera_segment_open(const char* path);
+size_t camera_segment_length(const camera_segment_t* segment);
+bool camera_segment_frame(const camera_segment_t* segment, size_t index,
+                          camera_frame_t* frame);
+/* index of the last frame at or before timestamp, or length when none */
+size_t camera_segment_find(const camera_segment_t* segment, 
+                           uint64_t timestamp);
+void camera_segment_close(camera_segment_t* segment);
+
+/* 
+ * capture thread: dequeues frames and runs the sinks off the caller's
+ * thread, optionally pinned to cpus at SCHED_FIFO priority (or a nice
+ * value when that is not permitted) with the buffers locked in memory;
+ * wanted frames are copied into a back buffer swapped into head on
+ * camera_thread_retrieve(). Other threads changing the stream, buffers
+ * or sinks of the camera hold camera_thread_lock() meanwhile, or park
+ * the thread for long changes so the lock stays free for its stats
+ */
+typedef struct {
+  const int* cpus; /* affinity, none when cpu_count is 0 */
+  size_t cpu_count;
+  int priority; /* SCHED_FIFO 1-99, 0 keeps SCHED_OTHER */
+  int nice; /* when priority is 0 or refused */
+  bool lock; /* mlock capture buffers, head and back buffer */
+  void (*notify)(void* pointer); /* called on the thread per wanted frame */
+  void* pointer;
+} camera_thread_config_t;
+typedef struct {
+  uint64_t wakeups;
+  uint64_t retrieved;
+  int policy; /* SCHED_FIFO or SCHED_OTHER as applied */
+  int priority;
+  int nice;
+  bool pinned;
+  bool locked;
+  int error; /* errno of the last refused setting */
+  camera_histogram_t latency; /* driver timestamp to the thread woken */
+} camera_thread_stats_t;
+typedef struct camera_thread_s camera_thread_t;
+
+camera_thread_t* 
+camera_thread_start(camera_t* camera, const camera_thread_config_t* config);
+void camera_thread_stop(camera_thread_t* thread);
+void camera_thread_lock(camera_thread_t* thread);
+/* also wakes the thread to see the changes */
+void camera_thread_unlock(camera_thread_t* thread);
+/* whether frames are copied for camera_thread_retrieve() */
+void camera_thread_want(camera_thread_t* thread, bool want);
+/* drops the frame not retrieved yet; with the lock held, after changing 
+ * the format, crop or buffers */
+void camera_thread_discard(camera_thread_t* thread);
+/* waits until the thread is off the camera and keeps it there without
+ * the lock held; unparking drops the frame not retrieved yet. For
+ * changes of the stream that may take long, not to run with the lock */
+void camera_thread_park(camera_thread_t* thread);
+void camera_thread_unpark(camera_thread_t* thread);
+/* swaps the latest wanted frame into head; false when none is new */
+bool camera_thread_retrieve(camera_thread_t* thread);
+void camera_thread_stats(camera_thread_t* thread, 
+                         camera_thread_stats_t* stats);
+
+/* 
+ * streaming: frames are passed to func in their mapped buffers without 
+ * copying into head, and stay with the caller until camera_stream_release()
+ * (from any thread); the driver drops frames while the caller holds every
+ * buffer. The loop runs in camera_stream_run() or on its own thread; the 
+ * camera's buffers must not be reallocated meanwhile
+ */
+typedef struct {
+  camera_frame_t frame;
+  int index; /* of the mapped buffer */
+} camera_stream_frame_t;
+typedef struct camera_stream_s camera_stream_t;
+/* frame is NULL once when the loop ends on an error (camera_stream_error) */
+typedef void (*camera_stream_func_t)(camera_stream_t* stream, 
+                                     const camera_stream_frame_t* frame,
+                                     void* pointer);
+typedef struct {
+  bool thread; /* run the loop on its own thread */
+  int timeout; /* ms without a frame ending the loop, 0 waits forever */
+} camera_stream_config_t;
+
+/* starts streaming unless already; config may be NULL */
+camera_stream_t* 
+camera_stream_start(camera_t* camera, camera_stream_func_t func, 
+                    void* pointer, const camera_stream_config_t* config);
+/* the loop on the caller's thread until camera_stream_stop(); false on
+ * errors, e.g. ETIMEDOUT */
+bool camera_stream_run(camera_stream_t* stream);
+/* from any thread, also from func */
+void camera_stream_stop(camera_stream_t* stream);
+bool camera_stream_release(camera_stream_t* stream, 
+                           const camera_stream_frame_t* frame);
+/* errno that ended the loop, 0 when none */
+int camera_stream_error(const camera_stream_t* stream);
+/* joins the loop thread and requeues frames still held (release them 
+ * first); stops streaming when camera_stream_start() started it */
+bool camera_stream_end(camera_stream_t* stream);
+
+/* 
+ * synchronizer: frames of several streaming cameras are held in their
+ * mapped buffers and matched into sets by driver timestamp, a set being
+ * one frame per camera within the skew tolerance; a frame that cannot 
+ * match any more is requeued uncopied. The cameras share the timestamp 
+ * clock (V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC); not thread safe
+ */
+#define CAMERA_SYNC_MAX 8
+typedef struct {
+  uint64_t tolerance; /* ns between the earliest and latest frame of a set */
+  size_t hold; /* frames held per camera, 0 for all buffers but one */
+} camera_sync_config_t;
+typedef struct {
+  size_t count;
+  camera_stream_frame_t frames[CAMERA_SYNC_MAX]; /* by camera */
+  uint32_t streams[CAMERA_SYNC_MAX]; /* camera->streams when dequeued */
+  uint64_t timestamp; /* of the earliest frame */
+  uint64_t skew; /* latest - earliest in ns */
+} camera_sync_set_t;
+typedef struct {
+  uint64_t sets;
+  uint64_t dropped; /* frames requeued unmatched */
+  uint64_t incomplete; /* sets dropped for missing frames */
+  uint64_t camera_dropped[CAMERA_SYNC_MAX];
+  uint64_t gaps[CAMERA_SYNC_MAX]; /* sequence numbers skipped by drivers */
+  camera_histogram_t skew;
+} camera_sync_stats_t;
+typedef struct camera_sync_s camera_sync_t;
+
+camera_sync_t* camera_sync_new(camera_t* const* cameras, size_t count,
+                               const camera_sync_config_t* config);
+/* frame and index as from camera_dequeue() of camera i, held until it is 
+ * matched or dropped; warm-up frames (index -1) are ignored */
+void camera_sync_offer(camera_sync_t* sync, size_t i, 
+                       const camera_frame_t* frame, int index);
+/* the next matched set, false until every camera holds a frame that fits;
+ * the frames stay with the caller until camera_sync_release() */
+bool camera_sync_take(camera_sync_t* sync, camera_sync_set_t* set);
+bool camera_sync_release(camera_sync_t* sync, const camera_sync_set_t* set);
+/* requeues the frames held for camera i, e.g. before reconfiguring it */
+void camera_sync_flush(camera_sync_t* sync, size_t i);
+/* dequeues from every camera until a set is matched; false with errno 
+ * ETIMEDOUT after timeout ms without frames (0 waits forever) */
+bool camera_sync_wait(camera_sync_t* sync, camera_sync_set_t* set, 
+                      int timeout);
+void camera_sync_stats(const camera_sync_t* sync, 
+                       camera_sync_stats_t* stats);
+/* requeues the frames still held (release sets first) */
+void camera_sync_delete(camera_sync_t* sync);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,184 @@
+#define _POSIX_C_SOURCE 200809L
+#include "capture.h"
+#include <string.h>
+
+/*
+ * temporal filter on the raw samples: each keeps an 8.8 fixed point
+ * average moved toward the new sample by a weight in 1/256; a still
+ * sample weighs 256/frames, differences up to the threshold raise it
+ * linearly to 256, so moving edges are taken as they are instead of
+ * smeared. Luma and chroma alike, the loops are branch free for the
+ * compiler to vectorize. The stack sums the unfiltered frames
+ */
+
+#define DENOISE_STACK_MAX (1u << 24) /* 255 x frames fits in 32 bits */
+
+struct camera_denoise_s {
+  uint32_t base; /* weight of a still sample */
+  uint32_t slope; /* weight per difference level, in 1/256 */
+  bool filter;
+  bool stack;
+  /* layout the accumulators were started for */
+  uint32_t format;
+  uint32_t width;
+  uint32_t height;
+  size_t length;
+  uint16_t* average;
+  uint32_t* sum;
+  uint32_t count;
+  bool seen;
+  uint32_t next_sequence;
+};
+
+bool camera_denoise_supported(uint32_t format)
+{
+  switch (format) {
+  case V4L2_PIX_FMT_YUYV: case V4L2_PIX_FMT_YVYU:
+  case V4L2_PIX_FMT_UYVY: case V4L2_PIX_FMT_VYUY:
+  case V4L2_PIX_FMT_NV12: case V4L2_PIX_FMT_NV12M:
+  case V4L2_PIX_FMT_NV21: case V4L2_PIX_FMT_NV21M:
+  case V4L2_PIX_FMT_NV16: case V4L2_PIX_FMT_NV16M:
+  case V4L2_PIX_FMT_NV61: case V4L2_PIX_FMT_NV61M:
+  case V4L2_PIX_FMT_YUV420: case V4L2_PIX_FMT_YUV420M:
+  case V4L2_PIX_FMT_YVU420: case V4L2_PIX_FMT_YVU420M:
+  case V4L2_PIX_FMT_YUV422P:
+  case V4L2_PIX_FMT_GREY:
+  case V4L2_PIX_FMT_RGB24: case V4L2_PIX_FMT_BGR24:
+  case V4L2_PIX_FMT_SBGGR8: case V4L2_PIX_FMT_SGBRG8:
+  case V4L2_PIX_FMT_SGRBG8: case V4L2_PIX_FMT_SRGGB8:
+    return true;
+  default:
+    return false;
+  }
+}
+
+camera_denoise_t* camera_denoise_new(const camera_denoise_config_t* config)
+{
+  camera_denoise_t* denoise = calloc(1, sizeof (camera_denoise_t));
+  if (!denoise) return NULL;
+  const uint32_t frames = config->frames > 256 ? 256 : config->frames;
+  denoise->filter = frames > 1;
+  denoise->base = frames > 1 ? 256 / frames : 256;
+  denoise->slope = config->threshold > 0 ?
+    ((256 - denoise->base) << 8) / config->threshold : 0;
+  denoise->stack = config->stack;
+  return denoise;
+}
+
+void camera_denoise_delete(camera_denoise_t* denoise)
+{
+  if (!denoise) return;
+  free(denoise->average);
+  free(denoise->sum);
+  free(denoise);
+}
+
+/* restarts on the first frame or another layout */
+static bool denoise_layout(camera_denoise_t* denoise,
+                           const camera_image_t* image, size_t length)
+{
+  if (denoise->length == length && denoise->format == image->format &&
+      denoise->width == image->width && denoise->height == image->height)
+    return true;
+  free(denoise->average);
+  free(denoise->sum);
+  denoise->average = NULL;
+  denoise->sum = NULL;
+  denoise->length = 0;
+  denoise->count = 0;
+  if (denoise->filter) {
+    denoise->average = malloc(length * sizeof (uint16_t));
+    if (!denoise->average) return false;
+  }
+  if (denoise->stack) {
+    denoise->sum = calloc(length, sizeof (uint32_t));
+    if (!denoise->sum) {
+      free(denoise->average);
+      denoise->average = NULL;
+      return false;
+    }
+  }
+  denoise->format = image->format;
+  denoise->width = image->width;
+  denoise->height = image->height;
+  denoise->length = length;
+  return false;
+}
+
+static void denoise_start(uint16_t* restrict average,
+                          const uint8_t* restrict pixels, size_t length)
+{
+  for (size_t i = 0; i < length; i++) average[i] = pixels[i] << 8;
+}
+
+static void denoise_filter(uint16_t* restrict average,
+                           uint8_t* restrict pixels, size_t length,
+                           int32_t base, int32_t slope)
+{
+  for (size_t i = 0; i < length; i++) {
+    const int32_t last = average[i];
+    const int32_t diff = (pixels[i] << 8) - last;
+    const int32_t level = (diff < 0 ? -diff : diff) >> 8;
+    const int32_t ramp = base + ((level * slope) >> 8);
+    const int32_t weight = ramp < 256 ? ramp : 256;
+    const int32_t next = last + diff * weight / 256;
+    average[i] = next;
+    pixels[i] = (next + 128) >> 8;
+  }
+}
+
+/* 256 less the part of a still sample kept over the frames missed */
+static int32_t denoise_base(const camera_denoise_t* denoise, uint32_t gap)
+{
+  const uint32_t keep = 256 - denoise->base;
+  uint32_t kept = keep;
+  for (uint32_t i = 0; i < gap && kept > 0; i++) kept = kept * keep / 256;
+  return 256 - kept;
+}
+
+static void denoise_sum(uint32_t* restrict sum,
+                        const uint8_t* restrict pixels, size_t length)
+{
+  for (size_t i = 0; i < length; i++) sum[i] += pixels[i];
+}
+
+bool camera_denoise_frame(camera_denoise_t* denoise,
+                          const camera_image_t* image, uint32_t sequence,
+                          uint8_t* pixels, size_t length)
+{
+  if (!camera_denoise_supported(image->format) || length == 0) return false;
+  const bool started = denoise_layout(denoise, image, length);
+  if (denoise->length != length) return false;
+  const uint32_t gap = denoise->seen && sequence > denoise->next_sequence ?
+    sequence - denoise->next_sequence : 0;
+  denoise->seen = true;
+  denoise->next_sequence = sequence + 1;
+  if (denoise->stack && denoise->count < DENOISE_STACK_MAX) {
+    denoise_sum(denoise->sum, pixels, length);
+    denoise->count++;
+  }
+  if (!denoise->filter) return true;
+  if (started) {
+    denoise_filter(denoise->average, pixels, length,
+                   denoise_base(denoise, gap), denoise->slope);
+  } else {
+    denoise_start(denoise->average, pixels, length);
+  }
+  return true;
+}
+
+size_t camera_denoise_stacked(camera_denoise_t* denoise, uint8_t* out,
+                              size_t length, bool reset)
+{
+  const uint32_t count = denoise->count;
+  if (!denoise->sum || count == 0 || length != denoise->length) return 0;
+  uint32_t* sum = denoise->sum;
+  for (size_t i = 0; i < length; i++) {
+    out[i] = (sum[i] + count / 2) / count;
+  }
+  if (reset) {
+    memset(sum, 0, length * sizeof (uint32_t));
+    denoise->count = 0;
+  }
+  return count;
+}
@@ -1,5 +1,4 @@
 var http = require("http");
-var pngjs = require("pngjs");
 var v4l2camera = require("../");
 
 var server = http.createServer(function (req, res) {
@@ -19,12 +18,23 @@ var server = http.createServer(function (req, res) {
         return;
     }
     if (req.url.match(/^\/.+\.png$/)) {
-        res.writeHead(200, {
-            "content-type": "image/png",
-            "cache-control": "no-cache",
+        // frames are captured on request: without viewers the camera pauses
+        return cam.capture(function (captured) {
+            if (!captured) {
+                res.writeHead(503);
+                return res.end();
+            }
+            cam.toPNG({level: 1}).then(function (png) {
+                res.writeHead(200, {
+                    "content-type": "image/png",
+                    "cache-control": "no-cache",
+                });
+                res.end(png);
+            }, function (err) {
+                res.writeHead(500);
+                res.end(err.message);
+            });
         });
-        var png = toPng();
-        return png.pack().pipe(res);
     }
 });
 server.listen(3000);
@@ -45,29 +55,7 @@ var script = function () {
     }, false);
 };
 
-var toPng = function () {
-    var rgb = cam.toRGB();
-    var png = new pngjs.PNG({
-        width: cam.width, height: cam.height,
-        deflateLevel: 1, deflateStrategy: 1,
-    });
-    var size = cam.width * cam.height;
-    for (var i = 0; i < size; i++) {
-        png.data[i * 4 + 0] = rgb[i * 3 + 0];
-        png.data[i * 4 + 1] = rgb[i * 3 + 1];
-        png.data[i * 4 + 2] = rgb[i * 3 + 2];
-        png.data[i * 4 + 3] = 255;
-    }
-    return png;
-};
-
-var cam = new v4l2camera.Camera("/dev/video0")
-if (cam.configGet().formatName !== "YUYV") {
-    console.log("YUYV camera required");
-    process.exit(1);
-}
+var cam = new v4l2camera.Camera("/dev/video0");
 cam.configSet({width: 352, height: 288});
+cam.idlePolicy({timeout: 3000, warmup: 5});
 cam.start();
-cam.capture(function loop() {
-    cam.capture(loop);
-});
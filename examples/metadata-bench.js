@@ -0,0 +1,84 @@
+// cost of the metadata objects: the formats and controls tables built on
+// their first access, the per frame metadata and the objects of
+// configGet() and stats(); runs on builds before and after a change
+//   node --expose-gc examples/metadata-bench.js [device] [rounds]
+// (with --expose-gc each camera is closed after its round, not when the
+// collector gets to it)
+
+var main = function () {
+    var v4l2camera = require("../");
+
+    var device = process.argv[2] || "/dev/video0";
+    var rounds = Number(process.argv[3]) || 100;
+
+    var modes = 0, controls = 0, spent = 0;
+    for (var i = 0; i < rounds; i++) {
+        var fresh = new v4l2camera.Camera(device);
+        var begin = now();
+        modes = fresh.formats.length;
+        controls = fresh.controls.length;
+        spent += now() - begin;
+        fresh = null;
+        release();
+    }
+    report("formats + controls", spent, rounds);
+    console.log("  (" + modes + " modes, " + controls + " controls)");
+
+    var cam = new v4l2camera.Camera(device);
+    cam.start();
+    cam.capture(function (captured) {
+        if (!captured) {
+            console.log("capture failed");
+            process.exit(1);
+        }
+        var frameMeta = frameMetaOf(cam);
+        time("frame metadata (" + frameMeta.kind + ")", rounds * 1000,
+             frameMeta);
+        time("configGet()", rounds * 1000, function () {cam.configGet();});
+        time("stats()", rounds * 10, function () {cam.stats();});
+        cam.stop(function () {
+            cam = null;
+            release();
+        });
+    });
+};
+
+// {sequence, timestamp, format, width, height, length} of the captured
+// frame: frameInfo() where the build has it, else the same object put
+// together from configGet() as a "frame" listener had to
+var frameMetaOf = function (cam) {
+    if (typeof cam.frameInfo === "function") {
+        var info = function () {return cam.frameInfo();};
+        info.kind = "frameInfo()";
+        return info;
+    }
+    var assembled = function () {
+        var config = cam.configGet();
+        return {
+            sequence: 0, timestamp: 0, format: config.format,
+            width: config.width, height: config.height, length: 0,
+        };
+    };
+    assembled.kind = "configGet()";
+    return assembled;
+};
+
+// in us
+var now = function () {
+    var t = process.hrtime();
+    return t[0] * 1e6 + t[1] / 1e3;
+};
+var report = function (label, us, count) {
+    console.log(label + ": " + (us / count).toFixed(2) + " us");
+};
+var time = function (label, count, task) {
+    var begin = now();
+    for (var i = 0; i < count; i++) task();
+    report(label, now() - begin, count);
+};
+// a camera no longer referenced closes its device when collected
+var release = function () {
+    if (typeof global.gc === "function") global.gc();
+};
+
+main();
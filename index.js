@@ -1,3 +1,193 @@
+var events = require("events");
 var raw = require("./build/Release/v4l2camera");
 
-exports.Camera = raw.Camera;
+var Camera = raw.Camera;
+Object.setPrototypeOf(Camera.prototype, events.EventEmitter.prototype);
+
+// device events are subscribed only while someone listens to them; a
+// failed subscription is emitted as "error" once and not retried until
+// the last of those listeners is removed
+var deviceEvents = ["control", "sourceChange", "eos"];
+var rewatch = function (cam) {
+    var watch = deviceEvents.some(function (name) {
+        return cam.listenerCount(name) > 0;
+    });
+    if (!watch) cam._watchFailed = false;
+    if (!cam._watchFailed) {
+        try {
+            cam._watchEvents(watch);
+        } catch (error) {
+            cam._watchFailed = true;
+            process.nextTick(function () {
+                cam.emit("error", error);
+            });
+        }
+    }
+    pump(cam);
+};
+// "frame" listeners keep one capture() pending; without them the camera
+// goes idle and may pause streaming (see idlePolicy)
+var pump = function (cam) {
+    if (cam._pumping || cam.listenerCount("frame") === 0) return;
+    cam._pumping = true;
+    cam.capture(function (captured) {
+        cam._pumping = false;
+        if (!captured) return;
+        cam.emit("frame", cam.frameInfo());
+        pump(cam);
+    });
+};
+var start = Camera.prototype.start;
+Camera.prototype.start = function () {
+    var result = start.apply(this, arguments);
+    pump(this);
+    return result;
+};
+["addListener", "on", "once", "prependListener", "prependOnceListener",
+ "removeListener", "off", "removeAllListeners"].forEach(function (method) {
+    var base = events.EventEmitter.prototype[method];
+    if (typeof base !== "function") return;
+    Camera.prototype[method] = function () {
+        var result = base.apply(this, arguments);
+        rewatch(this);
+        return result;
+    };
+});
+
+// a capture() with its own rate off the same stream: e.g. a preview at
+// the camera's rate and analytics at {targetFps: 5}; frames no pending
+// capture takes are requeued natively without a copy or a JS callback
+var Consumer = function (cam, options) {
+    this.camera = cam;
+    this.id = cam._consumerOpen(options);
+};
+Consumer.prototype.capture = function (callback) {
+    this.camera.capture(callback, this.id);
+};
+Consumer.prototype.stats = function () {
+    return this.camera._consumerStats(this.id);
+};
+Consumer.prototype.close = function () {
+    this.camera._consumerClose(this.id);
+};
+Camera.prototype.consumer = function (options) {
+    return new Consumer(this, options);
+};
+
+// frame sets matched across cameras by driver timestamp: "set" events
+// {timestamp, skew, sequences} come with the set in each camera's head
+var Sync = raw.Sync;
+Object.setPrototypeOf(Sync.prototype, events.EventEmitter.prototype);
+
+// promise variants run the device ioctls on the threadpool, one at a time
+var serialize = function (cam, task) {
+    var run = function () {
+        return new Promise(function (resolve, reject) {
+            task(function (err, result) {
+                if (err) reject(err); else resolve(result);
+            });
+        });
+    };
+    var result = (cam._asyncQueue || Promise.resolve()).then(run, run);
+    cam._asyncQueue = result.catch(function () {});
+    return result;
+};
+Camera.open = function (device) {
+    return new Promise(function (resolve, reject) {
+        Camera._openAsync(device, function (err, cam) {
+            if (err) reject(err); else resolve(cam);
+        });
+    });
+};
+Camera.prototype.startAsync = function () {
+    var cam = this;
+    return serialize(cam, function (done) {cam._startAsync(done);}).then(
+        function (result) {
+            pump(cam);
+            return result;
+        });
+};
+Camera.prototype.stopAsync = function () {
+    var cam = this;
+    return serialize(cam, function (done) {cam._stopAsync(done);});
+};
+Camera.prototype.configSetAsync = function (format) {
+    var cam = this;
+    return serialize(cam, function (done) {cam._configSetAsync(format, done);});
+};
+
+// a PNG of the captured frame, encoded on the threadpool; options are
+// {level: 0-9 (1), threads: bands deflated in parallel (1), 0 for all}
+Camera.prototype.toPNG = function (options) {
+    var cam = this;
+    return new Promise(function (resolve, reject) {
+        cam._toPNGAsync(options || {}, function (err, png) {
+            if (err) reject(err); else resolve(png);
+        });
+    });
+};
+
+// periodic "stats" snapshots; the timer does not keep the process alive
+Camera.prototype.watchStats = function (interval, reset) {
+    var cam = this;
+    if (cam._statsTimer) clearInterval(cam._statsTimer);
+    cam._statsTimer = null;
+    if (!(interval > 0)) return;
+    cam._statsTimer = setInterval(function () {
+        cam.emit("stats", cam.stats(reset));
+    }, interval);
+    cam._statsTimer.unref();
+};
+
+// frame slots on a SharedArrayBuffer for passing frames to worker_threads;
+// slot headers are {refs, length, sequence, format, width, height} as
+// int32 and the timestamp (ms) as float64, 32 bytes each (see _frameToSlot)
+var SLOT_HEADER = 32;
+var FramePool = function (slots, slotBytes, buffer) {
+    this.slots = slots;
+    this.slotBytes = slotBytes;
+    this.dataOffset = Math.ceil(slots * SLOT_HEADER / 64) * 64;
+    this.buffer = buffer || 
+        new SharedArrayBuffer(this.dataOffset + slots * slotBytes);
+    this._bytes = new Uint8Array(this.buffer);
+    this._ints = new Int32Array(this.buffer, 0, slots * SLOT_HEADER / 4);
+    this._doubles = new Float64Array(this.buffer, 0, slots * SLOT_HEADER / 8);
+};
+// postMessage(pool.share()) then FramePool.from(message) in the worker
+FramePool.from = function (shared) {
+    return new FramePool(shared.slots, shared.slotBytes, shared.buffer);
+};
+FramePool.prototype.share = function () {
+    return {slots: this.slots, slotBytes: this.slotBytes, buffer: this.buffer};
+};
+FramePool.prototype.frame = function (slot) {
+    var ints = this._ints, base = slot * SLOT_HEADER / 4;
+    return {
+        slot: slot,
+        data: new Uint8Array(this.buffer, 
+                             this.dataOffset + slot * this.slotBytes, 
+                             ints[base + 1]),
+        sequence: ints[base + 2] >>> 0,
+        format: ints[base + 3] >>> 0,
+        width: ints[base + 4] >>> 0,
+        height: ints[base + 5] >>> 0,
+        timestamp: this._doubles[slot * SLOT_HEADER / 8 + 3],
+    };
+};
+// a slot is reused once every holder has released it
+FramePool.prototype.retain = function (slot) {
+    return Atomics.add(this._ints, slot * SLOT_HEADER / 4, 1) + 1;
+};
+FramePool.prototype.release = function (slot) {
+    return Atomics.sub(this._ints, slot * SLOT_HEADER / 4, 1) - 1;
+};
+// copies the captured frame into a free slot held once by the caller,
+// returns the slot or -1 when none is free
+Camera.prototype.frameToPool = function (pool) {
+    return this._frameToSlot(pool._bytes, pool.slots, pool.slotBytes);
+};
+
+exports.Camera = Camera;
+exports.FramePool = FramePool;
+exports.Segment = raw.Segment;
+exports.Sync = Sync;
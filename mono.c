@@ -0,0 +1,313 @@
+#define _POSIX_C_SOURCE 200809L
+#include "capture.h"
+#include <string.h>
+#include <math.h>
+
+#include <pthread.h>
+#include <linux/videodev2.h>
+
+/*
+ * single channel formats: gray and thermal sensors (Y10, Y12, Y16...)
+ * and depth (Z16); samples are widened to 16 bits, then scaled to 8 bits
+ * over a fixed, min/max or percentile range and optionally colored
+ */
+
+typedef enum {
+  MONO_8,
+  MONO_16, /* little endian, the value in the low bits */
+  MONO_16BE,
+  MONO_10P, /* MIPI packed: 4 msb bytes then one byte of their lsbs */
+  MONO_10BPACK, /* 4 samples as a big endian 40 bit stream */
+} mono_packing_t;
+
+typedef struct {
+  uint32_t format;
+  uint8_t packing;
+  uint8_t depth;
+} mono_format_t;
+
+static const mono_format_t mono_formats[] = {
+  {V4L2_PIX_FMT_GREY, MONO_8, 8},
+  {V4L2_PIX_FMT_Y10, MONO_16, 10},
+  {V4L2_PIX_FMT_Y12, MONO_16, 12},
+#ifdef V4L2_PIX_FMT_Y14
+  {V4L2_PIX_FMT_Y14, MONO_16, 14},
+#endif
+  {V4L2_PIX_FMT_Y16, MONO_16, 16},
+#ifdef V4L2_PIX_FMT_Y16_BE
+  {V4L2_PIX_FMT_Y16_BE, MONO_16BE, 16},
+#endif
+  {V4L2_PIX_FMT_Z16, MONO_16, 16},
+#ifdef V4L2_PIX_FMT_Y10P
+  {V4L2_PIX_FMT_Y10P, MONO_10P, 10},
+#endif
+  {V4L2_PIX_FMT_Y10BPACK, MONO_10BPACK, 10},
+};
+
+static const mono_format_t* mono_format(uint32_t format)
+{
+  const size_t count = sizeof mono_formats / sizeof (mono_format_t);
+  for (size_t i = 0; i < count; i++) {
+    if (mono_formats[i].format == format) return &mono_formats[i];
+  }
+  return NULL;
+}
+
+unsigned camera_format_mono(uint32_t format)
+{
+  const mono_format_t* mono = mono_format(format);
+  return mono ? mono->depth : 0;
+}
+
+static uint32_t mono_stride(const mono_format_t* mono, uint32_t width)
+{
+  switch (mono->packing) {
+  case MONO_8: return width;
+  case MONO_10P: case MONO_10BPACK: return (width + 3) / 4 * 5;
+  default: return width * 2;
+  }
+}
+
+static void mono_row(const mono_format_t* mono,
+                     const uint8_t* restrict row, size_t width,
+                     uint16_t* restrict out)
+{
+  switch (mono->packing) {
+  case MONO_8:
+    for (size_t x = 0; x < width; x++) out[x] = row[x];
+    break;
+  case MONO_16:
+    for (size_t x = 0; x < width; x++) {
+      out[x] = row[2 * x] | row[2 * x + 1] << 8;
+    }
+    break;
+  case MONO_16BE:
+    for (size_t x = 0; x < width; x++) {
+      out[x] = row[2 * x] << 8 | row[2 * x + 1];
+    }
+    break;
+  case MONO_10P:
+    for (size_t x = 0; x < width; x++) {
+      const uint8_t* group = row + x / 4 * 5;
+      const unsigned i = x % 4;
+      out[x] = group[i] << 2 | (group[4] >> (2 * i) & 3);
+    }
+    break;
+  case MONO_10BPACK:
+    for (size_t x = 0; x < width; x++) {
+      const uint8_t* group = row + x / 4 * 5;
+      const unsigned bit = x % 4 * 10, byte = bit / 8, shift = bit % 8;
+      const unsigned bits = group[byte] << 8 | group[byte + 1];
+      out[x] = bits >> (6 - shift) & 0x3ff;
+    }
+    break;
+  }
+}
+
+uint16_t* camera_image_samples(const camera_image_t* image,
+                               const uint8_t* start)
+{
+  const mono_format_t* mono = mono_format(image->format);
+  if (!mono || image->plane_count < 1) return NULL;
+  const uint32_t width = image->width, height = image->height;
+  const uint32_t stride = image->planes[0].stride ?
+    image->planes[0].stride : mono_stride(mono, width);
+  if (stride < mono_stride(mono, width)) return NULL;
+  if (image->planes[0].length &&
+      image->planes[0].length < (size_t) stride * (height - 1) +
+      mono_stride(mono, width)) return NULL;
+  uint16_t* samples = malloc((size_t) width * height * sizeof (uint16_t));
+  if (!samples) return NULL;
+  camera_orient_t orient;
+  if (!camera_orient_init(&orient, image->orientation, width, height,
+                          sizeof (uint16_t), (uint8_t*) samples)) {
+    free(samples);
+    return NULL;
+  }
+  const uint8_t* plane = start + image->planes[0].offset;
+  for (uint32_t y = 0; y < height; y++) {
+    mono_row(mono, plane + (size_t) y * stride, width,
+             (uint16_t*) camera_orient_row(&orient, y));
+  }
+  camera_orient_end(&orient);
+  return samples;
+}
+
+
+//[colormaps]
+static uint8_t colormaps[3][256 * 3];
+static pthread_once_t colormaps_once = PTHREAD_ONCE_INIT;
+
+static uint8_t unit8(double v)
+{
+  return v <= 0 ? 0 : v >= 1 ? 255 : (uint8_t) lround(v * 255);
+}
+
+/* turbo by its polynomial approximation (A. Mikhailov, 2019) */
+static double turbo(const double c[6], double x)
+{
+  return c[0] + x * (c[1] + x * (c[2] + x * (c[3] + x * (c[4] + x * c[5]))));
+}
+
+static void colormaps_build(void)
+{
+  static const double red[6] = {
+    0.13572138, 4.61539260, -42.66032258, 132.13108234, -152.94239396,
+    59.28637943,
+  };
+  static const double green[6] = {
+    0.09140261, 2.19418839, 4.84296658, -14.18503333, 4.27729857,
+    2.82956604,
+  };
+  static const double blue[6] = {
+    0.10667330, 12.64194608, -60.58204836, 110.36276771, -89.90310912,
+    27.34824973,
+  };
+  for (int i = 0; i < 256; i++) {
+    const double x = i / 255.0;
+    uint8_t* gray = &colormaps[CAMERA_COLORMAP_GRAY][i * 3];
+    gray[0] = gray[1] = gray[2] = i;
+    uint8_t* jet = &colormaps[CAMERA_COLORMAP_JET][i * 3];
+    jet[0] = unit8(1.5 - fabs(4 * x - 3));
+    jet[1] = unit8(1.5 - fabs(4 * x - 2));
+    jet[2] = unit8(1.5 - fabs(4 * x - 1));
+    uint8_t* tb = &colormaps[CAMERA_COLORMAP_TURBO][i * 3];
+    tb[0] = unit8(turbo(red, x));
+    tb[1] = unit8(turbo(green, x));
+    tb[2] = unit8(turbo(blue, x));
+  }
+}
+
+const uint8_t* camera_colormap(camera_colormap_t map)
+{
+  if (map > CAMERA_COLORMAP_TURBO) return NULL;
+  pthread_once(&colormaps_once, colormaps_build);
+  return colormaps[map];
+}
+
+
+//[normalization]
+/* zeros count as the widest values when ignored, so the loops stay
+ * branch-free */
+static void mono_minmax(const uint16_t* samples, size_t count,
+                        bool ignore_zero, uint16_t* min, uint16_t* max)
+{
+  uint16_t lo = UINT16_MAX, hi = 0;
+  if (ignore_zero) {
+    for (size_t i = 0; i < count; i++) {
+      const uint16_t v = samples[i];
+      const uint16_t v_lo = v | (uint16_t) -(v == 0);
+      lo = v_lo < lo ? v_lo : lo;
+      hi = v > hi ? v : hi;
+    }
+  } else {
+    for (size_t i = 0; i < count; i++) {
+      const uint16_t v = samples[i];
+      lo = v < lo ? v : lo;
+      hi = v > hi ? v : hi;
+    }
+  }
+  *min = lo;
+  *max = hi;
+}
+
+static bool mono_percentile(const uint16_t* samples, size_t count,
+                            const camera_normalize_config_t* config,
+                            unsigned depth, double* low, double* high)
+{
+  const size_t bins = (size_t) 1 << depth;
+  uint32_t* histogram = calloc(bins, sizeof (uint32_t));
+  if (!histogram) return false;
+  const uint16_t mask = bins - 1;
+  for (size_t i = 0; i < count; i++) histogram[samples[i] & mask]++;
+  if (config->ignore_zero) histogram[0] = 0;
+  size_t total = 0;
+  for (size_t i = 0; i < bins; i++) total += histogram[i];
+  const double lo = config->low < 0 ? 0 : config->low;
+  const double hi = config->high > 1 || config->high <= 0 ?
+    1 : config->high;
+  const size_t lo_rank = (size_t) (lo * total);
+  const size_t hi_rank = (size_t) ceil(hi * total);
+  size_t seen = 0, v = 0;
+  for (; v < bins; v++) {
+    seen += histogram[v];
+    if (seen > lo_rank) break;
+  }
+  *low = v;
+  for (; v < bins - 1 && seen < hi_rank; v++) seen += histogram[v + 1];
+  *high = v;
+  free(histogram);
+  return true;
+}
+
+uint8_t* camera_image_normalize(const camera_image_t* image,
+                                const uint8_t* start,
+                                const camera_normalize_config_t* config,
+                                camera_normalize_result_t* result)
+{
+  const mono_format_t* mono = mono_format(image->format);
+  if (!mono) return NULL;
+  uint16_t* samples = camera_image_samples(image, start);
+  if (!samples) return NULL;
+  const size_t count = (size_t) image->width * image->height;
+  uint16_t min, max;
+  mono_minmax(samples, count, config->ignore_zero, &min, &max);
+  if (min > max) min = max = 0; /* every sample ignored */
+  double low = config->low, high = config->high;
+  switch (config->scale) {
+  case CAMERA_SCALE_MINMAX:
+    low = min;
+    high = max;
+    break;
+  case CAMERA_SCALE_PERCENTILE:
+    if (!mono_percentile(samples, count, config, mono->depth, &low, &high)) {
+      free(samples);
+      return NULL;
+    }
+    break;
+  default:
+    if (high <= low) {
+      low = 0;
+      high = (1 << mono->depth) - 1;
+    }
+  }
+  const uint32_t lo = low < 0 ? 0 : low > UINT16_MAX ? UINT16_MAX : low;
+  const uint32_t hi = high <= lo ? lo + 1 : high > UINT16_MAX ?
+    UINT16_MAX + 1 : high;
+  const uint32_t span = hi - lo;
+  const uint32_t mul = (255u << 16) / span;
+  const size_t channels = config->colormap ? 3 : 1;
+  uint8_t* out = malloc(count * channels);
+  if (!out) {
+    free(samples);
+    return NULL;
+  }
+  /* gray first, in place colored from the end backwards */
+  for (size_t i = 0; i < count; i++) {
+    const uint32_t v = samples[i];
+    uint32_t d = v > lo ? v - lo : 0;
+    d = d < span ? d : span;
+    out[i] = (d * mul + 0x8000) >> 16;
+  }
+  if (config->ignore_zero) {
+    for (size_t i = 0; i < count; i++) out[i] = samples[i] ? out[i] : 0;
+  }
+  if (config->colormap) {
+    const uint8_t* map = config->colormap;
+    for (size_t i = count; i-- > 0;) {
+      const bool blank = config->ignore_zero && samples[i] == 0;
+      const uint8_t* rgb = map + out[i] * 3;
+      out[i * 3] = blank ? 0 : rgb[0];
+      out[i * 3 + 1] = blank ? 0 : rgb[1];
+      out[i * 3 + 2] = blank ? 0 : rgb[2];
+    }
+  }
+  free(samples);
+  if (result) {
+    result->min = min;
+    result->max = max;
+    result->low = lo;
+    result->high = hi;
+  }
+  return out;
+}
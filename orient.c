@@ -0,0 +1,147 @@
+#define _POSIX_C_SOURCE 200809L
+#include "capture.h"
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * orientation of converted frames: a conversion asks for the line of each
+ * source row it produces; rows that keep their pixel order go straight to
+ * the output, others are held in a block of rows and placed when it is
+ * full; for 90/270 degrees each column of the block becomes a run of
+ * adjacent pixels, whole cache lines, of an output line
+ */
+
+#define ORIENT_TILE 32
+
+static bool orient_transposed(camera_orientation_t orientation)
+{
+  return orientation == CAMERA_ORIENT_ROTATE_90 ||
+    orientation == CAMERA_ORIENT_ROTATE_270 ||
+    orientation == CAMERA_ORIENT_TRANSPOSE ||
+    orientation == CAMERA_ORIENT_TRANSVERSE;
+}
+
+void camera_orientation_size(camera_orientation_t orientation,
+                             uint32_t width, uint32_t height,
+                             uint32_t* out_width, uint32_t* out_height)
+{
+  const bool transposed = orient_transposed(orientation);
+  *out_width = transposed ? height : width;
+  *out_height = transposed ? width : height;
+}
+
+bool camera_orient_init(camera_orient_t* orient,
+                        camera_orientation_t orientation,
+                        uint32_t width, uint32_t height, size_t bpp,
+                        uint8_t* out)
+{
+  orient->orientation = orientation;
+  orient->width = width;
+  orient->height = height;
+  orient->bpp = bpp;
+  orient->out = out;
+  orient->first = 0;
+  orient->count = 0;
+  orient->rows = NULL;
+  if (orientation == CAMERA_ORIENT_NONE ||
+      orientation == CAMERA_ORIENT_FLIP_V) return true;
+  orient->rows = malloc((size_t) ORIENT_TILE * width * bpp);
+  return orient->rows != NULL;
+}
+
+/* (x, y) of the source to its byte offset in the output */
+static size_t orient_offset(const camera_orient_t* orient,
+                            uint32_t x, uint32_t y)
+{
+  const size_t w = orient->width, h = orient->height;
+  size_t ox = x, oy = y, ow = w;
+  switch (orient->orientation) {
+  case CAMERA_ORIENT_NONE: break;
+  case CAMERA_ORIENT_ROTATE_90: ox = h - 1 - y; oy = x; ow = h; break;
+  case CAMERA_ORIENT_ROTATE_180: ox = w - 1 - x; oy = h - 1 - y; break;
+  case CAMERA_ORIENT_ROTATE_270: ox = y; oy = w - 1 - x; ow = h; break;
+  case CAMERA_ORIENT_FLIP_H: ox = w - 1 - x; break;
+  case CAMERA_ORIENT_FLIP_V: oy = h - 1 - y; break;
+  case CAMERA_ORIENT_TRANSPOSE: ox = y; oy = x; ow = h; break;
+  case CAMERA_ORIENT_TRANSVERSE:
+    ox = h - 1 - y; oy = w - 1 - x; ow = h;
+    break;
+  }
+  return (oy * ow + ox) * orient->bpp;
+}
+
+static inline void orient_pixel(uint8_t* out, const uint8_t* in, size_t bpp)
+{
+  switch (bpp) {
+  case 1: out[0] = in[0]; break;
+  case 2: memcpy(out, in, 2); break;
+  case 3: memcpy(out, in, 3); break;
+  case 4: memcpy(out, in, 4); break;
+  default: memcpy(out, in, bpp);
+  }
+}
+
+static void orient_flush(camera_orient_t* orient)
+{
+  const size_t bpp = orient->bpp, line = (size_t) orient->width * bpp;
+  const uint32_t width = orient->width, count = orient->count;
+  if (!orient_transposed(orient->orientation)) {
+    /* mirrored rows: the last pixel first */
+    for (uint32_t r = 0; r < count; r++) {
+      const uint8_t* in = orient->rows + r * line;
+      uint8_t* out = orient->out +
+        orient_offset(orient, width - 1, orient->first + r);
+      for (uint32_t x = 0; x < width; x++) {
+        orient_pixel(out + (size_t) x * bpp, in + (line - (x + 1) * bpp),
+                     bpp);
+      }
+    }
+    orient->count = 0;
+    return;
+  }
+  /* a source column is an output line: count pixels of it are adjacent,
+   * ascending or descending with the source row */
+  const uint32_t y = orient->first;
+  const bool descending = orient->orientation == CAMERA_ORIENT_ROTATE_90 ||
+    orient->orientation == CAMERA_ORIENT_TRANSVERSE;
+  const ptrdiff_t next = descending ? -(ptrdiff_t) bpp : (ptrdiff_t) bpp;
+  for (uint32_t x = 0; x < width; x++) {
+    uint8_t* out = orient->out + orient_offset(orient, x, y);
+    const uint8_t* in = orient->rows + (size_t) x * bpp;
+    for (uint32_t r = 0; r < count; r++) {
+      orient_pixel(out, in, bpp);
+      out += next;
+      in += line;
+    }
+  }
+  orient->count = 0;
+}
+
+uint8_t* camera_orient_row(camera_orient_t* orient, uint32_t y)
+{
+  const size_t line = (size_t) orient->width * orient->bpp;
+  if (!orient->rows) {
+    return orient->out + orient_offset(orient, 0, y);
+  }
+  if (orient->count == ORIENT_TILE ||
+      (orient->count && y != orient->first + orient->count)) {
+    orient_flush(orient);
+  }
+  if (orient->count == 0) orient->first = y;
+  return orient->rows + orient->count++ * line;
+}
+
+void camera_orient_end(camera_orient_t* orient)
+{
+  if (!orient->rows) return;
+  if (orient->count) orient_flush(orient);
+  free(orient->rows);
+  orient->rows = NULL;
+}
+
+void camera_orientation_set(camera_t* camera, 
+                            camera_orientation_t orientation)
+{
+  camera->orientation = orientation;
+  camera->image.orientation = orientation;
+}
@@ -0,0 +1,293 @@
+#define _POSIX_C_SOURCE 200809L
+#include "capture.h"
+#include <string.h>
+
+#include <pthread.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/*
+ * PNG encoder: bands of rows are filtered and deflated on their own
+ * threads as raw deflate streams, all but the last ended by a sync flush,
+ * so they join into one zlib stream whose adler32 is combined from the
+ * bands'. Back references do not cross bands, costing a little ratio.
+ * Deflate states and buffers stay in the encoder for the next image
+ */
+
+#define PNG_MAX_BANDS 8
+#define PNG_BAND_ROWS 32
+
+typedef struct {
+  z_stream z;
+  bool ready;
+  int level;
+  uint8_t* out;
+  size_t capacity;
+  size_t length;
+  uint8_t* rows; /* filter candidates: none, sub, up, paeth */
+  size_t rows_capacity;
+  uLong adler;
+  size_t raw_length;
+
+  const uint8_t* pixels;
+  uint32_t stride;
+  size_t row_bytes;
+  size_t channels;
+  uint32_t y0, y1;
+  bool last;
+  bool ok;
+} png_band_t;
+
+struct camera_png_s {
+  png_band_t bands[PNG_MAX_BANDS];
+  uint8_t* out;
+  size_t capacity;
+};
+
+camera_png_t* camera_png_new(void)
+{
+  return calloc(1, sizeof (camera_png_t));
+}
+
+void camera_png_delete(camera_png_t* png)
+{
+  if (!png) return;
+  for (size_t i = 0; i < PNG_MAX_BANDS; i++) {
+    png_band_t* band = &png->bands[i];
+    if (band->ready) deflateEnd(&band->z);
+    free(band->out);
+    free(band->rows);
+  }
+  free(png->out);
+  free(png);
+}
+
+static bool reserve(uint8_t** buffer, size_t* capacity, size_t size)
+{
+  if (*capacity >= size) return true;
+  uint8_t* grown = realloc(*buffer, size);
+  if (!grown) return false;
+  *buffer = grown;
+  *capacity = size;
+  return true;
+}
+
+static inline uint8_t paeth(int a, int b, int c)
+{
+  const int p = a + b - c;
+  const int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+/* sum of the filtered bytes as signed, the usual heuristic */
+static unsigned long png_cost(const uint8_t* filtered, size_t bytes)
+{
+  unsigned long sum = 0;
+  for (size_t i = 0; i < bytes; i++) {
+    const int v = filtered[i];
+    sum += v < 128 ? v : 256 - v;
+  }
+  return sum;
+}
+
+/* the filter type byte then the row; prev is NULL for the first row */
+static const uint8_t* png_filter(png_band_t* band, const uint8_t* row,
+                                 const uint8_t* prev)
+{
+  const size_t bytes = band->row_bytes, bpp = band->channels;
+  const size_t line = bytes + 1;
+  uint8_t* none = band->rows;
+  none[0] = 0;
+  memcpy(none + 1, row, bytes);
+  if (band->level == 0) return none;
+  uint8_t* sub = none + line;
+  uint8_t* up = sub + line;
+  uint8_t* pae = up + line;
+  sub[0] = 1;
+  up[0] = 2;
+  pae[0] = 4;
+  for (size_t i = 0; i < bpp; i++) {
+    const uint8_t b = prev ? prev[i] : 0;
+    sub[1 + i] = row[i];
+    up[1 + i] = row[i] - b;
+    pae[1 + i] = row[i] - b; /* paeth(0, b, 0) */
+  }
+  for (size_t i = bpp; i < bytes; i++) {
+    const uint8_t a = row[i - bpp];
+    sub[1 + i] = row[i] - a;
+    if (prev) {
+      up[1 + i] = row[i] - prev[i];
+      pae[1 + i] = row[i] - paeth(a, prev[i], prev[i - bpp]);
+    } else {
+      up[1 + i] = row[i];
+      pae[1 + i] = row[i] - a;
+    }
+  }
+  const uint8_t* best = none;
+  unsigned long least = png_cost(none + 1, bytes);
+  const uint8_t* candidates[3] = {sub, up, pae};
+  for (size_t c = 0; c < 3; c++) {
+    const unsigned long cost = png_cost(candidates[c] + 1, bytes);
+    if (cost < least) {
+      least = cost;
+      best = candidates[c];
+    }
+  }
+  return best;
+}
+
+static void* png_band_main(void* pointer)
+{
+  png_band_t* band = pointer;
+  z_stream* z = &band->z;
+  const size_t line = band->row_bytes + 1;
+  band->raw_length = (size_t) (band->y1 - band->y0) * line;
+  band->adler = adler32(0, Z_NULL, 0);
+  if (!reserve(&band->rows, &band->rows_capacity, line * 4)) return NULL;
+  if (!reserve(&band->out, &band->capacity,
+               deflateBound(z, band->raw_length) + 64)) return NULL;
+  z->next_out = band->out;
+  z->avail_out = band->capacity;
+  int r = Z_OK;
+  for (uint32_t y = band->y0; y < band->y1; y++) {
+    const uint8_t* row = band->pixels + (size_t) y * band->stride;
+    const uint8_t* prev = y > 0 ? row - band->stride : NULL;
+    const uint8_t* filtered = png_filter(band, row, prev);
+    band->adler = adler32(band->adler, filtered, line);
+    z->next_in = (Bytef*) filtered;
+    z->avail_in = line;
+    const int flush = y + 1 < band->y1 ? Z_NO_FLUSH :
+      band->last ? Z_FINISH : Z_SYNC_FLUSH;
+    r = deflate(z, flush);
+    if (r == Z_STREAM_ERROR || z->avail_in != 0) return NULL;
+  }
+  band->length = z->next_out - band->out;
+  band->ok = band->last ? r == Z_STREAM_END : true;
+  return NULL;
+}
+
+static bool png_band_ready(png_band_t* band, int level)
+{
+  if (band->ready && band->level == level) {
+    return deflateReset(&band->z) == Z_OK;
+  }
+  if (band->ready) deflateEnd(&band->z);
+  memset(&band->z, 0, sizeof band->z);
+  band->ready = deflateInit2(&band->z, level, Z_DEFLATED, -15, 8,
+                             Z_FILTERED) == Z_OK;
+  band->level = level;
+  return band->ready;
+}
+
+static uint8_t* put32(uint8_t* p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+  return p + 4;
+}
+
+/* length, type and data are in place: appends the crc */
+static uint8_t* png_chunk_end(uint8_t* chunk, uint8_t* end)
+{
+  const uLong crc = crc32(crc32(0, Z_NULL, 0), chunk + 4, end - chunk - 4);
+  return put32(end, crc);
+}
+
+const uint8_t* camera_png_encode(camera_png_t* png, const uint8_t* pixels,
+                                 uint32_t width, uint32_t height,
+                                 size_t channels, uint32_t stride,
+                                 const camera_png_config_t* config,
+                                 size_t* length)
+{
+  static const uint8_t color_types[5] = {0, 0, 4, 2, 6};
+  if (channels < 1 || channels > 4 || width == 0 || height == 0)
+    return NULL;
+  const int level = config->level < 0 || config->level > 9 ?
+    Z_DEFAULT_COMPRESSION : config->level;
+  const size_t row_bytes = (size_t) width * channels;
+  if (stride == 0) stride = row_bytes;
+
+  size_t count = config->threads;
+  if (count == 0) {
+    const long online = sysconf(_SC_NPROCESSORS_ONLN);
+    count = online > 0 ? (size_t) online : 1;
+  }
+  if (count > PNG_MAX_BANDS) count = PNG_MAX_BANDS;
+  const size_t most = height / PNG_BAND_ROWS;
+  if (count > most) count = most;
+  if (count == 0) count = 1;
+  pthread_t threads[PNG_MAX_BANDS];
+  bool started[PNG_MAX_BANDS] = {false};
+  for (size_t i = 0; i < count; i++) {
+    png_band_t* band = &png->bands[i];
+    if (!png_band_ready(band, level)) return NULL;
+    band->pixels = pixels;
+    band->stride = stride;
+    band->row_bytes = row_bytes;
+    band->channels = channels;
+    band->y0 = (uint64_t) height * i / count;
+    band->y1 = (uint64_t) height * (i + 1) / count;
+    band->last = i + 1 == count;
+    band->ok = false;
+  }
+  for (size_t i = 1; i < count; i++) {
+    started[i] = pthread_create(&threads[i], NULL, png_band_main,
+                                &png->bands[i]) == 0;
+  }
+  png_band_main(&png->bands[0]);
+  bool ok = true;
+  size_t deflated = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (i > 0) {
+      if (started[i]) pthread_join(threads[i], NULL);
+      else png_band_main(&png->bands[i]);
+    }
+    ok = ok && png->bands[i].ok;
+    deflated += png->bands[i].length;
+  }
+  if (!ok) return NULL;
+
+  /* signature, IHDR, IDAT with the zlib header and adler32, IEND */
+  const size_t size = 8 + 25 + 12 + 2 + deflated + 4 + 12;
+  if (!reserve(&png->out, &png->capacity, size)) return NULL;
+  static const uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+  uint8_t* p = png->out;
+  memcpy(p, signature, 8);
+  p += 8;
+  uint8_t* chunk = p;
+  p = put32(p, 13);
+  memcpy(p, "IHDR", 4);
+  p = put32(p + 4, width);
+  p = put32(p, height);
+  *p++ = 8;
+  *p++ = color_types[channels];
+  *p++ = 0;
+  *p++ = 0;
+  *p++ = 0;
+  p = png_chunk_end(chunk, p);
+  chunk = p;
+  p = put32(p, 2 + deflated + 4);
+  memcpy(p, "IDAT", 4);
+  p += 4;
+  /* CMF and FLG with the level hint, a multiple of 31 */
+  *p++ = 0x78;
+  *p++ = level == 0 || level == 1 ? 0x01 : level < 6 ? 0x5e :
+    level == 6 || level == Z_DEFAULT_COMPRESSION ? 0x9c : 0xda;
+  uLong adler = adler32(0, Z_NULL, 0);
+  for (size_t i = 0; i < count; i++) {
+    const png_band_t* band = &png->bands[i];
+    memcpy(p, band->out, band->length);
+    p += band->length;
+    adler = adler32_combine(adler, band->adler, band->raw_length);
+  }
+  p = put32(p, adler);
+  p = png_chunk_end(chunk, p);
+  chunk = p;
+  p = put32(p, 0);
+  memcpy(p, "IEND", 4);
+  p = png_chunk_end(chunk, p + 4);
+  *length = p - png->out;
+  return png->out;
+}
@@ -0,0 +1,352 @@
+#define _GNU_SOURCE
+#include "capture.h"
+#include <string.h>
+#include <errno.h>
+
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+struct camera_thread_s {
+  camera_t* camera;
+  cpu_set_t cpus;
+  size_t cpu_count;
+  int priority;
+  int nice;
+  bool lock;
+  void (*notify)(void* pointer);
+  void* pointer;
+
+  pthread_t thread;
+  pthread_mutex_t mutex; /* held while the thread touches the camera */
+  pthread_cond_t parking; /* of park and parked */
+  int wake; /* eventfd */
+  bool stop;
+  bool park;
+  bool parked;
+  bool want;
+  uint64_t woken;
+
+  /* latest wanted frame, swapped into head by camera_thread_retrieve() */
+  uint8_t* back;
+  size_t capacity;
+  size_t length;
+  /* of the copy: its plane offsets and lengths go to camera->image, the
+   * rest must still be the camera's or the copy is of an older format */
+  camera_image_t image;
+  uint64_t timestamp;
+  uint32_t sequence;
+  bool fresh;
+
+  const camera_buffer_t* locked_buffers;
+  camera_thread_stats_t stats;
+};
+
+static void thread_wake(camera_thread_t* thread)
+{
+  const uint64_t one = 1;
+  if (write(thread->wake, &one, sizeof one) == -1) {
+    // already pending
+  }
+}
+
+static void thread_setup(camera_thread_t* thread)
+{
+  camera_thread_stats_t* stats = &thread->stats;
+  stats->policy = SCHED_OTHER;
+  if (thread->cpu_count > 0) {
+    int r = pthread_setaffinity_np(pthread_self(), sizeof thread->cpus,
+                                   &thread->cpus);
+    stats->pinned = r == 0;
+    if (r != 0) stats->error = r;
+  }
+  if (thread->priority > 0) {
+    struct sched_param param;
+    memset(&param, 0, sizeof param);
+    param.sched_priority = thread->priority;
+    int r = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (r == 0) {
+      stats->policy = SCHED_FIFO;
+      stats->priority = thread->priority;
+      return;
+    }
+    stats->error = r;
+  }
+  if (thread->nice != 0) {
+    /* per thread on linux */
+    const id_t tid = syscall(SYS_gettid);
+    if (setpriority(PRIO_PROCESS, tid, thread->nice) == 0) {
+      stats->nice = thread->nice;
+    } else {
+      stats->error = errno;
+    }
+  }
+}
+
+/* buffers are locked again after the camera has reallocated them */
+static void thread_mlock(camera_thread_t* thread)
+{
+  camera_t* camera = thread->camera;
+  if (!thread->lock || thread->locked_buffers == camera->buffers) return;
+  thread->locked_buffers = camera->buffers;
+  bool locked = true;
+  const size_t count = camera->buffer_count * camera->plane_count;
+  for (size_t i = 0; i < count; i++) {
+    const camera_buffer_t* buffer = &camera->buffers[i];
+    locked = mlock(buffer->start, buffer->length) == 0 && locked;
+  }
+  if (camera->head.start)
+    locked = mlock(camera->head.start, camera->head_capacity) == 0 && locked;
+  if (thread->back)
+    locked = mlock(thread->back, thread->capacity) == 0 && locked;
+  if (!locked) thread->stats.error = errno;
+  thread->stats.locked = locked;
+}
+
+/* copies wanted frames into the back buffer; runs under the mutex */
+static void thread_sink(const camera_frame_t* frame, void* pointer)
+{
+  camera_thread_t* thread = pointer;
+  camera_t* camera = thread->camera;
+  if (frame->timestamp && frame->timestamp <= thread->woken) {
+    camera_histogram_record(&thread->stats.latency,
+                            thread->woken - frame->timestamp);
+  }
+  if (!thread->want) return;
+  if (!camera_rate_take(&camera->rate, camera_frame_time(camera, frame)))
+    return;
+  const uint64_t begin = camera_now();
+  if (thread->capacity != camera->head_capacity) {
+    free(thread->back);
+    thread->capacity = camera->head_capacity;
+    thread->back = malloc(thread->capacity);
+    if (!thread->back) thread->capacity = 0;
+    if (thread->back && thread->lock &&
+        mlock(thread->back, thread->capacity) != 0) {
+      thread->stats.error = errno;
+      thread->stats.locked = false;
+    }
+  }
+  if (camera_frame_size(frame) > thread->capacity) return;
+  thread->image = camera->image;
+  size_t offset = 0;
+  for (size_t p = 0; p < frame->plane_count; p++) {
+    memcpy(thread->back + offset, frame->planes[p].start,
+           frame->planes[p].length);
+    if (camera->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+      thread->image.planes[p].offset = offset;
+      thread->image.planes[p].length = frame->planes[p].length;
+    }
+    offset += frame->planes[p].length;
+  }
+  if (thread->image.plane_count == 1) thread->image.planes[0].length = offset;
+  thread->length = offset;
+  camera_stage_record(camera, CAMERA_STAGE_COPY, begin);
+  if (camera->denoise) {
+    const uint64_t filtered = camera_now();
+    camera_denoise_frame(camera->denoise, &thread->image, frame->sequence,
+                         thread->back, offset);
+    camera_stage_record(camera, CAMERA_STAGE_DENOISE, filtered);
+  }
+  thread->timestamp = frame->timestamp;
+  thread->sequence = frame->sequence;
+  thread->fresh = true;
+  if (thread->notify) thread->notify(thread->pointer);
+}
+
+static void* thread_main(void* pointer)
+{
+  camera_thread_t* thread = pointer;
+  camera_t* camera = thread->camera;
+  pthread_mutex_lock(&thread->mutex);
+  thread_setup(thread);
+  while (!thread->stop) {
+    if (thread->park) {
+      thread->parked = true;
+      pthread_cond_broadcast(&thread->parking);
+      while (thread->park && !thread->stop) {
+        pthread_cond_wait(&thread->parking, &thread->mutex);
+      }
+      thread->parked = false;
+      continue;
+    }
+    thread_mlock(thread);
+    struct pollfd fds[2] = {
+      {thread->wake, POLLIN, 0}, {camera->fd, POLLIN, 0},
+    };
+    const nfds_t count = camera->streaming ? 2 : 1;
+    pthread_mutex_unlock(&thread->mutex);
+    int r = poll(fds, count, -1);
+    const uint64_t woken = camera_now();
+    pthread_mutex_lock(&thread->mutex);
+    if (r == -1) continue;
+    if (fds[0].revents & POLLIN) {
+      uint64_t value;
+      if (read(thread->wake, &value, sizeof value) == -1) {
+        // drained by an earlier wake
+      }
+      continue;
+    }
+    if (!camera->streaming) continue;
+    if (fds[1].revents & POLLIN) {
+      thread->woken = woken;
+      thread->stats.wakeups++;
+      camera_grab(camera, false);
+    } else if (fds[1].revents & (POLLERR | POLLHUP)) {
+      /* the stream went away under us: wait for a wake */
+      pthread_mutex_unlock(&thread->mutex);
+      struct pollfd wake = {thread->wake, POLLIN, 0};
+      poll(&wake, 1, 100);
+      pthread_mutex_lock(&thread->mutex);
+    }
+  }
+  pthread_mutex_unlock(&thread->mutex);
+  return NULL;
+}
+
+
+camera_thread_t*
+camera_thread_start(camera_t* camera, const camera_thread_config_t* config)
+{
+  camera_thread_t* thread = calloc(1, sizeof (camera_thread_t));
+  if (!thread) return NULL;
+  thread->camera = camera;
+  CPU_ZERO(&thread->cpus);
+  for (size_t i = 0; i < config->cpu_count; i++) {
+    if (config->cpus[i] < 0 || config->cpus[i] >= CPU_SETSIZE) continue;
+    CPU_SET(config->cpus[i], &thread->cpus);
+    thread->cpu_count++;
+  }
+  thread->priority = config->priority;
+  thread->nice = config->nice;
+  thread->lock = config->lock;
+  thread->notify = config->notify;
+  thread->pointer = config->pointer;
+  thread->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (thread->wake == -1) goto fail;
+  if (!camera_sink_add(camera, thread_sink, thread)) goto fail;
+  pthread_mutex_init(&thread->mutex, NULL);
+  pthread_cond_init(&thread->parking, NULL);
+  int r = pthread_create(&thread->thread, NULL, thread_main, thread);
+  if (r == 0) return thread;
+  errno = r;
+  camera_sink_remove(camera, thread_sink, thread);
+  pthread_cond_destroy(&thread->parking);
+  pthread_mutex_destroy(&thread->mutex);
+fail:
+  if (thread->wake != -1) close(thread->wake);
+  free(thread);
+  return NULL;
+}
+
+void camera_thread_stop(camera_thread_t* thread)
+{
+  pthread_mutex_lock(&thread->mutex);
+  thread->stop = true;
+  pthread_cond_broadcast(&thread->parking);
+  pthread_mutex_unlock(&thread->mutex);
+  thread_wake(thread);
+  pthread_join(thread->thread, NULL);
+  camera_sink_remove(thread->camera, thread_sink, thread);
+  pthread_cond_destroy(&thread->parking);
+  pthread_mutex_destroy(&thread->mutex);
+  close(thread->wake);
+  free(thread->back);
+  free(thread);
+}
+
+void camera_thread_lock(camera_thread_t* thread)
+{
+  pthread_mutex_lock(&thread->mutex);
+}
+
+void camera_thread_unlock(camera_thread_t* thread)
+{
+  pthread_mutex_unlock(&thread->mutex);
+  thread_wake(thread);
+}
+
+void camera_thread_want(camera_thread_t* thread, bool want)
+{
+  pthread_mutex_lock(&thread->mutex);
+  thread->want = want;
+  if (!want) thread->fresh = false;
+  pthread_mutex_unlock(&thread->mutex);
+}
+
+void camera_thread_discard(camera_thread_t* thread)
+{
+  thread->fresh = false;
+}
+
+void camera_thread_park(camera_thread_t* thread)
+{
+  pthread_mutex_lock(&thread->mutex);
+  thread->park = true;
+  thread_wake(thread);
+  while (!thread->parked && !thread->stop) {
+    pthread_cond_wait(&thread->parking, &thread->mutex);
+  }
+  pthread_mutex_unlock(&thread->mutex);
+}
+
+void camera_thread_unpark(camera_thread_t* thread)
+{
+  pthread_mutex_lock(&thread->mutex);
+  thread->park = false;
+  thread->fresh = false;
+  pthread_cond_broadcast(&thread->parking);
+  pthread_mutex_unlock(&thread->mutex);
+}
+
+static bool thread_layout(const camera_image_t* copy,
+                          const camera_image_t* image)
+{
+  if (copy->format != image->format || copy->width != image->width ||
+      copy->height != image->height ||
+      copy->plane_count != image->plane_count) return false;
+  for (size_t p = 0; p < copy->plane_count; p++) {
+    if (copy->planes[p].stride != image->planes[p].stride) return false;
+  }
+  return true;
+}
+
+bool camera_thread_retrieve(camera_thread_t* thread)
+{
+  camera_t* camera = thread->camera;
+  pthread_mutex_lock(&thread->mutex);
+  const bool fresh = thread->fresh &&
+    thread->capacity == camera->head_capacity && camera->head.start &&
+    thread_layout(&thread->image, &camera->image);
+  if (fresh) {
+    uint8_t* head = camera->head.start;
+    camera->head.start = thread->back;
+    camera->head.length = thread->length;
+    for (size_t p = 0; p < camera->image.plane_count; p++) {
+      camera->image.planes[p].offset = thread->image.planes[p].offset;
+      camera->image.planes[p].length = thread->image.planes[p].length;
+    }
+    camera->timestamp = thread->timestamp;
+    camera->sequence = thread->sequence;
+    camera->generation++;
+    thread->back = head;
+    thread->stats.retrieved++;
+  }
+  thread->fresh = false;
+  pthread_mutex_unlock(&thread->mutex);
+  return fresh;
+}
+
+void camera_thread_stats(camera_thread_t* thread,
+                         camera_thread_stats_t* stats)
+{
+  pthread_mutex_lock(&thread->mutex);
+  *stats = thread->stats;
+  pthread_mutex_unlock(&thread->mutex);
+}
@@ -0,0 +1,899 @@
+#define _GNU_SOURCE
+#include "capture.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <zlib.h>
+
+/*
+ * segment file: records of {header, payload, zero pad to 16 bytes}
+ * index file: entries {timestamp, offset of payload, length, sequence}
+ * the stream is padded to a block boundary at each rotation so that
+ * every write is block aligned; the tail pad is truncated on close
+ */
+#define RECORD_MAGIC 0x524c3456 /* "V4LR" */
+#define RECORD_ALIGN 16
+#define RECORD_BLOCK 4096
+#define RECORD_ENTRIES 4096
+#define RECORD_WRITE_MAX (4 << 20)
+
+typedef struct {
+  uint32_t magic;
+  uint32_t length;
+  uint32_t sequence;
+  uint32_t flags;
+  uint64_t timestamp;
+} record_header_t;
+
+typedef struct {
+  uint64_t timestamp;
+  uint64_t offset;
+  uint32_t length;
+  uint32_t sequence;
+} record_index_t;
+
+typedef struct {
+  uint64_t offset; /* in the stream */
+  uint64_t end; /* of the padded record in the stream */
+  uint64_t timestamp;
+  uint32_t length;
+  uint32_t sequence;
+  bool rotate; /* first record of a new segment */
+} record_entry_t;
+
+struct camera_recorder_s {
+  char* path;
+  char* prefix;
+  uint64_t segment_bytes;
+  uint64_t segment_ns;
+
+  uint8_t* ring;
+  size_t ring_size;
+  record_entry_t* entries;
+
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool stop;
+  /* producer positions in the stream, guarded by mutex */
+  uint64_t head;
+  uint64_t entry_head;
+  /* writer positions in the stream, guarded by mutex */
+  uint64_t tail;
+  uint64_t entry_tail;
+
+  /* producer only */
+  uint64_t segment_start;
+  uint64_t segment_first;
+  bool segment_empty;
+
+  /* writer only: file_start is the stream offset of the open segment */
+  int fd;
+  int index_fd;
+  uint64_t file_start;
+  uint64_t file_end;
+
+  camera_recorder_stats_t stats;
+};
+
+static inline uint64_t align_up(uint64_t value, uint64_t align)
+{
+  return (value + align - 1) / align * align;
+}
+
+static void ring_copy(camera_recorder_t* recorder, uint64_t offset,
+                      const void* src, size_t length)
+{
+  const size_t pos = offset % recorder->ring_size;
+  const size_t first = recorder->ring_size - pos < length ?
+    recorder->ring_size - pos : length;
+  memcpy(recorder->ring + pos, src, first);
+  memcpy(recorder->ring, (const uint8_t*) src + first, length - first);
+}
+
+
+//[writer thread]
+static int segment_create(camera_recorder_t* recorder, char* name,
+                          size_t size, int flags)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  uint64_t ms = (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  for (int i = 0; i < 100; i++, ms++) {
+    snprintf(name, size, "%s/%s-%013llu.seg", recorder->path,
+             recorder->prefix, (unsigned long long) ms);
+    int fd = open(name, O_WRONLY | O_CREAT | O_EXCL | flags, 0644);
+    if (fd != -1 || errno != EEXIST) return fd;
+  }
+  return -1;
+}
+
+static bool segment_open(camera_recorder_t* recorder)
+{
+  char name[4096];
+  int fd = -1;
+#ifdef O_DIRECT
+  fd = segment_create(recorder, name, sizeof name, O_DIRECT);
+  if (fd == -1 && errno == EINVAL)
+#endif
+    fd = segment_create(recorder, name, sizeof name, 0);
+  if (fd == -1) return false;
+  strcpy(name + strlen(name) - 4, ".idx");
+  int index_fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (index_fd == -1) {
+    close(fd);
+    return false;
+  }
+  recorder->fd = fd;
+  recorder->index_fd = index_fd;
+  return true;
+}
+
+static bool segment_close(camera_recorder_t* recorder)
+{
+  if (recorder->fd == -1) return true;
+  bool ok = ftruncate(recorder->fd,
+                      recorder->file_end - recorder->file_start) == 0;
+  ok = fdatasync(recorder->fd) == 0 && ok;
+  ok = close(recorder->fd) == 0 && ok;
+  ok = close(recorder->index_fd) == 0 && ok;
+  recorder->fd = -1;
+  recorder->index_fd = -1;
+  return ok;
+}
+
+static bool segment_write(camera_recorder_t* recorder,
+                          uint64_t offset, size_t length)
+{
+  const uint8_t* data = recorder->ring + offset % recorder->ring_size;
+  off_t position = offset - recorder->file_start;
+  while (length > 0) {
+    ssize_t r = pwrite(recorder->fd, data, length, position);
+    if (r == -1 && errno == EINTR) continue;
+#ifdef O_DIRECT
+    if (r == -1 && errno == EINVAL) {
+      /* filesystem refused direct io: keep going buffered */
+      int flags = fcntl(recorder->fd, F_GETFL);
+      if (!(flags & O_DIRECT)) return false;
+      if (fcntl(recorder->fd, F_SETFL, flags & ~O_DIRECT) == -1)
+        return false;
+      continue;
+    }
+#endif
+    if (r <= 0) return false;
+    data += r;
+    position += r;
+    length -= r;
+  }
+  return true;
+}
+
+static void* recorder_main(void* pointer)
+{
+  camera_recorder_t* recorder = pointer;
+  record_index_t indexes[64];
+  pthread_mutex_lock(&recorder->mutex);
+  for (;;) {
+    /* data is written only up to a block boundary or the next rotation */
+    uint64_t tail = recorder->tail;
+    uint64_t limit = recorder->head / RECORD_BLOCK * RECORD_BLOCK;
+    bool rotate = false;
+    for (uint64_t e = recorder->entry_tail; e < recorder->entry_head; e++) {
+      const record_entry_t* entry = &recorder->entries[e % RECORD_ENTRIES];
+      if (!entry->rotate || entry->offset < tail) continue;
+      if (entry->offset == tail) {
+        rotate = tail != recorder->file_start;
+        continue;
+      }
+      if (entry->offset < limit) limit = entry->offset;
+      break;
+    }
+    const bool flush = recorder->stop && limit == tail && !rotate;
+    if (limit == tail && !rotate && !recorder->stop) {
+      pthread_cond_wait(&recorder->cond, &recorder->mutex);
+      continue;
+    }
+    pthread_mutex_unlock(&recorder->mutex);
+
+    bool ok = true, opened = false;
+    if (rotate) {
+      ok = segment_close(recorder);
+      recorder->file_start = tail;
+      recorder->file_end = tail;
+      opened = segment_open(recorder);
+      ok = opened && ok;
+    }
+    size_t length = limit - tail;
+    const size_t wrap = recorder->ring_size - tail % recorder->ring_size;
+    if (length > wrap) length = wrap;
+    if (length > RECORD_WRITE_MAX) length = RECORD_WRITE_MAX;
+    if (ok && length > 0 && recorder->fd != -1) {
+      ok = segment_write(recorder, tail, length);
+    }
+    tail += length;
+
+    /* index only what is on the disk already */
+    pthread_mutex_lock(&recorder->mutex);
+    uint64_t e = recorder->entry_tail;
+    pthread_mutex_unlock(&recorder->mutex);
+    size_t count = 0;
+    for (;; e++) {
+      pthread_mutex_lock(&recorder->mutex);
+      const bool more = e < recorder->entry_head;
+      pthread_mutex_unlock(&recorder->mutex);
+      if (!more) break;
+      const record_entry_t* entry = &recorder->entries[e % RECORD_ENTRIES];
+      if (entry->end > tail ||
+          (entry->rotate && entry->offset != recorder->file_start)) break;
+      indexes[count].timestamp = entry->timestamp;
+      indexes[count].offset =
+        entry->offset + sizeof (record_header_t) - recorder->file_start;
+      indexes[count].length = entry->length;
+      indexes[count].sequence = entry->sequence;
+      recorder->file_end = entry->end;
+      if (++count == sizeof indexes / sizeof indexes[0]) {
+        ok = write(recorder->index_fd, indexes, sizeof indexes) ==
+          sizeof indexes && ok;
+        count = 0;
+      }
+    }
+    if (count > 0) {
+      const ssize_t size = count * sizeof (record_index_t);
+      ok = write(recorder->index_fd, indexes, size) == size && ok;
+    }
+    if (flush) ok = segment_close(recorder) && ok;
+
+    pthread_mutex_lock(&recorder->mutex);
+    if (!ok && recorder->stats.error == 0) recorder->stats.error = errno;
+    if (opened) recorder->stats.segments++;
+    recorder->tail = tail;
+    recorder->entry_tail = e;
+    pthread_cond_broadcast(&recorder->cond);
+    if (flush) break;
+  }
+  pthread_mutex_unlock(&recorder->mutex);
+  return NULL;
+}
+
+
+//[recorder]
+camera_recorder_t* camera_recorder_new(const camera_recorder_config_t* config)
+{
+  camera_recorder_t* recorder = calloc(1, sizeof (camera_recorder_t));
+  if (!recorder) return NULL;
+  recorder->path = strdup(config->path ? config->path : ".");
+  recorder->prefix = strdup(config->prefix ? config->prefix : "camera");
+  recorder->segment_bytes = config->segment_bytes ?
+    config->segment_bytes : (uint64_t) 256 << 20;
+  recorder->segment_ns = config->segment_ns;
+  recorder->ring_size = align_up(
+    config->queue_bytes ? config->queue_bytes : 64 << 20, RECORD_BLOCK);
+  if (recorder->ring_size < 2 * RECORD_BLOCK)
+    recorder->ring_size = 2 * RECORD_BLOCK;
+  recorder->entries = calloc(RECORD_ENTRIES, sizeof (record_entry_t));
+  recorder->fd = -1;
+  recorder->index_fd = -1;
+  recorder->file_start = UINT64_MAX;
+  recorder->segment_empty = true;
+  void* ring = NULL;
+  if (!recorder->path || !recorder->prefix || !recorder->entries ||
+      posix_memalign(&ring, RECORD_BLOCK, recorder->ring_size) != 0) {
+    free(recorder->path);
+    free(recorder->prefix);
+    free(recorder->entries);
+    free(recorder);
+    return NULL;
+  }
+  recorder->ring = ring;
+
+  struct stat st;
+  if (stat(recorder->path, &st) == -1) goto fail;
+  if (!S_ISDIR(st.st_mode)) {
+    errno = ENOTDIR;
+    goto fail;
+  }
+  pthread_mutex_init(&recorder->mutex, NULL);
+  pthread_cond_init(&recorder->cond, NULL);
+  int r = pthread_create(&recorder->thread, NULL, recorder_main, recorder);
+  if (r == 0) return recorder;
+  errno = r;
+  pthread_cond_destroy(&recorder->cond);
+  pthread_mutex_destroy(&recorder->mutex);
+fail:
+  free(recorder->ring);
+  free(recorder->path);
+  free(recorder->prefix);
+  free(recorder->entries);
+  free(recorder);
+  return NULL;
+}
+
+bool camera_recorder_push(camera_recorder_t* recorder,
+                          const camera_frame_t* frame)
+{
+  pthread_mutex_lock(&recorder->mutex);
+  const uint64_t tail = recorder->tail;
+  const uint64_t entry_tail = recorder->entry_tail;
+  pthread_mutex_unlock(&recorder->mutex);
+
+  /* the planes of a multi-planar frame are recorded back to back */
+  const size_t length = camera_frame_size(frame);
+  uint64_t offset = recorder->head;
+  const uint64_t size =
+    align_up(sizeof (record_header_t) + length, RECORD_ALIGN);
+  bool rotate = recorder->segment_empty;
+  if (!rotate) {
+    rotate = offset + size - recorder->segment_start >
+      recorder->segment_bytes;
+    if (recorder->segment_ns > 0 &&
+        frame->timestamp - recorder->segment_first >= recorder->segment_ns)
+      rotate = true;
+  }
+  if (rotate) offset = align_up(offset, RECORD_BLOCK);
+  /* one block stays free for the final pad of camera_recorder_delete() */
+  if (offset + size - tail > recorder->ring_size - RECORD_BLOCK ||
+      recorder->entry_head - entry_tail >= RECORD_ENTRIES ||
+      length > UINT32_MAX) {
+    pthread_mutex_lock(&recorder->mutex);
+    recorder->stats.dropped++;
+    pthread_mutex_unlock(&recorder->mutex);
+    return false;
+  }
+
+  /* the ring between head and offset + size is owned by the producer */
+  const record_header_t header = {
+    RECORD_MAGIC, length, frame->sequence, 0, frame->timestamp,
+  };
+  static const uint8_t zeros[RECORD_BLOCK];
+  if (offset > recorder->head)
+    ring_copy(recorder, recorder->head, zeros, offset - recorder->head);
+  ring_copy(recorder, offset, &header, sizeof header);
+  uint64_t position = offset + sizeof header;
+  for (size_t p = 0; p < frame->plane_count; p++) {
+    ring_copy(recorder, position, frame->planes[p].start, 
+              frame->planes[p].length);
+    position += frame->planes[p].length;
+  }
+  const size_t pad = size - sizeof header - length;
+  ring_copy(recorder, offset + size - pad, zeros, pad);
+
+  record_entry_t* entry =
+    &recorder->entries[recorder->entry_head % RECORD_ENTRIES];
+  entry->offset = offset;
+  entry->end = offset + size;
+  entry->timestamp = frame->timestamp;
+  entry->length = length;
+  entry->sequence = frame->sequence;
+  entry->rotate = rotate;
+  if (rotate) {
+    recorder->segment_start = offset;
+    recorder->segment_first = frame->timestamp;
+    recorder->segment_empty = false;
+  }
+
+  pthread_mutex_lock(&recorder->mutex);
+  recorder->head = offset + size;
+  recorder->entry_head++;
+  recorder->stats.frames++;
+  recorder->stats.bytes += frame->length;
+  pthread_cond_signal(&recorder->cond);
+  pthread_mutex_unlock(&recorder->mutex);
+  return true;
+}
+
+void camera_recorder_sink(const camera_frame_t* frame, void* pointer)
+{
+  camera_recorder_push(pointer, frame);
+}
+
+void camera_recorder_stats(camera_recorder_t* recorder,
+                           camera_recorder_stats_t* stats)
+{
+  pthread_mutex_lock(&recorder->mutex);
+  *stats = recorder->stats;
+  pthread_mutex_unlock(&recorder->mutex);
+}
+
+bool camera_recorder_delete(camera_recorder_t* recorder,
+                            camera_recorder_stats_t* stats)
+{
+  pthread_mutex_lock(&recorder->mutex);
+  /* pad the last block so the writer can flush it whole */
+  const uint64_t head = align_up(recorder->head, RECORD_BLOCK);
+  static const uint8_t zeros[RECORD_BLOCK];
+  if (head > recorder->head)
+    ring_copy(recorder, recorder->head, zeros, head - recorder->head);
+  recorder->head = head;
+  recorder->stop = true;
+  pthread_cond_signal(&recorder->cond);
+  pthread_mutex_unlock(&recorder->mutex);
+  pthread_join(recorder->thread, NULL);
+
+  const bool ok = recorder->stats.error == 0;
+  if (stats) *stats = recorder->stats;
+  pthread_cond_destroy(&recorder->cond);
+  pthread_mutex_destroy(&recorder->mutex);
+  free(recorder->ring);
+  free(recorder->entries);
+  free(recorder->path);
+  free(recorder->prefix);
+  free(recorder);
+  return ok;
+}
+
+
+//[pre-event ring]
+#define PREEVENT_ENTRIES 8192
+
+typedef struct {
+  size_t offset;
+  size_t length; /* in the arena */
+  size_t raw_length;
+  uint64_t timestamp;
+  uint32_t sequence;
+  bool compressed;
+} preevent_entry_t;
+
+struct camera_preevent_s {
+  uint8_t* arena;
+  size_t arena_size;
+  uint64_t max_ns;
+  bool compress;
+  uint8_t* scratch; /* producer only */
+  size_t scratch_size;
+  uint8_t* packed; /* multi-planar frames, producer only */
+  size_t packed_size;
+
+  pthread_mutex_t mutex;
+  pthread_mutex_t dumping;
+  /* retained frames are entries [first, last) in arena order */
+  preevent_entry_t* entries;
+  uint64_t first;
+  uint64_t last;
+  size_t position;
+  size_t used;
+  /* entries from pin are being dumped and must not be overwritten */
+  uint64_t pin;
+  uint64_t dropped;
+};
+
+camera_preevent_t* camera_preevent_new(const camera_preevent_config_t* config)
+{
+  camera_preevent_t* ring = calloc(1, sizeof (camera_preevent_t));
+  if (!ring) return NULL;
+  ring->arena_size = config->arena_bytes ? 
+    config->arena_bytes : (size_t) 64 << 20;
+  ring->max_ns = config->max_ns ? config->max_ns : (uint64_t) 10000000000;
+  ring->compress = config->compress;
+  ring->arena = malloc(ring->arena_size);
+  ring->entries = calloc(PREEVENT_ENTRIES, sizeof (preevent_entry_t));
+  ring->pin = UINT64_MAX;
+  if (!ring->arena || !ring->entries) {
+    free(ring->arena);
+    free(ring->entries);
+    free(ring);
+    errno = ENOMEM;
+    return NULL;
+  }
+  /* touch the arena now rather than page faulting in the capture path */
+  memset(ring->arena, 0, ring->arena_size);
+  pthread_mutex_init(&ring->mutex, NULL);
+  pthread_mutex_init(&ring->dumping, NULL);
+  return ring;
+}
+
+static bool preevent_evict(camera_preevent_t* ring)
+{
+  if (ring->first >= ring->pin) return false;
+  ring->used -= ring->entries[ring->first % PREEVENT_ENTRIES].length;
+  ring->first++;
+  return true;
+}
+
+static bool preevent_overlaps(const preevent_entry_t* entry,
+                              size_t offset, size_t length)
+{
+  return entry->offset < offset + length && 
+    offset < entry->offset + entry->length;
+}
+
+bool camera_preevent_push(camera_preevent_t* ring, 
+                          const camera_frame_t* frame)
+{
+  const uint8_t* data = frame->start;
+  size_t length = frame->length;
+  if (frame->plane_count > 1) {
+    length = camera_frame_size(frame);
+    if (length > ring->packed_size) {
+      uint8_t* packed = realloc(ring->packed, length);
+      if (!packed) return false;
+      ring->packed = packed;
+      ring->packed_size = length;
+    }
+    size_t offset = 0;
+    for (size_t p = 0; p < frame->plane_count; p++) {
+      memcpy(ring->packed + offset, frame->planes[p].start, 
+             frame->planes[p].length);
+      offset += frame->planes[p].length;
+    }
+    data = ring->packed;
+  }
+  const size_t raw_length = length;
+  bool compressed = false;
+  if (ring->compress) {
+    uLongf size = compressBound(raw_length);
+    if (size > ring->scratch_size) {
+      uint8_t* scratch = realloc(ring->scratch, size);
+      if (scratch) {
+        ring->scratch = scratch;
+        ring->scratch_size = size;
+      }
+    }
+    if (size <= ring->scratch_size &&
+        compress2(ring->scratch, &size, data, raw_length, 
+                  Z_BEST_SPEED) == Z_OK && size < raw_length) {
+      data = ring->scratch;
+      length = size;
+      compressed = true;
+    }
+  }
+  
+  pthread_mutex_lock(&ring->mutex);
+  bool ok = length <= ring->arena_size;
+  /* oldest frames go first: past the retention time, when the entry
+   * table is full, then whatever the new frame would overwrite */
+  while (ok && ring->first < ring->last) {
+    const uint64_t oldest = 
+      ring->entries[ring->first % PREEVENT_ENTRIES].timestamp;
+    if (frame->timestamp < oldest || 
+        frame->timestamp - oldest <= ring->max_ns) break;
+    if (!preevent_evict(ring)) break;
+  }
+  if (ok && ring->last - ring->first == PREEVENT_ENTRIES)
+    ok = preevent_evict(ring);
+  size_t offset = ring->first == ring->last ? 0 : ring->position;
+  if (ok && offset + length > ring->arena_size) {
+    while (ok && ring->first < ring->last &&
+           ring->entries[ring->first % PREEVENT_ENTRIES].offset >= offset)
+      ok = preevent_evict(ring);
+    offset = 0;
+  }
+  while (ok && ring->first < ring->last && preevent_overlaps(
+           &ring->entries[ring->first % PREEVENT_ENTRIES], offset, length))
+    ok = preevent_evict(ring);
+  if (!ok) {
+    ring->dropped++;
+    pthread_mutex_unlock(&ring->mutex);
+    return false;
+  }
+  /* the region is free and only the producer writes the arena */
+  pthread_mutex_unlock(&ring->mutex);
+  memcpy(ring->arena + offset, data, length);
+  
+  pthread_mutex_lock(&ring->mutex);
+  preevent_entry_t* entry = &ring->entries[ring->last % PREEVENT_ENTRIES];
+  entry->offset = offset;
+  entry->length = length;
+  entry->raw_length = raw_length;
+  entry->timestamp = frame->timestamp;
+  entry->sequence = frame->sequence;
+  entry->compressed = compressed;
+  ring->last++;
+  ring->position = offset + length;
+  ring->used += length;
+  pthread_mutex_unlock(&ring->mutex);
+  return true;
+}
+
+void camera_preevent_sink(const camera_frame_t* frame, void* pointer)
+{
+  camera_preevent_push(pointer, frame);
+}
+
+void camera_preevent_stats(camera_preevent_t* ring, 
+                           camera_preevent_stats_t* stats)
+{
+  pthread_mutex_lock(&ring->mutex);
+  stats->frames = ring->last - ring->first;
+  stats->bytes = ring->used;
+  stats->raw_bytes = 0;
+  stats->duration = 0;
+  for (uint64_t i = ring->first; i < ring->last; i++) {
+    stats->raw_bytes += ring->entries[i % PREEVENT_ENTRIES].raw_length;
+  }
+  if (ring->first < ring->last) {
+    stats->duration = 
+      ring->entries[(ring->last - 1) % PREEVENT_ENTRIES].timestamp -
+      ring->entries[ring->first % PREEVENT_ENTRIES].timestamp;
+  }
+  stats->dropped = ring->dropped;
+  pthread_mutex_unlock(&ring->mutex);
+}
+
+bool camera_preevent_dump(camera_preevent_t* ring, 
+                          camera_preevent_func_t func, void* pointer)
+{
+  pthread_mutex_lock(&ring->dumping);
+  pthread_mutex_lock(&ring->mutex);
+  const uint64_t last = ring->last;
+  ring->pin = ring->first;
+  pthread_mutex_unlock(&ring->mutex);
+  
+  bool ok = true;
+  uint8_t* buffer = NULL;
+  size_t buffer_size = 0;
+  for (uint64_t i = ring->pin; ok && i < last; i++) {
+    pthread_mutex_lock(&ring->mutex);
+    const preevent_entry_t entry = ring->entries[i % PREEVENT_ENTRIES];
+    pthread_mutex_unlock(&ring->mutex);
+    camera_frame_t frame;
+    frame.start = ring->arena + entry.offset;
+    frame.length = entry.length;
+    frame.timestamp = entry.timestamp;
+    frame.sequence = entry.sequence;
+    if (entry.compressed) {
+      if (entry.raw_length > buffer_size) {
+        free(buffer);
+        buffer_size = entry.raw_length;
+        buffer = malloc(buffer_size);
+      }
+      uLongf size = entry.raw_length;
+      ok = buffer && uncompress(buffer, &size, frame.start, 
+                                entry.length) == Z_OK;
+      if (!ok) errno = buffer ? EIO : ENOMEM;
+      frame.start = buffer;
+      frame.length = size;
+    }
+    camera_frame_packed(&frame);
+    ok = ok && func(&frame, pointer);
+    pthread_mutex_lock(&ring->mutex);
+    ring->pin = i + 1;
+    pthread_mutex_unlock(&ring->mutex);
+  }
+  free(buffer);
+  
+  pthread_mutex_lock(&ring->mutex);
+  ring->pin = UINT64_MAX;
+  pthread_mutex_unlock(&ring->mutex);
+  pthread_mutex_unlock(&ring->dumping);
+  return ok;
+}
+
+typedef struct {
+  FILE* file;
+  uint64_t offset;
+  record_index_t* index;
+  size_t length;
+  size_t capacity;
+} preevent_writer_t;
+
+static bool preevent_write_frame(const camera_frame_t* frame, void* pointer)
+{
+  preevent_writer_t* writer = pointer;
+  if (writer->length == writer->capacity) {
+    writer->capacity = writer->capacity ? writer->capacity * 2 : 256;
+    record_index_t* index = realloc(
+      writer->index, writer->capacity * sizeof (record_index_t));
+    if (!index) return false;
+    writer->index = index;
+  }
+  const record_header_t header = {
+    RECORD_MAGIC, frame->length, frame->sequence, 0, frame->timestamp,
+  };
+  static const uint8_t zeros[RECORD_ALIGN];
+  const size_t size = 
+    align_up(sizeof header + frame->length, RECORD_ALIGN);
+  const size_t pad = size - sizeof header - frame->length;
+  if (fwrite(&header, sizeof header, 1, writer->file) != 1 ||
+      fwrite(frame->start, 1, frame->length, writer->file) != 
+      frame->length ||
+      fwrite(zeros, 1, pad, writer->file) != pad) return false;
+  record_index_t* entry = &writer->index[writer->length++];
+  entry->timestamp = frame->timestamp;
+  entry->offset = writer->offset + sizeof header;
+  entry->length = frame->length;
+  entry->sequence = frame->sequence;
+  writer->offset += size;
+  return true;
+}
+
+bool camera_preevent_write(camera_preevent_t* ring, const char* path,
+                           camera_preevent_stats_t* stats)
+{
+  const size_t plen = strlen(path);
+  char* name = malloc(plen + 5);
+  if (!name) return false;
+  strcpy(name, path);
+  if (plen >= 4 && strcmp(name + plen - 4, ".seg") == 0) name[plen - 4] = 0;
+  strcat(name, ".idx");
+  
+  preevent_writer_t writer = {fopen(path, "wb"), 0, NULL, 0, 0};
+  bool ok = writer.file != NULL;
+  if (ok) ok = camera_preevent_dump(ring, preevent_write_frame, &writer);
+  if (writer.file) ok = fclose(writer.file) == 0 && ok;
+  FILE* file = ok ? fopen(name, "wb") : NULL;
+  if (file) {
+    ok = fwrite(writer.index, sizeof (record_index_t), writer.length, 
+                file) == writer.length;
+    ok = fclose(file) == 0 && ok;
+  } else ok = false;
+  if (stats) {
+    memset(stats, 0, sizeof *stats);
+    stats->frames = writer.length;
+    stats->bytes = writer.offset;
+    if (writer.length > 0) {
+      stats->duration = writer.index[writer.length - 1].timestamp - 
+        writer.index[0].timestamp;
+    }
+  }
+  free(writer.index);
+  free(name);
+  return ok;
+}
+
+void camera_preevent_delete(camera_preevent_t* ring)
+{
+  pthread_mutex_lock(&ring->dumping);
+  pthread_mutex_unlock(&ring->dumping);
+  pthread_mutex_destroy(&ring->dumping);
+  pthread_mutex_destroy(&ring->mutex);
+  free(ring->scratch);
+  free(ring->packed);
+  free(ring->arena);
+  free(ring->entries);
+  free(ring);
+}
+
+
+//[replay]
+struct camera_segment_s {
+  uint8_t* start;
+  size_t size;
+  size_t length;
+  record_index_t* index;
+};
+
+static bool segment_load_index(camera_segment_t* segment, const char* path)
+{
+  size_t plen = strlen(path);
+  if (plen < 4 || strcmp(path + plen - 4, ".seg") != 0) return false;
+  char* name = strdup(path);
+  if (!name) return false;
+  strcpy(name + plen - 4, ".idx");
+  int fd = open(name, O_RDONLY);
+  free(name);
+  if (fd == -1) return false;
+  struct stat st;
+  bool ok = fstat(fd, &st) == 0 && st.st_size > 0 &&
+    st.st_size % sizeof (record_index_t) == 0;
+  if (ok) {
+    segment->length = st.st_size / sizeof (record_index_t);
+    segment->index = malloc(st.st_size);
+    ok = segment->index &&
+      read(fd, segment->index, st.st_size) == st.st_size;
+  }
+  close(fd);
+  /* trust the index only when every entry lies within the data */
+  for (size_t i = 0; ok && i < segment->length; i++) {
+    const record_index_t* entry = &segment->index[i];
+    ok = entry->offset <= segment->size &&
+      entry->length <= segment->size - entry->offset &&
+      (i == 0 || entry->timestamp >= entry[-1].timestamp);
+  }
+  if (!ok) {
+    free(segment->index);
+    segment->index = NULL;
+    segment->length = 0;
+  }
+  return ok;
+}
+
+static bool segment_scan(camera_segment_t* segment)
+{
+  size_t capacity = 256;
+  segment->index = malloc(capacity * sizeof (record_index_t));
+  if (!segment->index) return false;
+  size_t offset = 0;
+  while (segment->size - offset >= sizeof (record_header_t)) {
+    record_header_t header;
+    memcpy(&header, segment->start + offset, sizeof header);
+    if (header.magic != RECORD_MAGIC) {
+      /* padding left by a rotation that was never truncated */
+      offset = align_up(offset + 1, RECORD_BLOCK);
+      continue;
+    }
+    offset += sizeof header;
+    if (header.length > segment->size - offset) break;
+    if (segment->length == capacity) {
+      capacity *= 2;
+      record_index_t* index =
+        realloc(segment->index, capacity * sizeof (record_index_t));
+      if (!index) return false;
+      segment->index = index;
+    }
+    record_index_t* entry = &segment->index[segment->length++];
+    entry->timestamp = header.timestamp;
+    entry->offset = offset;
+    entry->length = header.length;
+    entry->sequence = header.sequence;
+    offset = align_up(offset + header.length, RECORD_ALIGN);
+  }
+  return true;
+}
+
+camera_segment_t* camera_segment_open(const char* path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) return NULL;
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return NULL;
+  }
+  camera_segment_t* segment = calloc(1, sizeof (camera_segment_t));
+  if (!segment) {
+    close(fd);
+    return NULL;
+  }
+  segment->size = st.st_size;
+  if (segment->size > 0) {
+    segment->start =
+      mmap(NULL, segment->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (segment->start == MAP_FAILED) {
+    free(segment);
+    return NULL;
+  }
+  if (!segment_load_index(segment, path) && !segment_scan(segment)) {
+    camera_segment_close(segment);
+    errno = ENOMEM;
+    return NULL;
+  }
+  return segment;
+}
+
+size_t camera_segment_length(const camera_segment_t* segment)
+{
+  return segment->length;
+}
+
+bool camera_segment_frame(const camera_segment_t* segment, size_t index,
+                          camera_frame_t* frame)
+{
+  if (index >= segment->length) return false;
+  const record_index_t* entry = &segment->index[index];
+  frame->start = segment->start + entry->offset;
+  frame->length = entry->length;
+  frame->timestamp = entry->timestamp;
+  frame->sequence = entry->sequence;
+  camera_frame_packed(frame);
+  return true;
+}
+
+size_t camera_segment_find(const camera_segment_t* segment,
+                           uint64_t timestamp)
+{
+  /* last frame at or before timestamp */
+  size_t low = 0, high = segment->length;
+  while (low < high) {
+    const size_t mid = low + (high - low) / 2;
+    if (segment->index[mid].timestamp <= timestamp) low = mid + 1;
+    else high = mid;
+  }
+  return low == 0 ? segment->length : low - 1;
+}
+
+void camera_segment_close(camera_segment_t* segment)
+{
+  if (segment->start) munmap(segment->start, segment->size);
+  free(segment->index);
+  free(segment);
+}
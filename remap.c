@@ -0,0 +1,472 @@
+#define _POSIX_C_SOURCE 200809L
+#include "capture.h"
+#include <string.h>
+#include <math.h>
+
+#include <pthread.h>
+#include <unistd.h>
+#include <linux/videodev2.h>
+
+/*
+ * remapping: each output pixel has its source position as an integer
+ * pixel and 7 bit fractions, precomputed once; frames are sampled
+ * bilinearly per channel straight from their planes (chroma at its own
+ * subsampled position), in tiles of output so the source rows a tile
+ * reads stay cached, each band of output rows on its own thread
+ */
+
+#define REMAP_OUTSIDE UINT16_MAX
+#define REMAP_FRACTION 7
+#define REMAP_ONE (1 << REMAP_FRACTION)
+#define REMAP_MAX_BANDS 16
+#define REMAP_BAND_ROWS 32
+#define REMAP_TILE_ROWS 16
+#define REMAP_TILE_COLS 64
+
+typedef struct {
+  uint16_t x, y; /* x REMAP_OUTSIDE: black */
+  uint8_t fx, fy;
+} remap_point_t;
+
+struct camera_remap_s {
+  uint32_t src_width, src_height;
+  uint32_t width, height;
+  remap_point_t* points;
+  /* the points in output order for frames of another orientation */
+  camera_orientation_t orientation;
+  remap_point_t* oriented;
+};
+
+static camera_remap_t* remap_alloc(uint32_t src_width, uint32_t src_height,
+                                   uint32_t width, uint32_t height)
+{
+  if (src_width < 4 || src_height < 4 || src_width >= REMAP_OUTSIDE ||
+      src_height >= REMAP_OUTSIDE || width == 0 || height == 0) return NULL;
+  camera_remap_t* remap = malloc(sizeof (camera_remap_t));
+  if (!remap) return NULL;
+  remap->points = malloc((size_t) width * height * sizeof (remap_point_t));
+  if (!remap->points) {
+    free(remap);
+    return NULL;
+  }
+  remap->src_width = src_width;
+  remap->src_height = src_height;
+  remap->width = width;
+  remap->height = height;
+  remap->orientation = CAMERA_ORIENT_NONE;
+  remap->oriented = NULL;
+  return remap;
+}
+
+/* positions within half a pixel of the frame are clamped onto it */
+static void remap_point(const camera_remap_t* remap, remap_point_t* point,
+                        double sx, double sy)
+{
+  const double w = remap->src_width - 1, h = remap->src_height - 1;
+  if (!(sx >= -0.5 && sx <= w + 0.5 && sy >= -0.5 && sy <= h + 0.5)) {
+    point->x = point->y = REMAP_OUTSIDE;
+    point->fx = point->fy = 0;
+    return;
+  }
+  sx = sx < 0 ? 0 : sx > w ? w : sx;
+  sy = sy < 0 ? 0 : sy > h ? h : sy;
+  const long x = lround(sx * REMAP_ONE), y = lround(sy * REMAP_ONE);
+  point->x = x >> REMAP_FRACTION;
+  point->y = y >> REMAP_FRACTION;
+  point->fx = x & (REMAP_ONE - 1);
+  point->fy = y & (REMAP_ONE - 1);
+}
+
+camera_remap_t* camera_remap_lens(const camera_lens_t* lens,
+                                  uint32_t src_width, uint32_t src_height,
+                                  uint32_t width, uint32_t height)
+{
+  if (lens->fx <= 0 || lens->fy <= 0) return NULL;
+  camera_remap_t* remap = remap_alloc(src_width, src_height, width, height);
+  if (!remap) return NULL;
+  /* intrinsics scaled from the calibrated size to the source's, then to
+   * the output's for the undistorted view */
+  const double sx = lens->width ? (double) src_width / lens->width : 1;
+  const double sy = lens->height ? (double) src_height / lens->height : 1;
+  const double fx = lens->fx * sx, fy = lens->fy * sy;
+  const double cx = lens->cx * sx, cy = lens->cy * sy;
+  const double ox = (double) width / src_width;
+  const double oy = (double) height / src_height;
+  const double zoom = lens->zoom > 0 ? lens->zoom : 1;
+  const double nfx = fx * ox * zoom, nfy = fy * oy * zoom;
+  const double ncx = cx * ox, ncy = cy * oy;
+  const double* k = lens->k;
+  remap_point_t* point = remap->points;
+  for (uint32_t v = 0; v < height; v++) {
+    const double y = (v - ncy) / nfy;
+    for (uint32_t u = 0; u < width; u++, point++) {
+      const double x = (u - ncx) / nfx;
+      double xd, yd;
+      if (lens->model == CAMERA_LENS_FISHEYE) {
+        const double r = sqrt(x * x + y * y);
+        const double t = atan(r), t2 = t * t;
+        const double td =
+          t * (1 + t2 * (k[0] + t2 * (k[1] + t2 * (k[2] + t2 * k[3]))));
+        const double scale = r > 1e-9 ? td / r : 1;
+        xd = x * scale;
+        yd = y * scale;
+      } else {
+        const double r2 = x * x + y * y;
+        const double radial = 1 + r2 * (k[0] + r2 * (k[1] + r2 * k[4]));
+        xd = x * radial + 2 * k[2] * x * y + k[3] * (r2 + 2 * x * x);
+        yd = y * radial + k[2] * (r2 + 2 * y * y) + 2 * k[3] * x * y;
+      }
+      remap_point(remap, point, fx * xd + cx, fy * yd + cy);
+    }
+  }
+  return remap;
+}
+
+camera_remap_t* camera_remap_map(uint32_t src_width, uint32_t src_height,
+                                 uint32_t width, uint32_t height,
+                                 const float* xs, const float* ys)
+{
+  camera_remap_t* remap = remap_alloc(src_width, src_height, width, height);
+  if (!remap) return NULL;
+  const size_t count = (size_t) width * height;
+  for (size_t i = 0; i < count; i++) {
+    remap_point(remap, &remap->points[i], xs[i], ys[i]);
+  }
+  return remap;
+}
+
+void camera_remap_delete(camera_remap_t* remap)
+{
+  if (!remap) return;
+  free(remap->points);
+  free(remap->oriented);
+  free(remap);
+}
+
+
+//[sampling]
+typedef enum {
+  REMAP_YUV, /* Y, Cb, Cr */
+  REMAP_RGB,
+  REMAP_GRAY,
+} remap_kind_t;
+
+/* one sample per pixel of a channel, every step bytes of a row */
+typedef struct {
+  const uint8_t* base;
+  uint32_t stride;
+  uint32_t step;
+  uint32_t hshift, vshift; /* subsampling */
+  uint32_t width, height;
+} remap_channel_t;
+
+typedef struct {
+  remap_kind_t kind;
+  size_t count;
+  remap_channel_t channels[3];
+} remap_source_t;
+
+/* channel c of plane at byte offset, every step bytes; false when the
+ * plane is short of it */
+static bool remap_channel(remap_source_t* source, size_t c,
+                          const camera_image_t* image, const uint8_t* start,
+                          size_t plane, size_t offset, uint32_t step,
+                          uint32_t hshift, uint32_t vshift)
+{
+  remap_channel_t* channel = &source->channels[c];
+  const uint32_t width = image->width >> hshift;
+  channel->base = start + image->planes[plane].offset + offset;
+  channel->stride = image->planes[plane].stride ?
+    image->planes[plane].stride : width * step;
+  channel->step = step;
+  channel->hshift = hshift;
+  channel->vshift = vshift;
+  channel->width = width;
+  channel->height = image->height >> vshift;
+  const size_t length = image->planes[plane].length;
+  return !length || length >= offset + (size_t) channel->stride *
+    (channel->height - 1) + (size_t) (width - 1) * step + 1;
+}
+
+static bool remap_source(remap_source_t* source, const camera_image_t* image,
+                         const uint8_t* start)
+{
+  size_t u = 1, v = 2, uoff = 0, voff = 0, needed = 3;
+  uint32_t step = 1, vshift = 1;
+  source->kind = REMAP_YUV;
+  source->count = 3;
+  switch (image->format) {
+  case V4L2_PIX_FMT_YUYV:
+    if (image->plane_count < 1) return false;
+    return remap_channel(source, 0, image, start, 0, 0, 2, 0, 0) &&
+      remap_channel(source, 1, image, start, 0, 1, 4, 1, 0) &&
+      remap_channel(source, 2, image, start, 0, 3, 4, 1, 0);
+  case V4L2_PIX_FMT_RGB24: case V4L2_PIX_FMT_BGR24:
+    if (image->plane_count < 1) return false;
+    source->kind = REMAP_RGB;
+    for (size_t c = 0; c < 3; c++) {
+      const size_t offset = image->format == V4L2_PIX_FMT_RGB24 ? c : 2 - c;
+      if (!remap_channel(source, c, image, start, 0, offset, 3, 0, 0))
+        return false;
+    }
+    return true;
+  case V4L2_PIX_FMT_GREY:
+    if (image->plane_count < 1) return false;
+    source->kind = REMAP_GRAY;
+    source->count = 1;
+    return remap_channel(source, 0, image, start, 0, 0, 1, 0, 0);
+  case V4L2_PIX_FMT_NV12: case V4L2_PIX_FMT_NV12M:
+    v = 1; voff = 1; step = 2; needed = 2;
+    break;
+  case V4L2_PIX_FMT_NV21: case V4L2_PIX_FMT_NV21M:
+    v = 1; uoff = 1; step = 2; needed = 2;
+    break;
+  case V4L2_PIX_FMT_NV16: case V4L2_PIX_FMT_NV16M:
+    v = 1; voff = 1; step = 2; vshift = 0; needed = 2;
+    break;
+  case V4L2_PIX_FMT_NV61: case V4L2_PIX_FMT_NV61M:
+    v = 1; uoff = 1; step = 2; vshift = 0; needed = 2;
+    break;
+  case V4L2_PIX_FMT_YUV420: case V4L2_PIX_FMT_YUV420M:
+    break;
+  case V4L2_PIX_FMT_YVU420: case V4L2_PIX_FMT_YVU420M:
+    u = 2; v = 1;
+    break;
+  case V4L2_PIX_FMT_YUV422P:
+#ifdef V4L2_PIX_FMT_YUV422M
+  case V4L2_PIX_FMT_YUV422M:
+#endif
+    vshift = 0;
+    break;
+  default:
+    return false;
+  }
+  if (image->plane_count < needed) return false;
+  return remap_channel(source, 0, image, start, 0, 0, 1, 0, 0) &&
+    remap_channel(source, 1, image, start, u, uoff, step, 1, vshift) &&
+    remap_channel(source, 2, image, start, v, voff, step, 1, vshift);
+}
+
+/* at a luma position in REMAP_FRACTION fixed point */
+static inline uint8_t remap_sample(const remap_channel_t* channel,
+                                   uint32_t px, uint32_t py)
+{
+  px >>= channel->hshift;
+  py >>= channel->vshift;
+  uint32_t x = px >> REMAP_FRACTION, y = py >> REMAP_FRACTION;
+  int fx = px & (REMAP_ONE - 1), fy = py & (REMAP_ONE - 1);
+  if (x >= channel->width - 1) {
+    x = channel->width - 2;
+    fx = REMAP_ONE;
+  }
+  if (y >= channel->height - 1) {
+    y = channel->height - 2;
+    fy = REMAP_ONE;
+  }
+  const uint8_t* p = channel->base + (size_t) y * channel->stride +
+    (size_t) x * channel->step;
+  const uint8_t* q = p + channel->stride;
+  const int top = p[0] * REMAP_ONE + (p[channel->step] - p[0]) * fx;
+  const int bottom = q[0] * REMAP_ONE + (q[channel->step] - q[0]) * fx;
+  return (top * REMAP_ONE + (bottom - top) * fy +
+          (1 << (2 * REMAP_FRACTION - 1))) >> (2 * REMAP_FRACTION);
+}
+
+/* one channel of a tile row, interleaved every step samples */
+static void remap_row(const remap_channel_t* shared,
+                      const remap_point_t* points, uint32_t cols,
+                      uint8_t blank, uint8_t* samples, size_t step)
+{
+  const remap_channel_t channel = *shared;
+  for (uint32_t i = 0; i < cols; i++) {
+    const remap_point_t point = points[i];
+    if (point.x == REMAP_OUTSIDE) {
+      samples[i * step] = blank;
+      continue;
+    }
+    samples[i * step] = remap_sample(&channel,
+                                     point.x << REMAP_FRACTION | point.fx,
+                                     point.y << REMAP_FRACTION | point.fy);
+  }
+}
+
+typedef struct {
+  const camera_image_t* image;
+  const remap_source_t* source;
+  const remap_point_t* points;
+  uint32_t width, height; /* oriented output */
+  camera_pixel_t pixel;
+  uint8_t* out;
+  uint32_t y0, y1;
+  bool ok;
+} remap_band_t;
+
+/* a row of samples to the output pixel, GRAY as BT.601 luma */
+static void remap_pack(const remap_band_t* band, const uint8_t* samples,
+                       size_t count, uint8_t* out)
+{
+  const camera_pixel_t pixel = band->pixel;
+  switch (band->source->kind) {
+  case REMAP_YUV:
+    camera_yuv_pixels(band->image, samples, count, pixel, out);
+    return;
+  case REMAP_GRAY:
+    for (size_t i = 0; i < count; i++) {
+      uint8_t* o = out + i * pixel;
+      for (size_t c = 0; c < (size_t) pixel; c++) o[c] = samples[i];
+      if (pixel == CAMERA_PIXEL_RGBA) o[3] = 255;
+    }
+    return;
+  case REMAP_RGB:
+    for (size_t i = 0; i < count; i++) {
+      const uint8_t* s = samples + i * 3;
+      uint8_t* o = out + i * pixel;
+      if (pixel == CAMERA_PIXEL_GRAY) {
+        o[0] = (77 * s[0] + 150 * s[1] + 29 * s[2] + 128) >> 8;
+        continue;
+      }
+      o[0] = s[0];
+      o[1] = s[1];
+      o[2] = s[2];
+      if (pixel == CAMERA_PIXEL_RGBA) o[3] = 255;
+    }
+    return;
+  }
+}
+
+static void* remap_band_main(void* pointer)
+{
+  remap_band_t* band = pointer;
+  const remap_source_t* source = band->source;
+  const size_t count = source->count;
+  /* outside pixels are black: zero luma and neutral chroma for YUV */
+  const uint8_t blank[3] = {0, source->kind == REMAP_YUV ? 128 : 0,
+                            source->kind == REMAP_YUV ? 128 : 0};
+  uint8_t samples[REMAP_TILE_COLS * 3];
+  for (uint32_t ty = band->y0; ty < band->y1; ty += REMAP_TILE_ROWS) {
+    const uint32_t ty1 = ty + REMAP_TILE_ROWS < band->y1 ?
+      ty + REMAP_TILE_ROWS : band->y1;
+    for (uint32_t tx = 0; tx < band->width; tx += REMAP_TILE_COLS) {
+      const uint32_t cols = band->width - tx < REMAP_TILE_COLS ?
+        band->width - tx : REMAP_TILE_COLS;
+      for (uint32_t y = ty; y < ty1; y++) {
+        const size_t first = (size_t) y * band->width + tx;
+        const remap_point_t* points = &band->points[first];
+        for (size_t c = 0; c < count; c++) {
+          remap_row(&source->channels[c], points, cols, blank[c],
+                    samples + c, count);
+        }
+        remap_pack(band, samples, cols, band->out + first * band->pixel);
+      }
+    }
+  }
+  band->ok = true;
+  return NULL;
+}
+
+/* orientation folds into the map: its points are placed once in the
+ * order of the oriented output */
+static bool remap_orient(camera_remap_t* remap,
+                         camera_orientation_t orientation)
+{
+  if (orientation == CAMERA_ORIENT_NONE ||
+      (remap->oriented && remap->orientation == orientation)) return true;
+  const size_t count = (size_t) remap->width * remap->height;
+  if (!remap->oriented) {
+    remap->oriented = malloc(count * sizeof (remap_point_t));
+    if (!remap->oriented) return false;
+  }
+  camera_orient_t orient;
+  if (!camera_orient_init(&orient, orientation, remap->width,
+                          remap->height, sizeof (remap_point_t),
+                          (uint8_t*) remap->oriented)) return false;
+  const size_t line = (size_t) remap->width * sizeof (remap_point_t);
+  for (uint32_t y = 0; y < remap->height; y++) {
+    memcpy(camera_orient_row(&orient, y),
+           remap->points + (size_t) y * remap->width, line);
+  }
+  camera_orient_end(&orient);
+  remap->orientation = orientation;
+  return true;
+}
+
+/* Bayer and deeper single channel formats are converted to RGB first */
+uint8_t* camera_image_remap(camera_remap_t* remap,
+                            const camera_image_t* image,
+                            const uint8_t* start,
+                            const camera_remap_config_t* config)
+{
+  if (image->width != remap->src_width ||
+      image->height != remap->src_height) return NULL;
+  if (!remap_orient(remap, image->orientation)) return NULL;
+  remap_source_t source;
+  camera_image_t rgb_image;
+  uint8_t* rgb = NULL;
+  if (!remap_source(&source, image, start)) {
+    /* the points are oriented already, so the source stays as captured */
+    camera_image_t unoriented = *image;
+    unoriented.orientation = CAMERA_ORIENT_NONE;
+    rgb = camera_image_rgb(&unoriented, start);
+    if (!rgb) return NULL;
+    memset(&rgb_image, 0, sizeof rgb_image);
+    rgb_image.format = V4L2_PIX_FMT_RGB24;
+    rgb_image.width = image->width;
+    rgb_image.height = image->height;
+    rgb_image.plane_count = 1;
+    rgb_image.orientation = CAMERA_ORIENT_NONE;
+    remap_source(&source, &rgb_image, rgb);
+  }
+  remap_band_t base = {
+    .image = image, .source = &source,
+    .points = image->orientation == CAMERA_ORIENT_NONE ?
+      remap->points : remap->oriented,
+    .pixel = config->pixel,
+  };
+  camera_orientation_size(image->orientation, remap->width, remap->height,
+                          &base.width, &base.height);
+  if (base.pixel != CAMERA_PIXEL_GRAY && base.pixel != CAMERA_PIXEL_RGBA) {
+    base.pixel = CAMERA_PIXEL_RGB;
+  }
+  base.out = malloc((size_t) remap->width * remap->height * base.pixel);
+  if (!base.out) {
+    free(rgb);
+    return NULL;
+  }
+
+  size_t count = config->threads;
+  if (count == 0) {
+    const long online = sysconf(_SC_NPROCESSORS_ONLN);
+    count = online > 0 ? (size_t) online : 1;
+  }
+  if (count > REMAP_MAX_BANDS) count = REMAP_MAX_BANDS;
+  const size_t most = base.height / REMAP_BAND_ROWS;
+  if (count > most) count = most;
+  if (count == 0) count = 1;
+  remap_band_t bands[REMAP_MAX_BANDS];
+  pthread_t threads[REMAP_MAX_BANDS];
+  bool started[REMAP_MAX_BANDS] = {false};
+  for (size_t i = 0; i < count; i++) {
+    bands[i] = base;
+    bands[i].y0 = (uint64_t) base.height * i / count;
+    bands[i].y1 = (uint64_t) base.height * (i + 1) / count;
+  }
+  for (size_t i = 1; i < count; i++) {
+    started[i] =
+      pthread_create(&threads[i], NULL, remap_band_main, &bands[i]) == 0;
+  }
+  remap_band_main(&bands[0]);
+  bool ok = true;
+  for (size_t i = 0; i < count; i++) {
+    if (i > 0) {
+      if (started[i]) pthread_join(threads[i], NULL);
+      else remap_band_main(&bands[i]);
+    }
+    ok = ok && bands[i].ok;
+  }
+  free(rgb);
+  if (!ok) {
+    free(base.out);
+    return NULL;
+  }
+  return base.out;
+}
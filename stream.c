@@ -0,0 +1,200 @@
+#define _POSIX_C_SOURCE 200809L
+#include "capture.h"
+#include <string.h>
+#include <errno.h>
+
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+struct camera_stream_s {
+  camera_t* camera;
+  camera_stream_func_t func;
+  void* pointer;
+  int timeout;
+  bool threaded;
+  bool started; /* streaming was turned on here */
+
+  pthread_t thread;
+  pthread_mutex_t mutex; /* guards stop and the held frames */
+  int wake; /* eventfd */
+  bool stop;
+  int error;
+  size_t held;
+  size_t frame_count;
+  camera_stream_frame_t* frames; /* by buffer index */
+  bool* holding;
+};
+
+static void stream_wake(camera_stream_t* stream)
+{
+  const uint64_t one = 1;
+  if (write(stream->wake, &one, sizeof one) == -1) {
+    // already pending
+  }
+}
+
+static bool stream_fail(camera_stream_t* stream, int error)
+{
+  stream->error = error;
+  stream->func(stream, NULL, stream->pointer);
+  return false;
+}
+
+static bool stream_loop(camera_stream_t* stream)
+{
+  camera_t* camera = stream->camera;
+  for (;;) {
+    pthread_mutex_lock(&stream->mutex);
+    const bool stop = stream->stop;
+    const bool starved = stream->held >= stream->frame_count;
+    pthread_mutex_unlock(&stream->mutex);
+    if (stop) return true;
+    /* the driver has no buffer while the caller holds every frame */
+    struct pollfd fds[2] = {
+      {stream->wake, POLLIN, 0}, {camera->fd, POLLIN, 0},
+    };
+    const int r = poll(fds, starved ? 1 : 2,
+                       stream->timeout > 0 ? stream->timeout : -1);
+    if (r == -1) {
+      if (errno == EINTR) continue;
+      return stream_fail(stream, errno);
+    }
+    if (r == 0) return stream_fail(stream, ETIMEDOUT);
+    if (fds[0].revents & POLLIN) {
+      uint64_t value;
+      if (read(stream->wake, &value, sizeof value) == -1) {
+        // drained by an earlier wake
+      }
+      continue;
+    }
+    if (fds[1].revents & (POLLERR | POLLHUP)) {
+      return stream_fail(stream, EIO);
+    }
+    if (!(fds[1].revents & POLLIN)) continue;
+    camera_frame_t frame;
+    int index;
+    if (!camera_dequeue(camera, &frame, &index)) {
+      if (errno == EAGAIN || errno == EINTR) continue;
+      return stream_fail(stream, errno);
+    }
+    if (index < 0) continue;
+    if ((size_t) index >= stream->frame_count) {
+      camera_requeue(camera, index);
+      continue;
+    }
+    camera_stream_frame_t* borrowed = &stream->frames[index];
+    borrowed->frame = frame;
+    borrowed->index = index;
+    pthread_mutex_lock(&stream->mutex);
+    stream->holding[index] = true;
+    stream->held++;
+    pthread_mutex_unlock(&stream->mutex);
+    stream->func(stream, borrowed, stream->pointer);
+  }
+}
+
+static void* stream_main(void* pointer)
+{
+  stream_loop(pointer);
+  return NULL;
+}
+
+
+camera_stream_t*
+camera_stream_start(camera_t* camera, camera_stream_func_t func,
+                    void* pointer, const camera_stream_config_t* config)
+{
+  camera_stream_t* stream = calloc(1, sizeof (camera_stream_t));
+  if (!stream) return NULL;
+  stream->camera = camera;
+  stream->func = func;
+  stream->pointer = pointer;
+  stream->timeout = config ? config->timeout : 0;
+  stream->threaded = config && config->thread;
+  stream->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (stream->wake == -1) goto fail;
+  if (!camera->streaming) {
+    if (!camera_start(camera)) goto fail;
+    stream->started = true;
+  }
+  stream->frame_count = camera->buffer_count;
+  stream->frames = calloc(stream->frame_count,
+                          sizeof (camera_stream_frame_t));
+  stream->holding = calloc(stream->frame_count, sizeof (bool));
+  if (!stream->frames || !stream->holding) goto fail;
+  pthread_mutex_init(&stream->mutex, NULL);
+  if (!stream->threaded) return stream;
+  int r = pthread_create(&stream->thread, NULL, stream_main, stream);
+  if (r == 0) return stream;
+  errno = r;
+  pthread_mutex_destroy(&stream->mutex);
+fail:
+  if (stream->started) camera_stop(camera);
+  if (stream->wake != -1) close(stream->wake);
+  free(stream->frames);
+  free(stream->holding);
+  free(stream);
+  return NULL;
+}
+
+bool camera_stream_run(camera_stream_t* stream)
+{
+  if (stream->threaded) {
+    errno = EINVAL;
+    return false;
+  }
+  return stream_loop(stream);
+}
+
+void camera_stream_stop(camera_stream_t* stream)
+{
+  pthread_mutex_lock(&stream->mutex);
+  stream->stop = true;
+  pthread_mutex_unlock(&stream->mutex);
+  stream_wake(stream);
+}
+
+bool camera_stream_release(camera_stream_t* stream,
+                           const camera_stream_frame_t* frame)
+{
+  const int index = frame->index;
+  pthread_mutex_lock(&stream->mutex);
+  if (index < 0 || (size_t) index >= stream->frame_count ||
+      !stream->holding[index]) {
+    pthread_mutex_unlock(&stream->mutex);
+    errno = EINVAL;
+    return false;
+  }
+  /* queued before the loop may poll the driver for it */
+  const bool queued = camera_requeue(stream->camera, index);
+  stream->holding[index] = false;
+  stream->held--;
+  pthread_mutex_unlock(&stream->mutex);
+  stream_wake(stream);
+  return queued;
+}
+
+int camera_stream_error(const camera_stream_t* stream)
+{
+  return stream->error;
+}
+
+bool camera_stream_end(camera_stream_t* stream)
+{
+  camera_stream_stop(stream);
+  if (stream->threaded) pthread_join(stream->thread, NULL);
+  camera_t* camera = stream->camera;
+  for (size_t i = 0; i < stream->frame_count; i++) {
+    if (stream->holding[i]) camera_requeue(camera, i);
+  }
+  bool ok = stream->error == 0;
+  if (stream->started) ok = camera_stop(camera) && ok;
+  pthread_mutex_destroy(&stream->mutex);
+  close(stream->wake);
+  free(stream->frames);
+  free(stream->holding);
+  free(stream);
+  return ok;
+}
@@ -0,0 +1,237 @@
+#define _POSIX_C_SOURCE 200809L
+#include "capture.h"
+#include <string.h>
+#include <errno.h>
+
+#include <poll.h>
+
+/*
+ * frames wait in their mapped buffers, oldest first per camera; while
+ * every camera holds one, the heads are a set when they fit within the
+ * tolerance, else the earliest head is too early for any later frame of
+ * the latest camera and goes back to the driver
+ */
+
+#define SYNC_HOLD_MAX 32
+
+typedef struct {
+  camera_stream_frame_t frame;
+  uint64_t time;
+  uint32_t streams;
+  bool partial; /* of an incomplete set counted already */
+} sync_entry_t;
+
+typedef struct {
+  camera_t* camera;
+  sync_entry_t held[SYNC_HOLD_MAX];
+  size_t first;
+  size_t count;
+  bool seen;
+  uint32_t next_sequence;
+} sync_member_t;
+
+struct camera_sync_s {
+  size_t count;
+  uint64_t tolerance;
+  size_t hold;
+  sync_member_t members[CAMERA_SYNC_MAX];
+  camera_sync_stats_t stats;
+};
+
+camera_sync_t* camera_sync_new(camera_t* const* cameras, size_t count,
+                               const camera_sync_config_t* config)
+{
+  if (count < 1 || count > CAMERA_SYNC_MAX) {
+    errno = EINVAL;
+    return NULL;
+  }
+  camera_sync_t* sync = calloc(1, sizeof (camera_sync_t));
+  if (!sync) return NULL;
+  sync->count = count;
+  sync->tolerance = config->tolerance;
+  sync->hold = config->hold < SYNC_HOLD_MAX ? config->hold : SYNC_HOLD_MAX;
+  for (size_t i = 0; i < count; i++) sync->members[i].camera = cameras[i];
+  return sync;
+}
+
+/* a buffer dequeued before the stream was restarted is the driver's */
+static bool sync_stale(const camera_t* camera, uint32_t streams)
+{
+  return !camera->streaming || camera->streams != streams;
+}
+
+static bool sync_requeue(camera_t* camera, const camera_stream_frame_t* frame,
+                         uint32_t streams)
+{
+  if (sync_stale(camera, streams)) return true;
+  return camera_requeue(camera, frame->index);
+}
+
+static sync_entry_t* sync_head(sync_member_t* member)
+{
+  return &member->held[member->first];
+}
+
+static void sync_pop(sync_member_t* member)
+{
+  member->first = (member->first + 1) % SYNC_HOLD_MAX;
+  member->count--;
+}
+
+static void sync_drop(camera_sync_t* sync, size_t i)
+{
+  sync_member_t* member = &sync->members[i];
+  const sync_entry_t* entry = sync_head(member);
+  sync_requeue(member->camera, &entry->frame, entry->streams);
+  sync_pop(member);
+  sync->stats.dropped++;
+  sync->stats.camera_dropped[i]++;
+}
+
+void camera_sync_offer(camera_sync_t* sync, size_t i,
+                       const camera_frame_t* frame, int index)
+{
+  if (index < 0 || i >= sync->count) return;
+  sync_member_t* member = &sync->members[i];
+  camera_t* camera = member->camera;
+  if (member->seen && frame->sequence > member->next_sequence) {
+    sync->stats.gaps[i] += frame->sequence - member->next_sequence;
+  }
+  member->seen = true;
+  member->next_sequence = frame->sequence + 1;
+  /* the driver keeps at least one buffer to capture into */
+  size_t limit = sync->hold;
+  if (limit == 0) limit = camera->buffer_count > 1 ?
+                    camera->buffer_count - 1 : 1;
+  if (limit > SYNC_HOLD_MAX) limit = SYNC_HOLD_MAX;
+  while (member->count >= limit) sync_drop(sync, i);
+  sync_entry_t* entry =
+    &member->held[(member->first + member->count) % SYNC_HOLD_MAX];
+  entry->frame.frame = *frame;
+  entry->frame.index = index;
+  entry->time = camera_frame_time(camera, frame);
+  entry->streams = camera->streams;
+  entry->partial = false;
+  member->count++;
+}
+
+bool camera_sync_take(camera_sync_t* sync, camera_sync_set_t* set)
+{
+  for (;;) {
+    size_t earliest = 0;
+    uint64_t min = UINT64_MAX, max = 0;
+    for (size_t i = 0; i < sync->count; i++) {
+      sync_member_t* member = &sync->members[i];
+      while (member->count > 0 &&
+             sync_stale(member->camera, sync_head(member)->streams)) {
+        sync_pop(member);
+      }
+      if (member->count == 0) return false;
+      const uint64_t time = sync_head(member)->time;
+      if (time < min) {
+        min = time;
+        earliest = i;
+      }
+      if (time > max) max = time;
+    }
+    if (max - min <= sync->tolerance) break;
+    /* the frames within tolerance of it are dropped with it as one set */
+    for (size_t i = 0; i < sync->count; i++) {
+      sync_entry_t* entry = sync_head(&sync->members[i]);
+      if (i != earliest && entry->time - min <= sync->tolerance) {
+        entry->partial = true;
+      }
+    }
+    if (!sync_head(&sync->members[earliest])->partial) {
+      sync->stats.incomplete++;
+    }
+    sync_drop(sync, earliest);
+  }
+  set->count = sync->count;
+  set->timestamp = UINT64_MAX;
+  uint64_t latest = 0;
+  for (size_t i = 0; i < sync->count; i++) {
+    sync_member_t* member = &sync->members[i];
+    const sync_entry_t* entry = sync_head(member);
+    set->frames[i] = entry->frame;
+    set->streams[i] = entry->streams;
+    if (entry->time < set->timestamp) set->timestamp = entry->time;
+    if (entry->time > latest) latest = entry->time;
+    sync_pop(member);
+  }
+  set->skew = latest - set->timestamp;
+  sync->stats.sets++;
+  camera_histogram_record(&sync->stats.skew, set->skew);
+  return true;
+}
+
+bool camera_sync_release(camera_sync_t* sync, const camera_sync_set_t* set)
+{
+  bool ok = true;
+  for (size_t i = 0; i < set->count && i < sync->count; i++) {
+    ok = sync_requeue(sync->members[i].camera, &set->frames[i],
+                      set->streams[i]) && ok;
+  }
+  return ok;
+}
+
+void camera_sync_flush(camera_sync_t* sync, size_t i)
+{
+  if (i >= sync->count) return;
+  sync_member_t* member = &sync->members[i];
+  while (member->count > 0) {
+    const sync_entry_t* entry = sync_head(member);
+    sync_requeue(member->camera, &entry->frame, entry->streams);
+    sync_pop(member);
+  }
+}
+
+bool camera_sync_wait(camera_sync_t* sync, camera_sync_set_t* set,
+                      int timeout)
+{
+  struct pollfd fds[CAMERA_SYNC_MAX];
+  for (;;) {
+    if (camera_sync_take(sync, set)) return true;
+    for (size_t i = 0; i < sync->count; i++) {
+      fds[i].fd = sync->members[i].camera->fd;
+      fds[i].events = POLLIN;
+      fds[i].revents = 0;
+    }
+    const int r = poll(fds, sync->count, timeout > 0 ? timeout : -1);
+    if (r == -1) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    if (r == 0) {
+      errno = ETIMEDOUT;
+      return false;
+    }
+    for (size_t i = 0; i < sync->count; i++) {
+      if (fds[i].revents & (POLLERR | POLLHUP)) {
+        errno = EIO;
+        return false;
+      }
+      if (!(fds[i].revents & POLLIN)) continue;
+      camera_frame_t frame;
+      int index;
+      if (!camera_dequeue(sync->members[i].camera, &frame, &index)) {
+        if (errno == EAGAIN || errno == EINTR) continue;
+        return false;
+      }
+      camera_sync_offer(sync, i, &frame, index);
+    }
+  }
+}
+
+void camera_sync_stats(const camera_sync_t* sync,
+                       camera_sync_stats_t* stats)
+{
+  *stats = sync->stats;
+}
+
+void camera_sync_delete(camera_sync_t* sync)
+{
+  if (!sync) return;
+  for (size_t i = 0; i < sync->count; i++) camera_sync_flush(sync, i);
+  free(sync);
+}
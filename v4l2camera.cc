@@ -3,17 +3,39 @@
 #include <nan.h>
 #include <errno.h>
 
+#include <algorithm>
+#include <deque>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <tuple>
+#include <unordered_map>
 #include <vector>
 
 
 namespace {
   
-  struct CallbackData {
-    Nan::Persistent<v8::Object> thisObj;
-    std::unique_ptr<Nan::Callback> callback;
+  // PNG encoders kept between snapshots for their buffers; shared with
+  // the workers, so releasing the camera never frees one in use
+  struct PngPool {
+    ~PngPool() {
+      for (auto png: idle) camera_png_delete(png);
+    }
+    camera_png_t* Take() {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (idle.empty()) return camera_png_new();
+      auto png = idle.back();
+      idle.pop_back();
+      return png;
+    }
+    void Give(camera_png_t* png) {
+      std::lock_guard<std::mutex> lock(mutex);
+      idle.push_back(png);
+    }
+    std::mutex mutex;
+    std::vector<camera_png_t*> idle;
   };
   
   class Camera : public Nan::ObjectWrap {
@@ -25,24 +47,210 @@ namespace {
     static NAN_METHOD(Stop);
     static NAN_METHOD(Capture);
     static NAN_METHOD(FrameRaw);
+    static NAN_METHOD(FrameInfo);
     static NAN_METHOD(FrameYUYVToRGB);
+    static NAN_METHOD(Demosaic);
+    static NAN_METHOD(Samples);
+    static NAN_METHOD(Normalize);
+    static NAN_METHOD(ToPNGAsync);
+    static NAN_METHOD(RemapSet);
+    static NAN_METHOD(RemapFrame);
+    static NAN_METHOD(Orientation);
+    static NAN_METHOD(Denoise);
+    static NAN_METHOD(Stacked);
+    static NAN_METHOD(FramePlanes);
+    static NAN_METHOD(FrameToSlot);
     static NAN_METHOD(ConfigGet);
     static NAN_METHOD(ConfigSet);
     static NAN_METHOD(ControlGet);
     static NAN_METHOD(ControlSet);
+    static NAN_METHOD(SelectMode);
+    static NAN_METHOD(CropBounds);
+    static NAN_METHOD(CropGet);
+    static NAN_METHOD(CropSet);
+    static NAN_METHOD(WatchEvents);
+    static NAN_METHOD(IdlePolicy);
+    static NAN_METHOD(Realtime);
+    static NAN_METHOD(RateControl);
+    static NAN_METHOD(ConsumerOpen);
+    static NAN_METHOD(ConsumerClose);
+    static NAN_METHOD(ConsumerStats);
+    static NAN_METHOD(Stats);
+    static NAN_METHOD(OpenAsync);
+    static NAN_METHOD(StartAsync);
+    static NAN_METHOD(StopAsync);
+    static NAN_METHOD(ConfigSetAsync);
+    static NAN_METHOD(RecordStart);
+    static NAN_METHOD(RecordStop);
+    static NAN_METHOD(RecordStats);
+    static NAN_METHOD(PreEventStart);
+    static NAN_METHOD(PreEventStop);
+    static NAN_METHOD(PreEventStats);
+    static NAN_METHOD(DumpPreEvent);
+    static NAN_GETTER(Formats);
+    static NAN_GETTER(Controls);
     
-    static void StopCB(uv_poll_t* handle, int status, int events);
-    static void CaptureCB(uv_poll_t* handle, int status, int events);
-    
-    static void
-    WatchCB(uv_poll_t* handle, void (*callbackCall)(CallbackData* data));
-    static void
-    Watch(const Nan::FunctionCallbackInfo<v8::Value>& info, uv_poll_cb cb);
+    class Worker;
+    class OpenWorker;
+    class RecordWorker;
+    class DumpWorker;
+    class PngWorker;
+    class Hold;
+    class Sync;
+    static Camera* Ready(const Nan::FunctionCallbackInfo<v8::Value>& info);
+    static void PollCB(uv_poll_t* handle, int status, int events);
+    static void IdleCB(uv_timer_t* handle);
+    static void AsyncCB(uv_async_t* handle);
+    void StopThread();
+    void Watch();
+    void Release();
+    static void Cleanup(void* pointer);
+    void Emit(const char* name, v8::Local<v8::Value> value);
+    void Record(camera_stage_t stage, std::uint64_t begin);
+    void EmitEvents();
+    bool Subscribe();
+    // outputs converted from the head frame are shared by every caller
+    // until the next frame is retrieved
+    enum Conversion {CONVERT_RGB, CONVERT_DEMOSAIC, CONVERT_REMAP};
+    typedef std::tuple<Conversion, std::uint32_t, std::uint32_t> ConvertKey;
+    v8::Local<v8::Value> Converted(const ConvertKey& key);
+    v8::Local<v8::Value> 
+    Convert(const ConvertKey& key, std::uint8_t* data, std::size_t size);
     
     Camera();
     ~Camera();
+    typedef std::deque<std::unique_ptr<Nan::Callback>> Callbacks;
+    // consumer 0 has no rate of its own
+    struct Pending {
+      std::unique_ptr<Nan::Callback> callback;
+      std::uint32_t consumer;
+    };
+    typedef std::deque<Pending> Captures;
+    Captures Takers(std::uint64_t time);
+    void Deliver(Captures& takers, bool captured, std::uint64_t woken = 0);
     camera_t* camera;
+    v8::Isolate* isolate;
+    uv_poll_t* poll;
+    int pollEvents;
+    uv_timer_t* idle;
+    std::uint64_t idleTimeout; /* ms, 0 keeps streaming */
+    bool paused;
+    camera_thread_t* thread;
+    uv_async_t* async;
+    bool waiting; /* for the thread to retrieve frames */
+    bool events;
+    bool watchEvents; /* wanted; applied once no worker is busy */
+    bool busy;
+    camera_recorder_t* recorder;
+    std::shared_ptr<camera_preevent_t> preEvent;
+    std::shared_ptr<PngPool> pngs;
+    // set by remapSet(); the map is built for the frame size on first use
+    struct Remapping {
+      ~Remapping() {
+        camera_remap_delete(map);
+      }
+      bool byLens;
+      camera_lens_t lens;
+      std::vector<float> xs;
+      std::vector<float> ys;
+      std::uint32_t width; /* output, 0 for the frame's */
+      std::uint32_t height;
+      std::uint32_t srcWidth;
+      std::uint32_t srcHeight;
+      camera_remap_t* map;
+    };
+    std::unique_ptr<Remapping> remapping;
+    Sync* sync; /* matching frames with other cameras */
+    std::size_t syncIndex;
+    Captures captures;
+    Callbacks stops;
+    std::map<std::uint32_t, camera_rate_t> consumers;
+    std::uint32_t nextConsumer;
+    Nan::Persistent<v8::Object> formats;
+    Nan::Persistent<v8::Object> controls;
+    std::uint64_t convertGeneration;
+    std::map<ConvertKey, Nan::Global<v8::ArrayBuffer>> converted;
+    std::uint64_t convertHits;
+    std::uint64_t convertMisses;
+  };
+  
+  //[per isolate data]
+  // the addon may be loaded by the main thread and any worker_threads;
+  // metadata objects are instances of templates holding their properties
+  // in the order they are set, so filling one adds no hidden classes
+  enum Shape {
+    SHAPE_FORMAT, SHAPE_INTERVAL, SHAPE_CONTROL, SHAPE_FLAGS, 
+    SHAPE_HISTOGRAM, SHAPE_FRAME, SHAPE_RECORDED, SHAPE_COUNT
+  };
+  static const char* const shape_properties[SHAPE_COUNT][10] = {
+    {"formatName", "format", "width", "height", "interval"},
+    {"numerator", "denominator"},
+    {"id", "name", "type", "min", "max", "step", "default", "flags", "menu"},
+    {"disabled", "grabbed", "readOnly", "update", "inactive", "slider",
+     "writeOnly", "volatile"},
+    {"count", "min", "max", "mean", "p50", "p90", "p99", "p999"},
+    {"sequence", "timestamp", "format", "width", "height", "length"},
+    {"data", "timestamp", "sequence"},
+  };
+  struct AddonData {
+    Nan::Persistent<v8::Function> camera;
+    // interned property names by the address of their literal
+    struct Name {
+      std::string text;
+      Nan::Global<v8::String> handle;
+    };
+    std::unordered_map<const char*, Name> names;
+    Nan::Global<v8::ObjectTemplate> shapes[SHAPE_COUNT];
   };
+  static std::mutex addonMutex;
+  static std::map<v8::Isolate*, std::unique_ptr<AddonData>> addonData;
+  // of the isolate last seen on this thread, looked up without the lock
+  static thread_local v8::Isolate* addonIsolate = nullptr;
+  static thread_local AddonData* addonCurrent = nullptr;
+  
+  static AddonData* getAddonData(v8::Isolate* isolate) {
+    if (isolate == addonIsolate) return addonCurrent;
+    std::lock_guard<std::mutex> lock(addonMutex);
+    auto& data = addonData[isolate];
+    if (!data) {
+      data.reset(new AddonData);
+      node::AddEnvironmentCleanupHook(isolate, [](void* pointer) -> void {
+        std::lock_guard<std::mutex> lock(addonMutex);
+        auto isolate = static_cast<v8::Isolate*>(pointer);
+        if (addonIsolate == isolate) addonIsolate = nullptr;
+        addonData[isolate]->camera.Reset();
+        addonData.erase(isolate);
+      }, isolate);
+    }
+    addonIsolate = isolate;
+    addonCurrent = data.get();
+    return addonCurrent;
+  }
+  
+  // property names are literals: a hit is checked for a reused address
+  static v8::Local<v8::String> propertyName(const char* name) {
+    const auto isolate = v8::Isolate::GetCurrent();
+    auto& entry = getAddonData(isolate)->names[name];
+    if (entry.handle.IsEmpty() || entry.text != name) {
+      entry.text = name;
+      entry.handle.Reset(v8::String::NewFromUtf8(
+        isolate, name, v8::NewStringType::kInternalized).ToLocalChecked());
+    }
+    return Nan::New(entry.handle);
+  }
+  
+  static v8::Local<v8::Object> newObject(Shape shape) {
+    auto& tmpl = getAddonData(v8::Isolate::GetCurrent())->shapes[shape];
+    if (tmpl.IsEmpty()) {
+      auto created = Nan::New<v8::ObjectTemplate>();
+      for (auto name: shape_properties[shape]) {
+        if (!name) break;
+        created->Set(propertyName(name), Nan::Undefined());
+      }
+      tmpl.Reset(created);
+    }
+    return Nan::NewInstance(Nan::New(tmpl)).ToLocalChecked();
+  }
   
   //[error message handling]
   struct LogContext {
@@ -73,7 +281,7 @@ namespace {
   //[helpers]
   static inline v8::Local<v8::Value>
   getValue(const v8::Local<v8::Object>& self, const char* name) {
-    return Nan::Get(self, Nan::New(name).ToLocalChecked()).ToLocalChecked();
+    return Nan::Get(self, propertyName(name)).ToLocalChecked();
   }
   static inline std::int32_t
   getInt(const v8::Local<v8::Object>& self, const char* name) {
@@ -83,11 +291,25 @@ namespace {
   getUint(const v8::Local<v8::Object>& self, const char* name) {
     return Nan::To<std::uint32_t>(getValue(self, name)).FromJust();
   }
+  static inline double
+  getNumber(const v8::Local<v8::Object>& self, const char* name, 
+            double fallback) {
+    const auto value = getValue(self, name);
+    if (!value->IsNumber()) return fallback;
+    return Nan::To<double>(value).FromJust();
+  }
+  static std::string
+  getString(const v8::Local<v8::Object>& self, const char* name,
+            const char* fallback) {
+    const auto value = getValue(self, name);
+    if (!value->IsString()) return fallback;
+    return *Nan::Utf8String(value);
+  }
   
   static inline void 
   setValue(const v8::Local<v8::Object>& self, const char* name, 
            const v8::Local<v8::Value>& value) {
-    Nan::Set(self, Nan::New(name).ToLocalChecked(), value);
+    Nan::Set(self, propertyName(name), value);
   }
   static inline void 
   setInt(const v8::Local<v8::Object>& self, const char* name,
@@ -108,33 +330,471 @@ namespace {
   setBool(const v8::Local<v8::Object>& self, const char* name, bool value) {
     setValue(self, name, Nan::New<v8::Boolean>(value));
   }
+  // cam.width/cam.height are of the oriented outputs
+  static void setSize(const v8::Local<v8::Object>& self, 
+                      const camera_t* camera) {
+    auto width = std::uint32_t{0}, height = std::uint32_t{0};
+    camera_orientation_size(camera->orientation, camera->width, 
+                            camera->height, &width, &height);
+    setUint(self, "width", width);
+    setUint(self, "height", height);
+  }
+  
+  //[capture thread]
+  // the camera is held against its capture thread while it is changed
+  class Camera::Hold {
+  public:
+    explicit Hold(Camera* self) : thread(self->thread) {
+      if (thread) camera_thread_lock(thread);
+    }
+    ~Hold() {
+      if (thread) camera_thread_unlock(thread);
+    }
+    // released before the caller goes on to Watch()
+    template <typename F> static bool Run(Camera* self, F task) {
+      Hold hold(self);
+      return task();
+    }
+    // the frame the thread copied before a change of the stream, format
+    // or crop is dropped with it
+    template <typename F> static bool Change(Camera* self, F task) {
+      Hold hold(self);
+      const auto ok = task();
+      hold.Discard();
+      return ok;
+    }
+    void Discard() {
+      if (thread) camera_thread_discard(thread);
+    }
+  private:
+    camera_thread_t* thread;
+  };
+  
+  //[synchronizer]
+  // frames of the member cameras wait in their mapped buffers until every
+  // camera has one within the tolerance; each matched set is copied into
+  // the cameras' heads and emitted as "set"
+  class Camera::Sync : public Nan::ObjectWrap {
+  public:
+    static NAN_MODULE_INIT(Init);
+    void Offer(Camera* member, const camera_frame_t& frame, int index,
+               std::uint64_t woken);
+    void Flush(Camera* member);
+    void Detach(Camera* releasing);
+  private:
+    static NAN_METHOD(New);
+    static NAN_METHOD(Stats);
+    static NAN_METHOD(Close);
+    void Emit(const camera_sync_set_t& set);
+    Sync() : sync(nullptr) {}
+    ~Sync() {
+      Detach(nullptr);
+    }
+    camera_sync_t* sync;
+    std::vector<Camera*> members;
+    Nan::Persistent<v8::Array> cameras;
+  };
+  
+  // stages timed on the JS thread share the histograms the capture thread
+  // records into, so they are recorded under its lock
+  void Camera::Record(camera_stage_t stage, std::uint64_t begin) {
+    const auto end = camera_now();
+    Hold hold(this);
+    camera_histogram_record(&camera->stats.stages[stage], end - begin);
+  }
   
   //[callback helpers]
-  void Camera::WatchCB(uv_poll_t* handle,
-                       void (*callbackCall)(CallbackData* data)) {
-    Nan::HandleScope scope;
-    auto data = static_cast<CallbackData*>(handle->data);
-    uv_poll_stop(handle);
-    uv_close(reinterpret_cast<uv_handle_t*>(handle), 
-             [](uv_handle_t* handle) -> void {delete handle;});
-    
-    callbackCall(data);
-    data->thisObj.Reset();
-    delete data;
-  }
-  void Camera::Watch(const Nan::FunctionCallbackInfo<v8::Value>& info,
-                     uv_poll_cb cb) {
-    auto data = new CallbackData;
-    data->thisObj.Reset(info.Holder());
-    data->callback.reset(new Nan::Callback(info[0].As<v8::Function>()));
-    auto camera = Nan::ObjectWrap::Unwrap<Camera>(info.Holder())->camera;
+  // one poll handle per camera: capture and stop callbacks wait for
+  // UV_READABLE, subscribed device events arrive as UV_PRIORITIZED;
+  // native sinks keep UV_READABLE on for as long as the stream runs;
+  // a stream without captures or sinks is paused after idleTimeout and
+  // restarted by the next of them; with a capture thread, frames come
+  // through the async handle instead while the stream runs
+  void Camera::Watch() {
+    const auto demand = !captures.empty() || recorder || preEvent || sync;
+    if (camera->streaming || camera->buffer_count == 0) paused = false;
+    if (paused && demand && !busy) {
+      // on failure the pending captures see POLLERR
+      Hold hold(this);
+      camera_start(camera);
+      paused = false;
+    }
+    if (thread) {
+      const auto wait = !captures.empty() && camera->streaming && !busy;
+      camera_thread_want(thread, wait);
+      if (wait != waiting) {
+        auto handle = reinterpret_cast<uv_handle_t*>(async);
+        if (wait) {
+          uv_ref(handle);
+          Ref();
+        } else {
+          uv_unref(handle);
+          Unref();
+        }
+        waiting = wait;
+      }
+    }
+    if (idleTimeout > 0 && camera->streaming && !demand && !busy) {
+      if (!idle) {
+        idle = new uv_timer_t;
+        idle->data = this;
+        uv_timer_init(Nan::GetCurrentEventLoop(), idle);
+        uv_unref(reinterpret_cast<uv_handle_t*>(idle));
+      }
+      if (!uv_is_active(reinterpret_cast<uv_handle_t*>(idle))) {
+        uv_timer_start(idle, IdleCB, idleTimeout, 0);
+      }
+    } else if (idle) {
+      uv_timer_stop(idle);
+    }
     
-    auto handle = new uv_poll_t;
-    handle->data = data;
-    uv_poll_init(uv_default_loop(), handle, camera->fd);
-    uv_poll_start(handle, UV_READABLE, cb);
+    const auto grab = !thread || !camera->streaming;
+    auto mask = 0;
+    if (!stops.empty()) mask |= UV_READABLE;
+    if (!captures.empty() && grab) mask |= UV_READABLE;
+    if (camera->sinks && camera->streaming && grab) mask |= UV_READABLE;
+    if (sync && camera->streaming && grab) mask |= UV_READABLE;
+    if (events) mask |= UV_PRIORITIZED;
+    if (busy) mask = 0;
+    if (mask == pollEvents) return;
+    if (mask == 0) {
+      uv_poll_stop(poll);
+      pollEvents = 0;
+      Unref();
+      return;
+    }
+    if (!poll) {
+      poll = new uv_poll_t;
+      poll->data = this;
+      uv_poll_init(Nan::GetCurrentEventLoop(), poll, camera->fd);
+    }
+    if (pollEvents == 0) Ref();
+    uv_poll_start(poll, mask, PollCB);
+    pollEvents = mask;
+  }
+  
+  void Camera::PollCB(uv_poll_t* handle, int status, int events) {
+    Nan::HandleScope scope;
+    auto self = static_cast<Camera*>(handle->data);
+    const auto woken = camera_now();
+    auto thisObj = self->handle();
+    self->Ref();
+    if (status < 0) {
+      // POLLERR after the stream is off: libuv has stopped the handle
+      self->pollEvents = 0;
+      self->Unref();
+      auto stops = std::move(self->stops);
+      auto captures = std::move(self->captures);
+      for (auto& callback: stops) callback->Call(thisObj, 0, nullptr);
+      self->Deliver(captures, false);
+    } else {
+      if (events & UV_PRIORITIZED) self->EmitEvents();
+      if (self->thread && self->camera->streaming) {
+        // the thread dequeues; a stale readiness is ignored
+      } else if ((events & UV_READABLE) && self->sync && 
+                 self->camera->streaming) {
+        // the frame waits for the other cameras, captures take sets
+        auto frame = camera_frame_t{};
+        auto index = 0;
+        if (camera_dequeue(self->camera, &frame, &index)) {
+          self->sync->Offer(self, frame, index, woken);
+        } else if (errno != EAGAIN) {
+          auto takers = std::move(self->captures);
+          self->Deliver(takers, false);
+        }
+      } else if ((events & UV_READABLE) && !self->captures.empty()) {
+        // warm-up frames and frames no capture takes go back untouched,
+        // the callbacks keep waiting for the next one
+        const auto camera = self->camera;
+        auto frame = camera_frame_t{};
+        auto index = 0;
+        auto captured = bool{camera_dequeue(camera, &frame, &index)};
+        auto takers = Captures{};
+        if (!captured) {
+          takers.push_back(std::move(self->captures.front()));
+          self->captures.pop_front();
+        } else if (index >= 0) {
+          const auto time = camera_frame_time(camera, &frame);
+          if (camera_rate_take(&camera->rate, time)) {
+            takers = self->Takers(time);
+          }
+          if (!takers.empty()) camera_retrieve(camera, &frame);
+          captured = camera_requeue(camera, index);
+        }
+        self->Deliver(takers, captured, woken);
+      } else if ((events & UV_READABLE) && self->camera->sinks) {
+        camera_grab(self->camera, false);
+      }
+    }
+    self->Watch();
+    self->Unref();
+  }
+  
+  void Camera::IdleCB(uv_timer_t* handle) {
+    auto self = static_cast<Camera*>(handle->data);
+    {
+      Hold hold(self);
+      self->paused = camera_pause(self->camera);
+    }
+    self->Watch();
   }
   
+  void Camera::AsyncCB(uv_async_t* handle) {
+    Nan::HandleScope scope;
+    auto self = static_cast<Camera*>(handle->data);
+    // a worker changes the head meanwhile, later frames notify again
+    if (!self->thread || self->captures.empty() || self->busy) return;
+    const auto woken = camera_now();
+    if (!camera_thread_retrieve(self->thread)) return;
+    self->Ref();
+    const auto camera = self->camera;
+    auto takers = self->Takers(camera->timestamp ? 
+                               camera->timestamp : camera_now());
+    self->Deliver(takers, true, woken);
+    self->Watch();
+    self->Unref();
+  }
+  
+  // the first pending capture of each consumer whose rate takes the frame
+  Camera::Captures Camera::Takers(std::uint64_t time) {
+    auto takers = Captures{};
+    auto seen = std::vector<std::uint32_t>{};
+    for (auto it = captures.begin(); it != captures.end();) {
+      const auto consumer = it->consumer;
+      if (std::find(seen.begin(), seen.end(), consumer) != seen.end()) {
+        ++it;
+        continue;
+      }
+      seen.push_back(consumer);
+      const auto found = consumers.find(consumer);
+      if (found != consumers.end() && 
+          !camera_rate_take(&found->second, time)) {
+        ++it;
+        continue;
+      }
+      takers.push_back(std::move(*it));
+      it = captures.erase(it);
+    }
+    return takers;
+  }
+  
+  // timed from the wake-up of the loop to the first callback, not
+  // through the callbacks themselves
+  void Camera::Deliver(Captures& takers, bool captured, 
+                       std::uint64_t woken) {
+    if (takers.empty()) return;
+    auto thisObj = handle();
+    if (captured && woken) Record(CAMERA_STAGE_DELIVER, woken);
+    for (auto& pending: takers) {
+      std::vector<v8::Local<v8::Value>> args{{Nan::New(captured)}};
+      pending.callback->Call(thisObj, args.size(), args.data());
+    }
+  }
+  
+  void Camera::Emit(const char* name, v8::Local<v8::Value> value) {
+    auto thisObj = handle();
+    const auto emit = getValue(thisObj, "emit");
+    if (!emit->IsFunction()) return;
+    v8::Local<v8::Value> argv[] = {propertyName(name), value};
+    Nan::MakeCallback(thisObj, emit.As<v8::Function>(), 2, argv);
+  }
+  
+  //[colorimetry]
+#ifdef V4L2_MAP_YCBCR_ENC_DEFAULT
+  struct Colorimetry {
+    const char* name;
+    std::uint32_t value;
+  };
+  // in camera_matrix_t order
+  static const Colorimetry matrix_names[] = {
+    {"bt601", V4L2_YCBCR_ENC_601}, {"bt709", V4L2_YCBCR_ENC_709},
+    {"bt2020", V4L2_YCBCR_ENC_BT2020},
+  };
+  static const Colorimetry range_names[] = {
+    {"full", V4L2_QUANTIZATION_FULL_RANGE}, 
+    {"limited", V4L2_QUANTIZATION_LIM_RANGE},
+  };
+  
+  template <std::size_t N> static const char* 
+  colorimetryName(const Colorimetry (&names)[N], std::uint32_t value) {
+    for (const auto& entry : names) {
+      if (entry.value == value) return entry.name;
+    }
+    return names[0].name;
+  }
+  template <std::size_t N> static bool 
+  colorimetryValue(const Colorimetry (&names)[N], const std::string& name,
+                   std::uint32_t& value) {
+    for (const auto& entry : names) {
+      if (name != entry.name) continue;
+      value = entry.value;
+      return true;
+    }
+    Nan::ThrowError(("unknown colorimetry: " + name).c_str());
+    return false;
+  }
+  
+  // {matrix, range} of the negotiated format, overridable per conversion;
+  // the matrix is named as converted, so it reads back as the same one
+  static v8::Local<v8::Object> colorimetryGet(const camera_image_t& image) {
+    auto obj = Nan::New<v8::Object>();
+    setString(obj, "matrix", matrix_names[camera_image_matrix(&image)].name);
+    setString(obj, "range", 
+              colorimetryName(range_names, image.quantization));
+    return obj;
+  }
+  static bool 
+  colorimetrySet(camera_image_t& image, v8::Local<v8::Object> options) {
+    const auto matrix = getString(options, "matrix", "");
+    const auto range = getString(options, "range", "");
+    if (!matrix.empty() && 
+        !colorimetryValue(matrix_names, matrix, image.ycbcr_enc)) 
+      return false;
+    if (!range.empty() && 
+        !colorimetryValue(range_names, range, image.quantization)) 
+      return false;
+    return true;
+  }
+#else
+  static v8::Local<v8::Object> colorimetryGet(const camera_image_t&) {
+    return Nan::New<v8::Object>();
+  }
+  static bool colorimetrySet(camera_image_t&, v8::Local<v8::Object>) {
+    return true;
+  }
+#endif
+  
+  //[demosaic]
+  static const char* demosaic_names[] = {"bilinear", "edge", "binning"};
+  static const char* pixel_names[] = {"gray", "rgb", "rgba"};
+  static const camera_pixel_t pixel_values[] = {
+    CAMERA_PIXEL_GRAY, CAMERA_PIXEL_RGB, CAMERA_PIXEL_RGBA,
+  };
+  
+  template <std::size_t N> static bool 
+  nameIndex(const char* (&names)[N], const std::string& name, 
+            const char* what, std::size_t& index) {
+    for (auto i = std::size_t{0}; i < N; ++i) {
+      if (name != names[i]) continue;
+      index = i;
+      return true;
+    }
+    Nan::ThrowError(("unknown " + std::string(what) + ": " + name).c_str());
+    return false;
+  }
+  
+  // {method, pixel, threads}
+  static bool 
+  demosaicConfig(v8::Local<v8::Value> value, 
+                 camera_demosaic_config_t& config) {
+    config = {CAMERA_DEMOSAIC_BILINEAR, CAMERA_PIXEL_RGB, 0};
+    if (!value->IsObject()) return true;
+    auto options = Nan::To<v8::Object>(value).ToLocalChecked();
+    auto method = std::size_t{0}, pixel = std::size_t{1};
+    if (!nameIndex(demosaic_names, getString(options, "method", "bilinear"),
+                   "demosaic method", method)) return false;
+    if (!nameIndex(pixel_names, getString(options, "pixel", "rgb"),
+                   "pixel", pixel)) return false;
+    config.method = static_cast<camera_demosaic_t>(method);
+    config.pixel = pixel_values[pixel];
+    config.threads = getUint(options, "threads");
+    return true;
+  }
+  
+  //[normalization]
+  static const char* scale_names[] = {"fixed", "minmax", "percentile"};
+  static const char* colormap_names[] = {"gray", "jet", "turbo"};
+  
+  // {range, low, high, ignoreZero, colormap}; a custom colormap is held
+  // by lut, which must outlive the conversion
+  static bool 
+  normalizeConfig(v8::Local<v8::Value> value, std::uint32_t format,
+                  camera_normalize_config_t& config, 
+                  std::vector<std::uint8_t>& lut) {
+    config = {CAMERA_SCALE_MINMAX, 0, 0, format == V4L2_PIX_FMT_Z16, 
+              nullptr};
+    if (!value->IsObject()) return true;
+    auto options = Nan::To<v8::Object>(value).ToLocalChecked();
+    auto scale = std::size_t{1};
+    if (!nameIndex(scale_names, getString(options, "range", "minmax"),
+                   "range", scale)) return false;
+    config.scale = static_cast<camera_scale_t>(scale);
+    if (config.scale == CAMERA_SCALE_PERCENTILE) {
+      config.low = 0.01;
+      config.high = 0.99;
+    }
+    config.low = getNumber(options, "low", config.low);
+    config.high = getNumber(options, "high", config.high);
+    const auto ignore = getValue(options, "ignoreZero");
+    if (ignore->IsBoolean()) {
+      config.ignore_zero = Nan::To<bool>(ignore).FromJust();
+    }
+    const auto colormap = getValue(options, "colormap");
+    if (colormap->IsString()) {
+      auto index = std::size_t{0};
+      if (!nameIndex(colormap_names, *Nan::Utf8String(colormap), 
+                     "colormap", index)) return false;
+      config.colormap = 
+        camera_colormap(static_cast<camera_colormap_t>(index));
+    } else if (colormap->IsUint8Array()) {
+      Nan::TypedArrayContents<std::uint8_t> contents(colormap);
+      if (contents.length() != 256 * 3) {
+        Nan::ThrowError("colormap: 256 RGB entries expected");
+        return false;
+      }
+      lut.assign(*contents, *contents + contents.length());
+      config.colormap = lut.data();
+    }
+    return true;
+  }
+  
+  //[remapping]
+  static const char* lens_model_names[] = {"pinhole", "fisheye"};
+  
+  // {model, fx, fy, cx, cy, k, width, height} as calibrated
+  static bool lensConfig(v8::Local<v8::Object> options, camera_lens_t& lens) {
+    lens = camera_lens_t{};
+    auto model = std::size_t{0};
+    if (!nameIndex(lens_model_names, getString(options, "model", "pinhole"),
+                   "lens model", model)) return false;
+    lens.model = static_cast<camera_lens_model_t>(model);
+    lens.width = getUint(options, "width");
+    lens.height = getUint(options, "height");
+    lens.fx = getNumber(options, "fx", 0);
+    lens.fy = getNumber(options, "fy", lens.fx);
+    lens.cx = getNumber(options, "cx", 0);
+    lens.cy = getNumber(options, "cy", 0);
+    if (!(lens.fx > 0 && lens.fy > 0)) {
+      Nan::ThrowError("lens: fx and fy required");
+      return false;
+    }
+    const auto k = getValue(options, "k");
+    if (k->IsArray()) {
+      const auto array = k.As<v8::Array>();
+      const auto count = std::min<std::size_t>(array->Length(), 5);
+      for (auto i = std::size_t{0}; i < count; ++i) {
+        const auto value = Nan::Get(array, i).ToLocalChecked();
+        lens.k[i] = Nan::To<double>(value).FromMaybe(0);
+      }
+    }
+    return true;
+  }
+  
+  // {pixel, threads}
+  static bool 
+  remapConfig(v8::Local<v8::Value> value, camera_remap_config_t& config) {
+    config = {CAMERA_PIXEL_RGB, 0};
+    if (!value->IsObject()) return true;
+    auto options = Nan::To<v8::Object>(value).ToLocalChecked();
+    auto pixel = std::size_t{1};
+    if (!nameIndex(pixel_names, getString(options, "pixel", "rgb"),
+                   "pixel", pixel)) return false;
+    config.pixel = pixel_values[pixel];
+    config.threads = getUint(options, "threads");
+    return true;
+  }
+  
+
   //[methods]
   
   static const char* control_type_names[] = {
@@ -142,32 +802,39 @@ namespace {
     "int",
     "bool",
     "menu",
+    "button",
     "int64",
-    "class"
+    "class",
     "string",
     "bitmask",
     "int_menu",
   };
+  static const char* controlTypeName(camera_control_type_t type) {
+    const auto count = sizeof control_type_names / sizeof (const char*);
+    const auto index = static_cast<std::size_t>(type);
+    if (index >= V4L2_CTRL_COMPOUND_TYPES) return "compound";
+    return index < count ? control_type_names[index] : control_type_names[0];
+  }
   
-  static v8::Local<v8::Object> cameraControls(const camera_t* camera) {
-    auto ccontrols = camera_controls_new(camera);
+  static v8::Local<v8::Object> cameraControls(camera_t* camera) {
+    const auto ccontrols = camera_controls(camera);
     auto controls = Nan::New<v8::Array>(ccontrols->length);
     for (auto i = std::size_t{0}; i < ccontrols->length; ++i) {
       const auto ccontrol = &ccontrols->head[i];
-      auto control = Nan::New<v8::Object>();
+      auto control = newObject(SHAPE_CONTROL);
       const auto name =
         Nan::New(reinterpret_cast<char*>(ccontrol->name)).ToLocalChecked();
       Nan::Set(controls, i, control);
       Nan::Set(controls, name, control);
       setUint(control, "id", ccontrol->id);
       setValue(control, "name", name);
-      setString(control, "type", control_type_names[ccontrol->type]);
+      setString(control, "type", controlTypeName(ccontrol->type));
       setInt(control, "min", ccontrol->min);
       setInt(control, "max", ccontrol->max);
       setInt(control, "step", ccontrol->step);
       setInt(control, "default", ccontrol->default_value);
       
-      auto flags = Nan::New<v8::Object>();
+      auto flags = newObject(SHAPE_FLAGS);
       setValue(control, "flags", flags);
       setBool(flags, "disabled", ccontrol->flags.disabled);
       setBool(flags, "grabbed", ccontrol->flags.grabbed);
@@ -200,7 +867,6 @@ namespace {
       default: break;
       }
     }
-    camera_controls_delete(ccontrols);
     return controls;
   }
 
@@ -221,32 +887,76 @@ namespace {
     };
   }
   
+  static v8::Local<v8::Object> 
+  convertInterval(const camera_interval_t& cinterval) {
+    auto interval = newObject(SHAPE_INTERVAL);
+    setUint(interval, "numerator", cinterval.numerator);
+    setUint(interval, "denominator", cinterval.denominator);
+    return interval;
+  }
+  
   static v8::Local<v8::Object> convertFormat(const camera_format_t* cformat) {
     char name[5];
     camera_format_name(cformat->format, name);
-    auto format = Nan::New<v8::Object>();
+    auto format = newObject(SHAPE_FORMAT);
     setString(format, "formatName", name);
     setUint(format, "format", cformat->format);
     setUint(format, "width", cformat->width);
     setUint(format, "height", cformat->height);
-    auto interval = Nan::New<v8::Object>();
-    setValue(format, "interval", interval);
-    setUint(interval, "numerator", cformat->interval.numerator);
-    setUint(interval, "denominator", cformat->interval.denominator);
+    setValue(format, "interval", convertInterval(cformat->interval));
     return format;
   }
   
-  static v8::Local<v8::Object> cameraFormats(const camera_t* camera) {
-    auto cformats = camera_formats_new(camera);
+  static const char* range_type_names[] = {
+    "invalid",
+    "discrete",
+    "continuous",
+    "stepwise",
+  };
+  
+  static void setRanges(v8::Local<v8::Object> format,
+                        const camera_format_range_t* crange) {
+    if (crange->size.type != CAMERA_RANGE_DISCRETE) {
+      auto size = Nan::New<v8::Object>();
+      setValue(format, "sizeRange", size);
+      setString(size, "type", range_type_names[crange->size.type]);
+      setUint(size, "minWidth", crange->size.min_width);
+      setUint(size, "maxWidth", crange->size.max_width);
+      setUint(size, "stepWidth", crange->size.step_width);
+      setUint(size, "minHeight", crange->size.min_height);
+      setUint(size, "maxHeight", crange->size.max_height);
+      setUint(size, "stepHeight", crange->size.step_height);
+    }
+    if (crange->interval.type != CAMERA_RANGE_DISCRETE) {
+      auto interval = Nan::New<v8::Object>();
+      setValue(format, "intervalRange", interval);
+      setString(interval, "type", range_type_names[crange->interval.type]);
+      setValue(interval, "min", convertInterval(crange->interval.min));
+      setValue(interval, "max", convertInterval(crange->interval.max));
+      setValue(interval, "step", convertInterval(crange->interval.step));
+    }
+  }
+  
+  static v8::Local<v8::Object> cameraFormats(camera_t* camera) {
+    const auto cformats = camera_formats(camera);
     auto formats = Nan::New<v8::Array>(cformats->length);
     for (auto i = std::size_t{0}; i < cformats->length; ++i) {
       auto cformat = &cformats->head[i];
       auto format = convertFormat(cformat);
+      setRanges(format, &cformats->ranges[i]);
       Nan::Set(formats, i, format);
     }
     return formats;
   }
   
+  // format id from a number or a 4 char name (padded by spaces e.g. "Y16")
+  static std::uint32_t formatId(const v8::Local<v8::Value>& value) {
+    if (!value->IsString()) return Nan::To<std::uint32_t>(value).FromJust();
+    std::string name = *Nan::Utf8String(value);
+    name.resize(4, ' ');
+    return camera_format_id(name.c_str());
+  }
+  
   NAN_METHOD(Camera::New) {
     if (!info.IsConstructCall()) {
       // [NOTE] generic recursive call with `new`
@@ -261,161 +971,1822 @@ namespace {
       Nan::ThrowTypeError("argument required: device");
       return;
     }
-    const auto device = Nan::To<v8::String>(info[0]).ToLocalChecked();
-    auto camera = camera_open(*Nan::Utf8String(device));
-    if (!camera) {
-      Nan::ThrowError(strerror(errno));
-      return;
+    auto camera = static_cast<camera_t*>(nullptr);
+    auto device = info[0];
+    if (info[0]->IsExternal()) {
+      // opened by OpenAsync on the threadpool
+      camera = static_cast<camera_t*>(info[0].As<v8::External>()->Value());
+      device = info[1];
+    } else {
+      const auto name = Nan::To<v8::String>(info[0]).ToLocalChecked();
+      camera = camera_open(*Nan::Utf8String(name));
+      if (!camera) {
+        Nan::ThrowError(strerror(errno));
+        return;
+      }
+      camera->context.pointer = new LogContext;
+      camera->context.log = &logRecord;
     }
-    camera->context.pointer = new LogContext;
-    camera->context.log = &logRecord;
     
     auto thisObj = info.This();
     auto self = new Camera;
     self->camera = camera;
+    self->isolate = info.GetIsolate();
     self->Wrap(thisObj);
-    setValue(thisObj, "device", info[0]);
-    setValue(thisObj, "formats", cameraFormats(camera));
-    setValue(thisObj, "controls", cameraControls(camera));
+    setValue(thisObj, "device", device);
+    node::AddEnvironmentCleanupHook(self->isolate, Cleanup, self);
+  }
+  
+  Camera* Camera::Ready(const Nan::FunctionCallbackInfo<v8::Value>& info) {
+    auto self = Nan::ObjectWrap::Unwrap<Camera>(info.Holder());
+    if (self->busy) {
+      Nan::ThrowError("camera is busy");
+      return nullptr;
+    }
+    return self;
+  }
+  
+  // formats and controls are enumerated on first access, then cached;
+  // while a worker changes the device only the cached tables are served
+  NAN_GETTER(Camera::Formats) {
+    auto self = Nan::ObjectWrap::Unwrap<Camera>(info.Holder());
+    if (self->formats.IsEmpty()) {
+      if (self->busy) {
+        Nan::ThrowError("camera is busy");
+        return;
+      }
+      self->formats.Reset(cameraFormats(self->camera));
+    }
+    info.GetReturnValue().Set(Nan::New(self->formats));
+  }
+  NAN_GETTER(Camera::Controls) {
+    auto self = Nan::ObjectWrap::Unwrap<Camera>(info.Holder());
+    if (self->controls.IsEmpty()) {
+      if (self->busy) {
+        Nan::ThrowError("camera is busy");
+        return;
+      }
+      self->controls.Reset(cameraControls(self->camera));
+    }
+    info.GetReturnValue().Set(Nan::New(self->controls));
   }
+
   
   NAN_METHOD(Camera::Start) {
     auto thisObj = info.Holder();
-    auto camera = Nan::ObjectWrap::Unwrap<Camera>(thisObj)->camera;
-    if (!camera_start(camera)) {
+    auto self = Ready(info);
+    if (!self) return;
+    auto camera = self->camera;
+    if (!Hold::Change(self, [camera] {return camera_start(camera);})) {
       Nan::ThrowError(cameraError(camera));
       return;
     }
-    setUint(thisObj, "width", camera->width);
-    setUint(thisObj, "height", camera->height);
+    setSize(thisObj, camera);
+    setValue(thisObj, "colorimetry", colorimetryGet(camera->image));
+    self->Watch();
     info.GetReturnValue().Set(thisObj);
   }
 
   
-  void Camera::StopCB(uv_poll_t* handle, int /*status*/, int /*events*/) {
-    auto callCallback = [](CallbackData* data) -> void {
-      Nan::HandleScope scope;
-      auto thisObj = Nan::New<v8::Object>(data->thisObj);
-      data->callback->Call(thisObj, 0, nullptr);
-    };
-    WatchCB(handle, callCallback);
-  }
   NAN_METHOD(Camera::Stop) {
-    auto camera = Nan::ObjectWrap::Unwrap<Camera>(info.Holder())->camera;
-    if (!camera_stop(camera)) {
-      Nan::ThrowError(cameraError(camera));
+    auto self = Ready(info);
+    if (!self) return;
+    const auto camera = self->camera;
+    if (!Hold::Change(self, [camera] {return camera_stop(camera);})) {
+      Nan::ThrowError(cameraError(self->camera));
       return;
     }
-    Watch(info, StopCB);
+    if (info[0]->IsFunction()) {
+      self->stops.emplace_back(new Nan::Callback(info[0].As<v8::Function>()));
+    }
+    self->Watch();
   }
   
-  void Camera::CaptureCB(uv_poll_t* handle, int /*status*/, int /*events*/) {
-    auto callCallback = [](CallbackData* data) -> void {
-      Nan::HandleScope scope;
-      auto thisObj = Nan::New<v8::Object>(data->thisObj);
-      auto camera = Nan::ObjectWrap::Unwrap<Camera>(thisObj)->camera;
-      auto captured = bool{camera_capture(camera)};
-      std::vector<v8::Local<v8::Value>> args{{Nan::New(captured)}};
-      data->callback->Call(thisObj, args.size(), args.data());
+  NAN_METHOD(Camera::Capture) {
+    auto self = Nan::ObjectWrap::Unwrap<Camera>(info.Holder());
+    if (!info[0]->IsFunction()) {
+      Nan::ThrowTypeError("argument required: callback");
+      return;
+    }
+    auto callback = std::unique_ptr<Nan::Callback>(
+      new Nan::Callback(info[0].As<v8::Function>()));
+    const auto consumer = Nan::To<std::uint32_t>(info[1]).FromMaybe(0);
+    self->captures.push_back(Pending{std::move(callback), consumer});
+    self->Watch();
+  }
+  
+  //[rate control]
+  static void rateInit(camera_rate_t& rate, v8::Local<v8::Value> value) {
+    if (!value->IsObject()) {
+      camera_rate_init(&rate, 0, 0);
+      return;
+    }
+    const auto options = Nan::To<v8::Object>(value).ToLocalChecked();
+    camera_rate_init(&rate, getNumber(options, "targetFps", 0), 
+                     getNumber(options, "every", 0));
+  }
+  
+  static v8::Local<v8::Object> rateStats(const camera_rate_t& rate) {
+    auto obj = Nan::New<v8::Object>();
+    setValue(obj, "targetFps", Nan::New(rate.target_fps));
+    setUint(obj, "every", rate.every);
+    setValue(obj, "taken", Nan::New(static_cast<double>(rate.taken)));
+    setValue(obj, "dropped", Nan::New(static_cast<double>(rate.dropped)));
+    setValue(obj, "sourceFps", 
+             Nan::New(rate.period ? 1e9 / rate.period : 0.0));
+    return obj;
+  }
+  
+  // of the frames retrieved for any capture; null takes every frame
+  NAN_METHOD(Camera::RateControl) {
+    auto self = Ready(info);
+    if (!self) return;
+    Hold hold(self);
+    rateInit(self->camera->rate, info[0]);
+  }
+  
+  NAN_METHOD(Camera::ConsumerOpen) {
+    auto self = Ready(info);
+    if (!self) return;
+    const auto id = ++self->nextConsumer;
+    rateInit(self->consumers[id], info[0]);
+    info.GetReturnValue().Set(id);
+  }
+  
+  NAN_METHOD(Camera::ConsumerClose) {
+    auto self = Nan::ObjectWrap::Unwrap<Camera>(info.Holder());
+    self->consumers.erase(Nan::To<std::uint32_t>(info[0]).FromJust());
+  }
+  
+  NAN_METHOD(Camera::ConsumerStats) {
+    auto self = Nan::ObjectWrap::Unwrap<Camera>(info.Holder());
+    const auto id = Nan::To<std::uint32_t>(info[0]).FromJust();
+    const auto found = self->consumers.find(id);
+    if (found == self->consumers.end()) return;
+    info.GetReturnValue().Set(rateStats(found->second));
+  }
+  
+  NAN_METHOD(Camera::IdlePolicy) {
+    auto self = Ready(info);
+    if (!self) return;
+    const auto options = info[0]->IsObject() ? 
+      info[0]->ToObject() : Nan::New<v8::Object>();
+    self->idleTimeout = getNumber(options, "timeout", self->idleTimeout);
+    self->camera->warmup = getNumber(options, "warmup", self->camera->warmup);
+    self->Watch();
+  }
+  
+  void Camera::StopThread() {
+    if (!thread) return;
+    camera_thread_stop(thread);
+    thread = nullptr;
+    if (waiting) Unref();
+    waiting = false;
+    uv_close(reinterpret_cast<uv_handle_t*>(async), 
+             [](uv_handle_t* handle) -> void {
+               delete reinterpret_cast<uv_async_t*>(handle);
+             });
+    async = nullptr;
+  }
+  
+  NAN_METHOD(Camera::Realtime) {
+    auto self = Ready(info);
+    if (!self) return;
+    if (self->sync && info[0]->IsObject()) {
+      Nan::ThrowError("realtime: camera is synchronized");
+      return;
+    }
+    self->StopThread();
+    if (!info[0]->IsObject()) {
+      self->Watch();
+      return;
+    }
+    const auto options = Nan::To<v8::Object>(info[0]).ToLocalChecked();
+    std::vector<int> cpus;
+    const auto fcpus = getValue(options, "cpus");
+    if (fcpus->IsArray()) {
+      const auto array = fcpus.As<v8::Array>();
+      for (auto i = std::uint32_t{0}; i < array->Length(); ++i) {
+        const auto cpu = Nan::Get(array, i).ToLocalChecked();
+        cpus.push_back(Nan::To<std::int32_t>(cpu).FromJust());
+      }
+    }
+    auto config = camera_thread_config_t{};
+    config.cpus = cpus.data();
+    config.cpu_count = cpus.size();
+    config.priority = getNumber(options, "priority", 0);
+    config.nice = getNumber(options, "nice", 0);
+    config.lock = Nan::To<bool>(getValue(options, "lock")).FromJust();
+    self->async = new uv_async_t;
+    self->async->data = self;
+    uv_async_init(Nan::GetCurrentEventLoop(), self->async, AsyncCB);
+    uv_unref(reinterpret_cast<uv_handle_t*>(self->async));
+    config.notify = [](void* pointer) -> void {
+      uv_async_send(static_cast<uv_async_t*>(pointer));
     };
-    WatchCB(handle, callCallback);
+    config.pointer = self->async;
+    self->thread = camera_thread_start(self->camera, &config);
+    if (!self->thread) {
+      const auto err = errno;
+      uv_close(reinterpret_cast<uv_handle_t*>(self->async), 
+               [](uv_handle_t* handle) -> void {
+                 delete reinterpret_cast<uv_async_t*>(handle);
+               });
+      self->async = nullptr;
+      self->Watch();
+      Nan::ThrowError(strerror(err));
+      return;
+    }
+    self->Watch();
   }
-  NAN_METHOD(Camera::Capture) {
-    Watch(info, CaptureCB);
+  
+  //[events]
+  void Camera::EmitEvents() {
+    camera_event_t cevent;
+    while (camera_event_dequeue(camera, &cevent)) {
+      Nan::HandleScope scope;
+      auto event = Nan::New<v8::Object>();
+      auto changes = Nan::New<v8::Object>();
+      setValue(event, "changes", changes);
+      setUint(event, "sequence", cevent.sequence);
+      switch (cevent.type) {
+      case CAMERA_EVENT_CONTROL:
+        if (cevent.changes.flags || cevent.changes.range) controls.Reset();
+        setUint(event, "id", cevent.id);
+        setValue(event, "value", 
+                 Nan::New(static_cast<double>(cevent.value)));
+        setInt(event, "min", cevent.min);
+        setInt(event, "max", cevent.max);
+        setInt(event, "step", cevent.step);
+        setInt(event, "default", cevent.default_value);
+        setBool(changes, "value", cevent.changes.value);
+        setBool(changes, "flags", cevent.changes.flags);
+        setBool(changes, "range", cevent.changes.range);
+        Emit("control", event);
+        break;
+      case CAMERA_EVENT_SOURCE_CHANGE:
+        formats.Reset();
+        controls.Reset();
+        setBool(changes, "resolution", cevent.changes.resolution);
+        Emit("sourceChange", event);
+        break;
+      case CAMERA_EVENT_EOS:
+        Emit("eos", event);
+        break;
+      }
+    }
+  }
+  
+  // (un)subscribes to the wanted state; false leaves the error logged
+  bool Camera::Subscribe() {
+    if (watchEvents == events) return true;
+    const auto ok = watchEvents ? camera_events_subscribe(camera) :
+      camera_events_unsubscribe(camera);
+    if (!ok) {
+      watchEvents = events;
+      return false;
+    }
+    events = watchEvents;
+    Watch();
+    return true;
+  }
+  
+  // while a worker changes the device, the subscription waits for it
+  NAN_METHOD(Camera::WatchEvents) {
+    auto self = Nan::ObjectWrap::Unwrap<Camera>(info.Holder());
+    self->watchEvents = Nan::To<bool>(info[0]).FromJust();
+    if (self->busy) return;
+    if (!self->Subscribe()) Nan::ThrowError(cameraError(self->camera));
   }
 
 
+  //[statistics]
+  static const char* stage_names[] = {
+    "wait", "dqbuf", "sinks", "copy", "convert", "frame", "deliver", 
+    "start", "denoise",
+  };
+  
+  static v8::Local<v8::Object> 
+  convertHistogram(const camera_histogram_t& histogram) {
+    auto obj = newObject(SHAPE_HISTOGRAM);
+    const auto ms = [](std::uint64_t ns) -> v8::Local<v8::Value> {
+      return Nan::New(ns / 1e6);
+    };
+    const auto count = histogram.count;
+    setValue(obj, "count", Nan::New(static_cast<double>(count)));
+    setValue(obj, "min", ms(histogram.min));
+    setValue(obj, "max", ms(histogram.max));
+    setValue(obj, "mean", Nan::New(count ? histogram.sum / 1e6 / count : 0));
+    setValue(obj, "p50", ms(camera_histogram_quantile(&histogram, 0.5)));
+    setValue(obj, "p90", ms(camera_histogram_quantile(&histogram, 0.9)));
+    setValue(obj, "p99", ms(camera_histogram_quantile(&histogram, 0.99)));
+    setValue(obj, "p999", ms(camera_histogram_quantile(&histogram, 0.999)));
+    return obj;
+  }
+  
+  static const char* policyName(int policy) {
+    return policy == SCHED_FIFO ? "fifo" : "other";
+  }
+  
+  NAN_METHOD(Camera::Stats) {
+    auto self = Nan::ObjectWrap::Unwrap<Camera>(info.Holder());
+    const auto reset = Nan::To<bool>(info[0]).FromJust();
+    // copied at once, the capture thread keeps recording into it
+    std::unique_ptr<camera_stats_t> copy(new camera_stats_t);
+    auto crate = camera_rate_t{};
+    {
+      Hold hold(self);
+      *copy = self->camera->stats;
+      crate = self->camera->rate;
+      if (reset) camera_stats_reset(self->camera);
+    }
+    const auto& cstats = *copy;
+    auto stats = Nan::New<v8::Object>();
+    auto stages = Nan::New<v8::Object>();
+    setValue(stats, "frames", Nan::New(static_cast<double>(cstats.frames)));
+    setValue(stats, "bytes", Nan::New(static_cast<double>(cstats.bytes)));
+    setValue(stats, "errors", Nan::New(static_cast<double>(cstats.errors)));
+    setValue(stats, "skipped", 
+             Nan::New(static_cast<double>(cstats.skipped)));
+    setBool(stats, "paused", self->paused);
+    setValue(stats, "stages", stages);
+    for (auto i = 0; i < CAMERA_STAGE_COUNT; ++i) {
+      setValue(stages, stage_names[i], convertHistogram(cstats.stages[i]));
+    }
+    auto cache = Nan::New<v8::Object>();
+    setValue(cache, "hits", 
+             Nan::New(static_cast<double>(self->convertHits)));
+    setValue(cache, "misses", 
+             Nan::New(static_cast<double>(self->convertMisses)));
+    setValue(stats, "cache", cache);
+    setValue(stats, "rate", rateStats(crate));
+    if (self->thread) {
+      auto tstats = camera_thread_stats_t{};
+      camera_thread_stats(self->thread, &tstats);
+      auto realtime = Nan::New<v8::Object>();
+      setValue(realtime, "wakeups", 
+               Nan::New(static_cast<double>(tstats.wakeups)));
+      setValue(realtime, "retrieved", 
+               Nan::New(static_cast<double>(tstats.retrieved)));
+      setString(realtime, "policy", policyName(tstats.policy));
+      setInt(realtime, "priority", tstats.priority);
+      setInt(realtime, "nice", tstats.nice);
+      setBool(realtime, "pinned", tstats.pinned);
+      setBool(realtime, "locked", tstats.locked);
+      if (tstats.error) setString(realtime, "error", strerror(tstats.error));
+      setValue(realtime, "latency", convertHistogram(tstats.latency));
+      setValue(stats, "realtime", realtime);
+    }
+    if (reset) self->convertHits = self->convertMisses = 0;
+    info.GetReturnValue().Set(stats);
+  }
+  
+  
   NAN_METHOD(Camera::FrameRaw) {
-    const auto camera = Nan::ObjectWrap::Unwrap<Camera>(info.Holder())->camera;
+    const auto self = Ready(info);
+    if (!self) return;
+    const auto camera = self->camera;
     const auto size = camera->head.length;
+    const auto begin = camera_now();
     auto data = new uint8_t[size];
     std::copy(camera->head.start, camera->head.start + size, data);
+    self->Record(CAMERA_STAGE_FRAME, begin);
     const auto flag = v8::ArrayBufferCreationMode::kInternalized;
     auto buf = v8::ArrayBuffer::New(info.GetIsolate(), data, size, flag);
     auto array = v8::Uint8Array::New(buf, 0, size);
     info.GetReturnValue().Set(array);
   }
   
-  NAN_METHOD(Camera::FrameYUYVToRGB) {
-    // TBD: check the current format as YUYV
-    const auto camera = Nan::ObjectWrap::Unwrap<Camera>(info.Holder())->camera;
-    auto rgb = yuyv2rgb(camera->head.start, camera->width, camera->height);
-    const auto size = camera->width * camera->height * 3;
-    const auto flag = v8::ArrayBufferCreationMode::kInternalized;
-    auto buf = v8::ArrayBuffer::New(info.GetIsolate(), rgb, size, flag);
-    auto array = v8::Uint8Array::New(buf, 0, size);
-    info.GetReturnValue().Set(array);
-  }
-  
-  
-  NAN_METHOD(Camera::ConfigGet) {
-    const auto camera = Nan::ObjectWrap::Unwrap<Camera>(info.Holder())->camera;
-    camera_format_t cformat;
-    if (!camera_config_get(camera, &cformat)) {
-      Nan::ThrowError(cameraError(camera));
+  // of the raw head frame, one object per frame delivered to "frame"
+  NAN_METHOD(Camera::FrameInfo) {
+    const auto self = Ready(info);
+    if (!self) return;
+    const auto camera = self->camera;
+    if (!camera->head.start) {
+      info.GetReturnValue().SetNull();
       return;
     }
-    auto format = convertFormat(&cformat);
-    info.GetReturnValue().Set(format);
+    auto frame = newObject(SHAPE_FRAME);
+    setUint(frame, "sequence", camera->sequence);
+    setValue(frame, "timestamp", Nan::New(camera->timestamp / 1e6));
+    setUint(frame, "format", camera->image.format);
+    setUint(frame, "width", camera->width);
+    setUint(frame, "height", camera->height);
+    setValue(frame, "length", 
+             Nan::New(static_cast<double>(camera->head.length)));
+    info.GetReturnValue().Set(frame);
   }
   
-  NAN_METHOD(Camera::ConfigSet) {
-    if (info.Length() < 1) {
-      Nan::ThrowTypeError("argument required: config");
-      return;
+  //[conversion cache]
+  // a new view on the cached output, empty on a miss
+  v8::Local<v8::Value> Camera::Converted(const ConvertKey& key) {
+    if (convertGeneration != camera->generation) {
+      converted.clear();
+      convertGeneration = camera->generation;
     }
-    const auto cformat = convertCFormat(info[0]->ToObject());
-    auto thisObj = info.Holder();
-    auto camera = Nan::ObjectWrap::Unwrap<Camera>(thisObj)->camera;
-    if (!camera_config_set(camera, &cformat)) {
-      Nan::ThrowError(cameraError(camera));
-      return;
+    const auto found = converted.find(key);
+    if (found == converted.end()) {
+      ++convertMisses;
+      return v8::Local<v8::Value>();
     }
-    setUint(thisObj, "width", camera->width);
-    setUint(thisObj, "height", camera->height);
-    info.GetReturnValue().Set(thisObj);
+    ++convertHits;
+    auto buf = Nan::New(found->second);
+    return v8::Uint8Array::New(buf, 0, buf->ByteLength());
+  }
+  // takes the malloc()ed data over as the cached output of key
+  v8::Local<v8::Value> 
+  Camera::Convert(const ConvertKey& key, std::uint8_t* data, 
+                  std::size_t size) {
+    const auto flag = v8::ArrayBufferCreationMode::kInternalized;
+    auto buf = v8::ArrayBuffer::New(v8::Isolate::GetCurrent(), data, size, 
+                                    flag);
+    converted[key].Reset(buf);
+    return v8::Uint8Array::New(buf, 0, size);
   }
   
-  NAN_METHOD(Camera::ControlGet) {
-    if (info.Length() < 1) {
-      Nan::ThrowTypeError("an argument required: id");
+  NAN_METHOD(Camera::FrameYUYVToRGB) {
+    const auto self = Ready(info);
+    if (!self) return;
+    const auto camera = self->camera;
+    auto image = camera->image;
+    if (info[0]->IsObject()) {
+      auto options = Nan::To<v8::Object>(info[0]).ToLocalChecked();
+      if (!colorimetrySet(image, options)) return;
+    }
+    const auto key = 
+      ConvertKey(CONVERT_RGB, image.ycbcr_enc, image.quantization);
+    const auto cached = self->Converted(key);
+    if (!cached.IsEmpty()) {
+      info.GetReturnValue().Set(cached);
       return;
     }
-    const auto id = info[0]->Uint32Value();
-    auto camera = Nan::ObjectWrap::Unwrap<Camera>(info.Holder())->camera;
-    auto value = std::int32_t{0};
-    auto success = bool{camera_control_get(camera, id, &value)};
-    if (!success) {
-      Nan::ThrowError(cameraError(camera));
+    const auto begin = camera_now();
+    auto rgb = camera_image_rgb(&image, camera->head.start);
+    self->Record(CAMERA_STAGE_CONVERT, begin);
+    if (!rgb) {
+      Nan::ThrowError("toRGB: unsupported format");
       return;
     }
-    info.GetReturnValue().Set(Nan::New(value));
+    const auto size = std::size_t{image.width} * image.height * 3;
+    info.GetReturnValue().Set(self->Convert(key, rgb, size));
   }
   
-  NAN_METHOD(Camera::ControlSet) {
-    if (info.Length() < 2) {
-      Nan::ThrowTypeError("arguments required: id, value");
+  // {data, width, height} of a raw Bayer frame; binning halves the size
+  NAN_METHOD(Camera::Demosaic) {
+    const auto self = Ready(info);
+    if (!self) return;
+    const auto camera = self->camera;
+    const auto& image = camera->image;
+    if (!camera_format_bayer(image.format)) {
+      Nan::ThrowError("demosaic: not a Bayer format");
       return;
     }
-    const auto id = info[0]->Uint32Value();
-    const auto value = info[1]->Int32Value();
+    auto config = camera_demosaic_config_t{};
+    if (!demosaicConfig(info[0], config)) return;
+    const auto binning = config.method == CAMERA_DEMOSAIC_BINNING;
+    // unoriented, as a cached output has no size of its own
+    const auto width = binning ? image.width / 2 : image.width;
+    const auto height = binning ? image.height / 2 : image.height;
+    const auto key = ConvertKey(CONVERT_DEMOSAIC, config.method, config.pixel);
+    auto data = self->Converted(key);
+    if (data.IsEmpty()) {
+      const auto begin = camera_now();
+      auto out = camera_image_demosaic(&image, camera->head.start, &config,
+                                       nullptr, nullptr);
+      self->Record(CAMERA_STAGE_CONVERT, begin);
+      if (!out) {
+        Nan::ThrowError("demosaic: conversion failed");
+        return;
+      }
+      const auto size = std::size_t{width} * height * config.pixel;
+      data = self->Convert(key, out, size);
+    }
+    auto outWidth = std::uint32_t{0}, outHeight = std::uint32_t{0};
+    camera_orientation_size(image.orientation, width, height, 
+                            &outWidth, &outHeight);
+    auto result = Nan::New<v8::Object>();
+    setValue(result, "data", data);
+    setUint(result, "width", outWidth);
+    setUint(result, "height", outHeight);
+    info.GetReturnValue().Set(result);
+  }
+  
+  static const char* flip_names[] = {"none", "horizontal", "vertical"};
+  // flipped first, then rotated clockwise
+  static const camera_orientation_t orientations[3][4] = {
+    {CAMERA_ORIENT_NONE, CAMERA_ORIENT_ROTATE_90, 
+     CAMERA_ORIENT_ROTATE_180, CAMERA_ORIENT_ROTATE_270},
+    {CAMERA_ORIENT_FLIP_H, CAMERA_ORIENT_TRANSVERSE, 
+     CAMERA_ORIENT_FLIP_V, CAMERA_ORIENT_TRANSPOSE},
+    {CAMERA_ORIENT_FLIP_V, CAMERA_ORIENT_TRANSPOSE, 
+     CAMERA_ORIENT_FLIP_H, CAMERA_ORIENT_TRANSVERSE},
+  };
+  
+  // {rotate: 0, 90, 180 or 270, flip}: applied while converting, so
+  // cam.width/cam.height and every converted output are of the turned
+  // frame; raw frames stay as captured
+  NAN_METHOD(Camera::Orientation) {
     auto thisObj = info.Holder();
-    auto camera = Nan::ObjectWrap::Unwrap<Camera>(thisObj)->camera;
-    auto success = bool{camera_control_set(camera, id, value)};
-    if (!success) {
-      Nan::ThrowError(cameraError(camera));
+    const auto self = Ready(info);
+    if (!self) return;
+    auto rotate = 0;
+    auto flip = std::size_t{0};
+    if (info[0]->IsObject()) {
+      auto options = Nan::To<v8::Object>(info[0]).ToLocalChecked();
+      rotate = (static_cast<int>(getNumber(options, "rotate", 0)) % 360 + 
+                360) % 360;
+      if (!nameIndex(flip_names, getString(options, "flip", "none"),
+                     "flip", flip)) return;
+    }
+    if (rotate % 90 != 0) {
+      Nan::ThrowError("orientation: rotate by 0, 90, 180 or 270");
       return;
     }
+    const auto orientation = orientations[flip][rotate / 90];
+    const auto camera = self->camera;
+    Hold::Run(self, [camera, orientation] {
+      camera_orientation_set(camera, orientation);
+      return true;
+    });
+    self->converted.clear();
+    setSize(thisObj, camera);
     info.GetReturnValue().Set(thisObj);
   }
   
+  //[denoise]
+  // the frames retrieved are filtered in place before any conversion
+  NAN_METHOD(Camera::Denoise) {
+    auto thisObj = info.Holder();
+    const auto self = Ready(info);
+    if (!self) return;
+    const auto camera = self->camera;
+    auto denoise = static_cast<camera_denoise_t*>(nullptr);
+    if (info[0]->IsObject()) {
+      if (!camera_denoise_supported(camera->image.format)) {
+        Nan::ThrowError("denoise: not a format of 8 bit samples");
+        return;
+      }
+      const auto options = Nan::To<v8::Object>(info[0]).ToLocalChecked();
+      auto config = camera_denoise_config_t{};
+      config.frames = getNumber(options, "frames", 4);
+      config.threshold = getNumber(options, "threshold", 24);
+      config.stack = Nan::To<bool>(getValue(options, "stack")).FromJust();
+      denoise = camera_denoise_new(&config);
+      if (!denoise) {
+        Nan::ThrowError(strerror(errno));
+        return;
+      }
+    }
+    Hold::Run(self, [camera, denoise] {
+      camera_denoise_delete(camera->denoise);
+      camera->denoise = denoise;
+      return true;
+    });
+    info.GetReturnValue().Set(thisObj);
+  }
+  
+  // the mean of the frames stacked so far replaces the cached frame
+  NAN_METHOD(Camera::Stacked) {
+    const auto self = Ready(info);
+    if (!self) return;
+    const auto camera = self->camera;
+    if (!camera->denoise) {
+      Nan::ThrowError("stacked: no denoise({stack: true})");
+      return;
+    }
+    const auto reset = Nan::To<bool>(info[0]).FromJust();
+    auto count = std::size_t{0};
+    Hold::Run(self, [camera, reset, &count] {
+      if (!camera->head.start) return false;
+      count = camera_denoise_stacked(camera->denoise, camera->head.start,
+                                     camera->head.length, reset);
+      if (count) camera->generation++;
+      return true;
+    });
+    info.GetReturnValue().Set(Nan::New(static_cast<double>(count)));
+  }
+  
+  // single channel samples widened to a Uint16Array, rows unpadded
+  NAN_METHOD(Camera::Samples) {
+    const auto self = Ready(info);
+    if (!self) return;
+    const auto camera = self->camera;
+    const auto& image = camera->image;
+    const auto begin = camera_now();
+    auto samples = camera_image_samples(&image, camera->head.start);
+    self->Record(CAMERA_STAGE_CONVERT, begin);
+    if (!samples) {
+      Nan::ThrowError("samples: not a single channel format");
+      return;
+    }
+    const auto count = std::size_t{image.width} * image.height;
+    const auto flag = v8::ArrayBufferCreationMode::kInternalized;
+    auto buf = v8::ArrayBuffer::New(info.GetIsolate(), samples, 
+                                    count * sizeof (std::uint16_t), flag);
+    info.GetReturnValue().Set(v8::Uint16Array::New(buf, 0, count));
+  }
+  
+  // {data, width, height, min, max, low, high}: 8 bit gray, or RGB with
+  // a colormap
+  NAN_METHOD(Camera::Normalize) {
+    const auto self = Ready(info);
+    if (!self) return;
+    const auto camera = self->camera;
+    const auto& image = camera->image;
+    if (!camera_format_mono(image.format)) {
+      Nan::ThrowError("normalize: not a single channel format");
+      return;
+    }
+    auto config = camera_normalize_config_t{};
+    auto lut = std::vector<std::uint8_t>{};
+    if (!normalizeConfig(info[0], image.format, config, lut)) return;
+    auto range = camera_normalize_result_t{};
+    const auto begin = camera_now();
+    auto out = camera_image_normalize(&image, camera->head.start, &config,
+                                      &range);
+    self->Record(CAMERA_STAGE_CONVERT, begin);
+    if (!out) {
+      Nan::ThrowError("normalize: conversion failed");
+      return;
+    }
+    const auto size = std::size_t{image.width} * image.height * 
+      (config.colormap ? 3 : 1);
+    auto width = std::uint32_t{0}, height = std::uint32_t{0};
+    camera_orientation_size(image.orientation, image.width, image.height,
+                            &width, &height);
+    const auto flag = v8::ArrayBufferCreationMode::kInternalized;
+    auto buf = v8::ArrayBuffer::New(info.GetIsolate(), out, size, flag);
+    auto result = Nan::New<v8::Object>();
+    setValue(result, "data", v8::Uint8Array::New(buf, 0, size));
+    setUint(result, "width", width);
+    setUint(result, "height", height);
+    setUint(result, "min", range.min);
+    setUint(result, "max", range.max);
+    setUint(result, "low", range.low);
+    setUint(result, "high", range.high);
+    info.GetReturnValue().Set(result);
+  }
+  
+  // {lens, zoom, width, height} or {mapX, mapY, width, height}; null
+  // turns remapping off
+  NAN_METHOD(Camera::RemapSet) {
+    const auto self = Ready(info);
+    if (!self) return;
+    self->converted.clear();
+    if (!info[0]->IsObject()) {
+      self->remapping.reset();
+      return;
+    }
+    auto options = Nan::To<v8::Object>(info[0]).ToLocalChecked();
+    std::unique_ptr<Remapping> remapping(new Remapping{});
+    remapping->width = getUint(options, "width");
+    remapping->height = getUint(options, "height");
+    const auto lens = getValue(options, "lens");
+    const auto xs = getValue(options, "mapX");
+    const auto ys = getValue(options, "mapY");
+    if (lens->IsObject()) {
+      remapping->byLens = true;
+      if (!lensConfig(Nan::To<v8::Object>(lens).ToLocalChecked(), 
+                      remapping->lens)) return;
+      remapping->lens.zoom = getNumber(options, "zoom", 1);
+    } else if (xs->IsFloat32Array() && ys->IsFloat32Array()) {
+      const auto count = 
+        std::size_t{remapping->width} * remapping->height;
+      Nan::TypedArrayContents<float> x(xs), y(ys);
+      if (count == 0 || x.length() != count || y.length() != count) {
+        Nan::ThrowError("remapSet: mapX and mapY of width * height");
+        return;
+      }
+      remapping->xs.assign(*x, *x + count);
+      remapping->ys.assign(*y, *y + count);
+    } else {
+      Nan::ThrowTypeError("remapSet: lens or mapX and mapY required");
+      return;
+    }
+    self->remapping = std::move(remapping);
+  }
+  
+  // {data, width, height} of the frame remapped by remapSet()
+  NAN_METHOD(Camera::RemapFrame) {
+    const auto self = Ready(info);
+    if (!self) return;
+    const auto camera = self->camera;
+    const auto& image = camera->image;
+    const auto remapping = self->remapping.get();
+    if (!remapping) {
+      Nan::ThrowError("remap: no lens or map set");
+      return;
+    }
+    auto config = camera_remap_config_t{};
+    if (!remapConfig(info[0], config)) return;
+    if (remapping->map && (remapping->srcWidth != image.width || 
+                           remapping->srcHeight != image.height)) {
+      camera_remap_delete(remapping->map);
+      remapping->map = nullptr;
+    }
+    const auto width = remapping->width ? remapping->width : image.width;
+    const auto height = 
+      remapping->height ? remapping->height : image.height;
+    if (!remapping->map) {
+      remapping->map = remapping->byLens ?
+        camera_remap_lens(&remapping->lens, image.width, image.height, 
+                          width, height) :
+        camera_remap_map(image.width, image.height, width, height, 
+                         remapping->xs.data(), remapping->ys.data());
+      if (!remapping->map) {
+        Nan::ThrowError("remap: no map for the frame size");
+        return;
+      }
+      remapping->srcWidth = image.width;
+      remapping->srcHeight = image.height;
+    }
+    const auto key = ConvertKey(CONVERT_REMAP, config.pixel, 0);
+    auto data = self->Converted(key);
+    if (data.IsEmpty()) {
+      const auto begin = camera_now();
+      auto out = camera_image_remap(remapping->map, &image, 
+                                    camera->head.start, &config);
+      self->Record(CAMERA_STAGE_CONVERT, begin);
+      if (!out) {
+        Nan::ThrowError("remap: unsupported format");
+        return;
+      }
+      const auto size = std::size_t{width} * height * config.pixel;
+      data = self->Convert(key, out, size);
+    }
+    auto outWidth = std::uint32_t{0}, outHeight = std::uint32_t{0};
+    camera_orientation_size(image.orientation, width, height, 
+                            &outWidth, &outHeight);
+    auto result = Nan::New<v8::Object>();
+    setValue(result, "data", data);
+    setUint(result, "width", outWidth);
+    setUint(result, "height", outHeight);
+    info.GetReturnValue().Set(result);
+  }
+  
+  // encodes a copy of the head frame on the threadpool: single channel
+  // formats as normalized gray, RGB24 as captured, others through toRGB
+  class Camera::PngWorker : public Nan::AsyncWorker {
+  public:
+    PngWorker(Camera* self, v8::Local<v8::Object> thisObj,
+              const camera_png_config_t& config, Nan::Callback* callback)
+      : Nan::AsyncWorker(callback), pngs(self->pngs), config(config),
+        image(self->camera->image), 
+        data(self->camera->head.start, 
+             self->camera->head.start + self->camera->head.length),
+        png(nullptr), out(nullptr), length(0) {
+      SaveToPersistent("camera", thisObj);
+    }
+    ~PngWorker() {
+      if (png) pngs->Give(png);
+    }
+    void Execute() {
+      auto width = std::uint32_t{0}, height = std::uint32_t{0};
+      camera_orientation_size(image.orientation, image.width, image.height,
+                              &width, &height);
+      auto pixels = static_cast<const std::uint8_t*>(data.data());
+      auto channels = std::size_t{3};
+      auto stride = std::uint32_t{0};
+      auto converted = std::unique_ptr<std::uint8_t, decltype(&free)>(
+        nullptr, free);
+      const auto direct = image.format == V4L2_PIX_FMT_RGB24 && 
+        image.plane_count == 1 && image.orientation == CAMERA_ORIENT_NONE;
+      if (direct) {
+        const auto& plane = image.planes[0];
+        stride = plane.stride ? plane.stride : width * 3;
+        if (plane.offset + std::size_t{stride} * (height - 1) + 
+            width * 3 > data.size()) {
+          SetErrorMessage("toPNG: short frame");
+          return;
+        }
+        pixels += plane.offset;
+      } else if (camera_format_mono(image.format)) {
+        const camera_normalize_config_t gray = {
+          CAMERA_SCALE_MINMAX, 0, 0, image.format == V4L2_PIX_FMT_Z16, 
+          nullptr};
+        converted.reset(camera_image_normalize(&image, pixels, &gray, 
+                                               nullptr));
+        channels = 1;
+      } else {
+        converted.reset(camera_image_rgb(&image, pixels));
+      }
+      if (!direct) {
+        if (!converted) {
+          SetErrorMessage("toPNG: unsupported format");
+          return;
+        }
+        pixels = converted.get();
+      }
+      png = pngs->Take();
+      if (png) {
+        out = camera_png_encode(png, pixels, width, height, channels, 
+                                stride, &config, &length);
+      }
+      if (!out) SetErrorMessage("toPNG: encoding failed");
+    }
+    void HandleOKCallback() {
+      Nan::HandleScope scope;
+      v8::Local<v8::Value> argv[] = {
+        Nan::Null(),
+        Nan::CopyBuffer(reinterpret_cast<const char*>(out), length)
+        .ToLocalChecked(),
+      };
+      callback->Call(2, argv);
+    }
+  private:
+    std::shared_ptr<PngPool> pngs;
+    camera_png_config_t config;
+    camera_image_t image;
+    std::vector<std::uint8_t> data;
+    camera_png_t* png;
+    const std::uint8_t* out; /* held by png */
+    std::size_t length;
+  };
+  
+  // {level, threads}: level 0-9 defaults to 1, threads 0 for every core
+  NAN_METHOD(Camera::ToPNGAsync) {
+    const auto self = Ready(info);
+    if (!self) return;
+    if (!info[1]->IsFunction()) {
+      Nan::ThrowTypeError("argument required: callback");
+      return;
+    }
+    if (!self->camera->head.start) {
+      Nan::ThrowError("toPNG: no frame captured");
+      return;
+    }
+    auto config = camera_png_config_t{1, 1};
+    if (info[0]->IsObject()) {
+      auto options = Nan::To<v8::Object>(info[0]).ToLocalChecked();
+      config.level = getNumber(options, "level", config.level);
+      config.threads = getNumber(options, "threads", config.threads);
+    }
+    if (!self->pngs) self->pngs = std::make_shared<PngPool>();
+    auto callback = new Nan::Callback(info[1].As<v8::Function>());
+    Nan::AsyncQueueWorker(
+      new PngWorker(self, info.Holder(), config, callback));
+  }
+  
+  
+  // planes are views on one copy of the frame in their captured layout
+  NAN_METHOD(Camera::FramePlanes) {
+    const auto self = Ready(info);
+    if (!self) return;
+    const auto camera = self->camera;
+    const auto& image = camera->image;
+    const auto size = camera->head.length;
+    const auto begin = camera_now();
+    auto data = new uint8_t[size];
+    std::copy(camera->head.start, camera->head.start + size, data);
+    self->Record(CAMERA_STAGE_FRAME, begin);
+    const auto flag = v8::ArrayBufferCreationMode::kInternalized;
+    auto buf = v8::ArrayBuffer::New(info.GetIsolate(), data, size, flag);
+    auto planes = Nan::New<v8::Array>(image.plane_count);
+    for (auto i = std::size_t{0}; i < image.plane_count; ++i) {
+      const auto& cplane = image.planes[i];
+      const auto offset = std::min(cplane.offset, size);
+      const auto length = std::min(cplane.length, size - offset);
+      auto plane = Nan::New<v8::Object>();
+      setValue(plane, "data", v8::Uint8Array::New(buf, offset, length));
+      setUint(plane, "offset", offset);
+      setUint(plane, "stride", cplane.stride);
+      Nan::Set(planes, i, plane);
+    }
+    info.GetReturnValue().Set(planes);
+  }
+  
+  
+  // slots of a SharedArrayBuffer, see FramePool in index.js: a 32 byte
+  // header per slot {int32 refs, length, sequence, format, width, height,
+  // float64 timestamp}, then the slot data from a 64 byte boundary
+  static const auto slotHeader = std::size_t{32};
+  NAN_METHOD(Camera::FrameToSlot) {
+    const auto self = Ready(info);
+    if (!self) return;
+    const auto camera = self->camera;
+    Nan::TypedArrayContents<std::uint8_t> contents(info[0]);
+    const auto slots = std::size_t{Nan::To<std::uint32_t>(info[1]).FromJust()};
+    const auto slotBytes = 
+      std::size_t{Nan::To<std::uint32_t>(info[2]).FromJust()};
+    const auto dataOffset = (slots * slotHeader + 63) / 64 * 64;
+    const auto base = *contents;
+    if (!base || contents.length() < dataOffset + slots * slotBytes) {
+      Nan::ThrowRangeError("frame pool buffer too small");
+      return;
+    }
+    if (camera->head.length > slotBytes) {
+      Nan::ThrowRangeError("frame larger than the pool slots");
+      return;
+    }
+    for (auto i = std::size_t{0}; i < slots; ++i) {
+      const auto header = base + i * slotHeader;
+      auto refs = reinterpret_cast<std::int32_t*>(header);
+      auto expected = std::int32_t{0};
+      // same memory as Atomics on the Int32Array of the other threads
+      if (!__atomic_compare_exchange_n(refs, &expected, 1, false, 
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        continue;
+      const auto begin = camera_now();
+      std::copy(camera->head.start, camera->head.start + camera->head.length,
+                base + dataOffset + i * slotBytes);
+      self->Record(CAMERA_STAGE_FRAME, begin);
+      auto fields = reinterpret_cast<std::uint32_t*>(header);
+      fields[1] = camera->head.length;
+      fields[2] = camera->sequence;
+      fields[3] = camera->image.format;
+      fields[4] = camera->width;
+      fields[5] = camera->height;
+      *reinterpret_cast<double*>(header + 24) = camera->timestamp / 1e6;
+      info.GetReturnValue().Set(Nan::New(static_cast<std::int32_t>(i)));
+      return;
+    }
+    info.GetReturnValue().Set(Nan::New(-1));
+  }
+  
+  
+  NAN_METHOD(Camera::ConfigGet) {
+    const auto self = Ready(info);
+    if (!self) return;
+    const auto camera = self->camera;
+    camera_format_t cformat;
+    if (!camera_config_get(camera, &cformat)) {
+      Nan::ThrowError(cameraError(camera));
+      return;
+    }
+    auto format = convertFormat(&cformat);
+    info.GetReturnValue().Set(format);
+  }
+  
+  NAN_METHOD(Camera::ConfigSet) {
+    if (info.Length() < 1) {
+      Nan::ThrowTypeError("argument required: config");
+      return;
+    }
+    const auto cformat = convertCFormat(info[0]->ToObject());
+    auto thisObj = info.Holder();
+    auto self = Ready(info);
+    if (!self) return;
+    auto camera = self->camera;
+    const auto set = [camera, &cformat] {
+      return camera_config_set(camera, &cformat);
+    };
+    if (!Hold::Change(self, set)) {
+      Nan::ThrowError(cameraError(camera));
+      return;
+    }
+    setSize(thisObj, camera);
+    setValue(thisObj, "colorimetry", colorimetryGet(camera->image));
+    setValue(thisObj, "configLatency", Nan::New(camera->config_latency / 1e6));
+    info.GetReturnValue().Set(thisObj);
+  }
+  
+  NAN_METHOD(Camera::SelectMode) {
+    const auto self = Ready(info);
+    if (!self) return;
+    auto camera = self->camera;
+    auto request = camera_mode_request_t{};
+    std::vector<std::uint32_t> prefer;
+    std::vector<camera_format_cost_t> costs;
+    if (info[0]->IsObject()) {
+      const auto options = Nan::To<v8::Object>(info[0]).ToLocalChecked();
+      request.min_fps = getNumber(options, "minFps", 0);
+      request.min_width = getUint(options, "minWidth");
+      request.min_height = getUint(options, "minHeight");
+      request.max_width = getUint(options, "maxWidth");
+      request.max_height = getUint(options, "maxHeight");
+      const auto fprefer = getValue(options, "preferFormats");
+      if (fprefer->IsArray()) {
+        const auto array = fprefer.As<v8::Array>();
+        for (auto i = std::uint32_t{0}; i < array->Length(); ++i) {
+          prefer.push_back(formatId(Nan::Get(array, i).ToLocalChecked()));
+        }
+      }
+      const auto fmodel = getValue(options, "costModel");
+      if (fmodel->IsObject()) {
+        const auto model = Nan::To<v8::Object>(fmodel).ToLocalChecked();
+        request.bandwidth = getNumber(model, "bandwidth", 0);
+        const auto fformats = getValue(model, "formats");
+        if (fformats->IsObject()) {
+          const auto formats = Nan::To<v8::Object>(fformats).ToLocalChecked();
+          const auto names = Nan::GetOwnPropertyNames(formats).ToLocalChecked();
+          for (auto i = std::uint32_t{0}; i < names->Length(); ++i) {
+            const auto name = Nan::Get(names, i).ToLocalChecked();
+            const auto fcost = Nan::Get(formats, name).ToLocalChecked();
+            if (!fcost->IsObject()) continue;
+            const auto cost = Nan::To<v8::Object>(fcost).ToLocalChecked();
+            costs.push_back({
+              formatId(name), 
+              getNumber(cost, "bytesPerPixel", 2), 
+              getNumber(cost, "costPerPixel", 1),
+            });
+          }
+        }
+      }
+    }
+    request.prefer = prefer.data();
+    request.prefer_length = prefer.size();
+    request.costs = costs.data();
+    request.cost_length = costs.size();
+    
+    camera_format_t cformat;
+    if (!camera_formats_select(camera_formats(camera), &request, &cformat)) {
+      info.GetReturnValue().SetNull();
+      return;
+    }
+    info.GetReturnValue().Set(convertFormat(&cformat));
+  }
+  
+  static v8::Local<v8::Object> convertRect(const camera_rect_t& rect) {
+    auto obj = Nan::New<v8::Object>();
+    setInt(obj, "left", rect.left);
+    setInt(obj, "top", rect.top);
+    setUint(obj, "width", rect.width);
+    setUint(obj, "height", rect.height);
+    return obj;
+  }
+  
+  NAN_METHOD(Camera::CropBounds) {
+    const auto self = Ready(info);
+    if (!self) return;
+    auto bounds = camera_rect_t{}, defrect = camera_rect_t{};
+    if (!camera_crop_bounds(self->camera, &bounds, &defrect)) {
+      Nan::ThrowError(cameraError(self->camera));
+      return;
+    }
+    auto obj = convertRect(bounds);
+    setValue(obj, "default", convertRect(defrect));
+    info.GetReturnValue().Set(obj);
+  }
+  
+  NAN_METHOD(Camera::CropGet) {
+    const auto self = Ready(info);
+    if (!self) return;
+    auto rect = camera_rect_t{};
+    if (!camera_crop_get(self->camera, &rect)) {
+      Nan::ThrowError(cameraError(self->camera));
+      return;
+    }
+    info.GetReturnValue().Set(convertRect(rect));
+  }
+  
+  // without a rect the default crop is restored
+  NAN_METHOD(Camera::CropSet) {
+    auto thisObj = info.Holder();
+    const auto self = Ready(info);
+    if (!self) return;
+    auto camera = self->camera;
+    auto rect = camera_rect_t{};
+    if (info[0]->IsObject()) {
+      const auto obj = Nan::To<v8::Object>(info[0]).ToLocalChecked();
+      rect.left = getInt(obj, "left");
+      rect.top = getInt(obj, "top");
+      rect.width = getUint(obj, "width");
+      rect.height = getUint(obj, "height");
+    } else {
+      auto bounds = camera_rect_t{};
+      if (!camera_crop_bounds(camera, &bounds, &rect)) {
+        Nan::ThrowError(cameraError(camera));
+        return;
+      }
+    }
+    if (!Hold::Change(self, [camera, &rect] {
+          return camera_crop_set(camera, &rect);
+        })) {
+      Nan::ThrowError(cameraError(camera));
+      return;
+    }
+    setSize(thisObj, camera);
+    info.GetReturnValue().Set(convertRect(rect));
+  }
+  
+  NAN_METHOD(Camera::ControlGet) {
+    if (info.Length() < 1) {
+      Nan::ThrowTypeError("an argument required: id");
+      return;
+    }
+    const auto id = info[0]->Uint32Value();
+    const auto self = Ready(info);
+    if (!self) return;
+    auto camera = self->camera;
+    auto value = std::int32_t{0};
+    auto success = bool{camera_control_get(camera, id, &value)};
+    if (!success) {
+      Nan::ThrowError(cameraError(camera));
+      return;
+    }
+    info.GetReturnValue().Set(Nan::New(value));
+  }
+  
+  NAN_METHOD(Camera::ControlSet) {
+    if (info.Length() < 2) {
+      Nan::ThrowTypeError("arguments required: id, value");
+      return;
+    }
+    const auto id = info[0]->Uint32Value();
+    const auto value = info[1]->Int32Value();
+    auto thisObj = info.Holder();
+    auto self = Ready(info);
+    if (!self) return;
+    auto camera = self->camera;
+    auto success = bool{camera_control_set(camera, id, value)};
+    if (!success) {
+      Nan::ThrowError(cameraError(camera));
+      return;
+    }
+    info.GetReturnValue().Set(thisObj);
+  }
+  
+  
+  //[async methods]
+  // device ioctls run on the threadpool; the camera stays busy meanwhile
+  class Camera::Worker : public Nan::AsyncWorker {
+  public:
+    typedef bool (*Task)(camera_t* camera, const camera_format_t* format);
+    Worker(Camera* self, v8::Local<v8::Object> thisObj, Task task,
+           const camera_format_t& format, Nan::Callback* callback)
+      : Nan::AsyncWorker(callback), self(self), task(task), format(format) {
+      SaveToPersistent("camera", thisObj);
+      // nothing of the camera is matched while the task changes it
+      if (self->sync) self->sync->Flush(self);
+      self->busy = true;
+      self->Watch();
+    }
+    // the capture thread is parked rather than locked out, the lock stays
+    // free for stats() meanwhile; unparking drops its copied frame
+    void Execute() {
+      const auto thread = self->thread;
+      if (thread) camera_thread_park(thread);
+      const auto ok = task(self->camera, &format);
+      if (thread) camera_thread_unpark(thread);
+      if (ok) return;
+      SetErrorMessage(
+        static_cast<LogContext*>(self->camera->context.pointer)->msg.c_str());
+    }
+    void HandleOKCallback() {
+      Nan::HandleScope scope;
+      const auto thisObj = Done();
+      const auto camera = self->camera;
+      setSize(thisObj, camera);
+      setValue(thisObj, "colorimetry", colorimetryGet(camera->image));
+      setValue(thisObj, "configLatency", 
+               Nan::New(camera->config_latency / 1e6));
+      v8::Local<v8::Value> argv[] = {Nan::Null(), thisObj};
+      callback->Call(2, argv);
+    }
+    void HandleErrorCallback() {
+      Nan::HandleScope scope;
+      Done();
+      v8::Local<v8::Value> argv[] = {Nan::Error(ErrorMessage())};
+      callback->Call(1, argv);
+    }
+  private:
+    v8::Local<v8::Object> Done() {
+      self->busy = false;
+      self->Watch();
+      const auto thisObj = 
+        Nan::To<v8::Object>(GetFromPersistent("camera")).ToLocalChecked();
+      if (!self->Subscribe()) self->Emit("error", cameraError(self->camera));
+      return thisObj;
+    }
+    Camera* self;
+    Task task;
+    camera_format_t format;
+  };
+  
+  NAN_METHOD(Camera::StartAsync) {
+    auto self = Ready(info);
+    if (!self) return;
+    auto task = [](camera_t* camera, const camera_format_t*) -> bool {
+      return camera_start(camera);
+    };
+    auto callback = new Nan::Callback(info[0].As<v8::Function>());
+    Nan::AsyncQueueWorker(
+      new Worker(self, info.Holder(), task, camera_format_t{}, callback));
+  }
+  
+  NAN_METHOD(Camera::StopAsync) {
+    auto self = Ready(info);
+    if (!self) return;
+    auto task = [](camera_t* camera, const camera_format_t*) -> bool {
+      return camera_stop(camera);
+    };
+    auto callback = new Nan::Callback(info[0].As<v8::Function>());
+    Nan::AsyncQueueWorker(
+      new Worker(self, info.Holder(), task, camera_format_t{}, callback));
+  }
+  
+  NAN_METHOD(Camera::ConfigSetAsync) {
+    auto self = Ready(info);
+    if (!self) return;
+    const auto cformat = convertCFormat(info[0]->ToObject());
+    auto task = [](camera_t* camera, const camera_format_t* format) -> bool {
+      return camera_config_set(camera, format);
+    };
+    auto callback = new Nan::Callback(info[1].As<v8::Function>());
+    Nan::AsyncQueueWorker(
+      new Worker(self, info.Holder(), task, cformat, callback));
+  }
+  
+  // opens and enumerates the device off the main thread
+  class Camera::OpenWorker : public Nan::AsyncWorker {
+  public:
+    OpenWorker(const std::string& device, Nan::Callback* callback)
+      : Nan::AsyncWorker(callback), device(device), camera(nullptr),
+        openErrno(0) {}
+    ~OpenWorker() {
+      if (!camera) return;
+      auto ctx = static_cast<LogContext*>(camera->context.pointer);
+      camera_close(camera);
+      delete ctx;
+    }
+    void Execute() {
+      camera = camera_open(device.c_str());
+      if (!camera) {
+        openErrno = errno;
+        SetErrorMessage("open");
+        return;
+      }
+      camera->context.pointer = new LogContext;
+      camera->context.log = &logRecord;
+      camera_formats(camera);
+      camera_controls(camera);
+    }
+    void HandleOKCallback() {
+      Nan::HandleScope scope;
+      v8::Local<v8::Value> args[] = {
+        Nan::New<v8::External>(camera), Nan::New(device).ToLocalChecked(),
+      };
+      const auto data = getAddonData(v8::Isolate::GetCurrent());
+      const auto ctor = Nan::New(data->camera);
+      Nan::TryCatch tryCatch;
+      const auto inst = Nan::NewInstance(ctor, 2, args);
+      if (inst.IsEmpty()) {
+        // the camera is still the worker's, closed with it
+        v8::Local<v8::Value> argv[] = {
+          tryCatch.HasCaught() ? tryCatch.Exception() :
+            Nan::Error("open: the camera object was not created"),
+        };
+        tryCatch.Reset();
+        callback->Call(1, argv);
+        return;
+      }
+      camera = nullptr;
+      v8::Local<v8::Value> argv[] = {Nan::Null(), inst.ToLocalChecked()};
+      callback->Call(2, argv);
+    }
+    void HandleErrorCallback() {
+      Nan::HandleScope scope;
+      v8::Local<v8::Value> argv[] = {Nan::Error(strerror(openErrno))};
+      callback->Call(1, argv);
+    }
+  private:
+    std::string device;
+    camera_t* camera;
+    int openErrno;
+  };
+  
+  NAN_METHOD(Camera::OpenAsync) {
+    if (info.Length() < 2) {
+      Nan::ThrowTypeError("arguments required: device, callback");
+      return;
+    }
+    const auto device = std::string{*Nan::Utf8String(info[0])};
+    auto callback = new Nan::Callback(info[1].As<v8::Function>());
+    Nan::AsyncQueueWorker(new OpenWorker(device, callback));
+  }
+  
+  
+  //[recording]
+  static v8::Local<v8::Object> 
+  recorderStats(const camera_recorder_stats_t& stats) {
+    auto obj = Nan::New<v8::Object>();
+    setValue(obj, "frames", Nan::New(static_cast<double>(stats.frames)));
+    setValue(obj, "bytes", Nan::New(static_cast<double>(stats.bytes)));
+    setValue(obj, "dropped", Nan::New(static_cast<double>(stats.dropped)));
+    setValue(obj, "segments", 
+             Nan::New(static_cast<double>(stats.segments)));
+    if (stats.error) setString(obj, "error", strerror(stats.error));
+    return obj;
+  }
+  
+  NAN_METHOD(Camera::RecordStart) {
+    auto self = Ready(info);
+    if (!self) return;
+    if (self->recorder) {
+      Nan::ThrowError("already recording");
+      return;
+    }
+    const auto options = info[0]->IsObject() ? 
+      info[0]->ToObject() : Nan::New<v8::Object>();
+    const auto path = getString(options, "path", ".");
+    const auto prefix = getString(options, "prefix", "camera");
+    camera_recorder_config_t config;
+    config.path = path.c_str();
+    config.prefix = prefix.c_str();
+    config.segment_bytes = getNumber(options, "segmentBytes", 0);
+    config.segment_ns = getNumber(options, "segmentMs", 0) * 1e6;
+    config.queue_bytes = getNumber(options, "queueBytes", 0);
+    self->recorder = camera_recorder_new(&config);
+    if (!self->recorder) {
+      Nan::ThrowError(strerror(errno));
+      return;
+    }
+    {
+      Hold hold(self);
+      camera_sink_add(self->camera, camera_recorder_sink, self->recorder);
+    }
+    self->Watch();
+  }
+  
+  // the writer thread drains its queue on the threadpool
+  class Camera::RecordWorker : public Nan::AsyncWorker {
+  public:
+    RecordWorker(camera_recorder_t* recorder, Nan::Callback* callback)
+      : Nan::AsyncWorker(callback), recorder(recorder), stats() {}
+    void Execute() {
+      if (camera_recorder_delete(recorder, &stats)) return;
+      SetErrorMessage(strerror(stats.error));
+    }
+    void HandleOKCallback() {
+      Nan::HandleScope scope;
+      v8::Local<v8::Value> argv[] = {Nan::Null(), recorderStats(stats)};
+      callback->Call(2, argv);
+    }
+  private:
+    camera_recorder_t* recorder;
+    camera_recorder_stats_t stats;
+  };
+  
+  NAN_METHOD(Camera::RecordStop) {
+    auto self = Nan::ObjectWrap::Unwrap<Camera>(info.Holder());
+    if (!info[0]->IsFunction()) {
+      Nan::ThrowTypeError("argument required: callback");
+      return;
+    }
+    if (!self->recorder) {
+      Nan::ThrowError("not recording");
+      return;
+    }
+    {
+      Hold hold(self);
+      camera_sink_remove(self->camera, camera_recorder_sink, self->recorder);
+    }
+    self->Watch();
+    auto callback = new Nan::Callback(info[0].As<v8::Function>());
+    Nan::AsyncQueueWorker(new RecordWorker(self->recorder, callback));
+    self->recorder = nullptr;
+  }
+  
+  NAN_METHOD(Camera::RecordStats) {
+    auto self = Nan::ObjectWrap::Unwrap<Camera>(info.Holder());
+    if (!self->recorder) {
+      info.GetReturnValue().Set(Nan::Null());
+      return;
+    }
+    camera_recorder_stats_t stats;
+    camera_recorder_stats(self->recorder, &stats);
+    info.GetReturnValue().Set(recorderStats(stats));
+  }
+  
+  static v8::Local<v8::Object> 
+  preEventStats(const camera_preevent_stats_t& stats) {
+    auto obj = Nan::New<v8::Object>();
+    setValue(obj, "frames", Nan::New(static_cast<double>(stats.frames)));
+    setValue(obj, "bytes", Nan::New(static_cast<double>(stats.bytes)));
+    setValue(obj, "rawBytes", Nan::New(static_cast<double>(stats.raw_bytes)));
+    setValue(obj, "duration", Nan::New(stats.duration / 1e6));
+    setValue(obj, "dropped", Nan::New(static_cast<double>(stats.dropped)));
+    return obj;
+  }
+  
+  NAN_METHOD(Camera::PreEventStart) {
+    auto self = Ready(info);
+    if (!self) return;
+    if (self->preEvent) {
+      Nan::ThrowError("pre-event ring already started");
+      return;
+    }
+    const auto options = info[0]->IsObject() ? 
+      info[0]->ToObject() : Nan::New<v8::Object>();
+    camera_format_t cformat;
+    const auto yuyv = camera_config_get(self->camera, &cformat) &&
+      cformat.format == camera_format_id("YUYV");
+    const auto compress = getValue(options, "compress");
+    camera_preevent_config_t config;
+    config.arena_bytes = getNumber(options, "bytes", 0);
+    config.max_ns = getNumber(options, "seconds", 0) * 1e9;
+    config.compress = compress->IsBoolean() ? 
+      Nan::To<bool>(compress).FromJust() : yuyv;
+    const auto ring = camera_preevent_new(&config);
+    if (!ring) {
+      Nan::ThrowError(strerror(errno));
+      return;
+    }
+    self->preEvent.reset(ring, camera_preevent_delete);
+    {
+      Hold hold(self);
+      camera_sink_add(self->camera, camera_preevent_sink, ring);
+    }
+    self->Watch();
+  }
+  
+  NAN_METHOD(Camera::PreEventStop) {
+    auto self = Nan::ObjectWrap::Unwrap<Camera>(info.Holder());
+    if (!self->preEvent) return;
+    {
+      Hold hold(self);
+      camera_sink_remove(self->camera, camera_preevent_sink, 
+                         self->preEvent.get());
+    }
+    self->preEvent.reset();
+    self->Watch();
+  }
+  
+  NAN_METHOD(Camera::PreEventStats) {
+    auto self = Nan::ObjectWrap::Unwrap<Camera>(info.Holder());
+    if (!self->preEvent) {
+      info.GetReturnValue().Set(Nan::Null());
+      return;
+    }
+    camera_preevent_stats_t stats;
+    camera_preevent_stats(self->preEvent.get(), &stats);
+    info.GetReturnValue().Set(preEventStats(stats));
+  }
+  
+  // dumps to a segment file, or copies the frames out for the callback
+  class Camera::DumpWorker : public Nan::AsyncWorker {
+  public:
+    DumpWorker(std::shared_ptr<camera_preevent_t> ring, 
+               const std::string& path, Nan::Callback* callback)
+      : Nan::AsyncWorker(callback), ring(ring), path(path), stats() {}
+    ~DumpWorker() {
+      for (auto& frame: frames) free(const_cast<std::uint8_t*>(frame.start));
+    }
+    void Execute() {
+      const auto ok = path.empty() ?
+        camera_preevent_dump(ring.get(), Collect, &frames) :
+        camera_preevent_write(ring.get(), path.c_str(), &stats);
+      if (!ok) SetErrorMessage(strerror(errno));
+    }
+    void HandleOKCallback() {
+      Nan::HandleScope scope;
+      v8::Local<v8::Value> argv[] = {Nan::Null(), Nan::Null()};
+      if (path.empty()) {
+        auto array = Nan::New<v8::Array>(frames.size());
+        for (auto i = std::size_t{0}; i < frames.size(); ++i) {
+          auto& cframe = frames[i];
+          auto frame = newObject(SHAPE_RECORDED);
+          // the buffer takes over the malloc()ed copy
+          setValue(frame, "data", Nan::NewBuffer(
+            reinterpret_cast<char*>(const_cast<std::uint8_t*>(cframe.start)),
+            cframe.length).ToLocalChecked());
+          cframe.start = nullptr;
+          setValue(frame, "timestamp", Nan::New(cframe.timestamp / 1e6));
+          setUint(frame, "sequence", cframe.sequence);
+          Nan::Set(array, i, frame);
+        }
+        argv[1] = array;
+      } else {
+        argv[1] = preEventStats(stats);
+      }
+      callback->Call(2, argv);
+    }
+  private:
+    static bool Collect(const camera_frame_t* frame, void* pointer) {
+      auto frames = static_cast<std::vector<camera_frame_t>*>(pointer);
+      auto copy = *frame;
+      auto data = static_cast<std::uint8_t*>(malloc(frame->length));
+      if (!data) return false;
+      std::copy(frame->start, frame->start + frame->length, data);
+      copy.start = data;
+      frames->push_back(copy);
+      return true;
+    }
+    std::shared_ptr<camera_preevent_t> ring;
+    std::string path;
+    camera_preevent_stats_t stats;
+    std::vector<camera_frame_t> frames;
+  };
+  
+  NAN_METHOD(Camera::DumpPreEvent) {
+    auto self = Nan::ObjectWrap::Unwrap<Camera>(info.Holder());
+    const auto withPath = info[0]->IsString();
+    const auto func = withPath ? info[1] : info[0];
+    if (!func->IsFunction()) {
+      Nan::ThrowTypeError("argument required: callback");
+      return;
+    }
+    if (!self->preEvent) {
+      Nan::ThrowError("pre-event ring not started");
+      return;
+    }
+    const auto path = withPath ? 
+      std::string{*Nan::Utf8String(info[0])} : std::string{};
+    auto callback = new Nan::Callback(func.As<v8::Function>());
+    Nan::AsyncQueueWorker(new DumpWorker(self->preEvent, path, callback));
+  }
+  
+  // replays a recorded segment; frame buffers share its mapping
+  class Segment : public Nan::ObjectWrap {
+  public:
+    static NAN_MODULE_INIT(Init);
+  private:
+    static NAN_METHOD(New);
+    static NAN_METHOD(Find);
+    static NAN_METHOD(Frame);
+    typedef std::shared_ptr<camera_segment_t> Handle;
+    Handle segment;
+  };
+  
+  NAN_METHOD(Segment::New) {
+    if (!info.IsConstructCall()) {
+      v8::Local<v8::Value> args[] = {info[0]};
+      auto inst = Nan::NewInstance(info.Callee(), 1, args);
+      if (!inst.IsEmpty()) info.GetReturnValue().Set(inst.ToLocalChecked());
+      return;
+    }
+    if (!info[0]->IsString()) {
+      Nan::ThrowTypeError("argument required: path");
+      return;
+    }
+    const auto segment = camera_segment_open(*Nan::Utf8String(info[0]));
+    if (!segment) {
+      Nan::ThrowError(strerror(errno));
+      return;
+    }
+    auto thisObj = info.This();
+    auto self = new Segment;
+    self->segment = Handle(segment, camera_segment_close);
+    self->Wrap(thisObj);
+    setValue(thisObj, "path", info[0]);
+    setValue(thisObj, "length", Nan::New(static_cast<double>(
+      camera_segment_length(segment))));
+  }
+  
+  NAN_METHOD(Segment::Find) {
+    auto self = Nan::ObjectWrap::Unwrap<Segment>(info.Holder());
+    const auto ms = Nan::To<double>(info[0]).FromMaybe(0);
+    const auto segment = self->segment.get();
+    const auto index = camera_segment_find(
+      segment, ms > 0 ? static_cast<std::uint64_t>(ms * 1e6) : 0);
+    if (index == camera_segment_length(segment)) {
+      info.GetReturnValue().Set(Nan::New(-1));
+      return;
+    }
+    info.GetReturnValue().Set(Nan::New(static_cast<double>(index)));
+  }
+  
+  NAN_METHOD(Segment::Frame) {
+    auto self = Nan::ObjectWrap::Unwrap<Segment>(info.Holder());
+    const auto index = Nan::To<double>(info[0]).FromMaybe(-1);
+    camera_frame_t cframe;
+    if (index < 0 || !camera_segment_frame(
+          self->segment.get(), static_cast<std::size_t>(index), &cframe)) {
+      Nan::ThrowRangeError("frame index out of range");
+      return;
+    }
+    auto hint = new Handle(self->segment);
+    auto data = Nan::NewBuffer(
+      reinterpret_cast<char*>(const_cast<std::uint8_t*>(cframe.start)),
+      cframe.length, [](char*, void* hint) -> void {
+        delete static_cast<Handle*>(hint);
+      }, hint).ToLocalChecked();
+    auto frame = newObject(SHAPE_RECORDED);
+    setValue(frame, "data", data);
+    setValue(frame, "timestamp", Nan::New(cframe.timestamp / 1e6));
+    setUint(frame, "sequence", cframe.sequence);
+    info.GetReturnValue().Set(frame);
+  }
+  
+  NAN_MODULE_INIT(Segment::Init) {
+    const auto name = Nan::New("Segment").ToLocalChecked();
+    auto ctor = Nan::New<v8::FunctionTemplate>(New);
+    ctor->SetClassName(name);
+    ctor->InstanceTemplate()->SetInternalFieldCount(1);
+    Nan::SetPrototypeMethod(ctor, "find", Find);
+    Nan::SetPrototypeMethod(ctor, "frame", Frame);
+    Nan::Set(target, name, Nan::GetFunction(ctor).ToLocalChecked());
+  }
+  
+  NAN_METHOD(Camera::Sync::New) {
+    if (!info.IsConstructCall()) {
+      v8::Local<v8::Value> args[] = {info[0], info[1]};
+      auto inst = Nan::NewInstance(info.Callee(), 2, args);
+      if (!inst.IsEmpty()) info.GetReturnValue().Set(inst.ToLocalChecked());
+      return;
+    }
+    if (!info[0]->IsArray()) {
+      Nan::ThrowTypeError("argument required: cameras");
+      return;
+    }
+    const auto array = info[0].As<v8::Array>();
+    const auto ctor = Nan::New(getAddonData(info.GetIsolate())->camera);
+    std::vector<Camera*> members;
+    std::vector<camera_t*> cameras;
+    for (auto i = std::uint32_t{0}; i < array->Length(); ++i) {
+      const auto value = Nan::Get(array, i).ToLocalChecked();
+      if (!value->IsObject() || 
+          !value->InstanceOf(Nan::GetCurrentContext(), ctor).FromMaybe(false)) {
+        Nan::ThrowTypeError("cameras must be Camera objects");
+        return;
+      }
+      const auto member = Nan::ObjectWrap::Unwrap<Camera>(
+        Nan::To<v8::Object>(value).ToLocalChecked());
+      if (!member->camera || member->busy || member->thread || 
+          member->sync ||
+          std::find(members.begin(), members.end(), member) != 
+          members.end()) {
+        Nan::ThrowError(
+          "cameras must be idle, without realtime and in no other sync");
+        return;
+      }
+      members.push_back(member);
+      cameras.push_back(member->camera);
+    }
+    const auto options = info[1]->IsObject() ? 
+      Nan::To<v8::Object>(info[1]).ToLocalChecked() : Nan::New<v8::Object>();
+    auto config = camera_sync_config_t{};
+    config.tolerance = getNumber(options, "tolerance", 5) * 1e6;
+    config.hold = getNumber(options, "hold", 0);
+    const auto sync = camera_sync_new(cameras.data(), cameras.size(), &config);
+    if (!sync) {
+      Nan::ThrowError(strerror(errno));
+      return;
+    }
+    auto thisObj = info.This();
+    auto self = new Sync;
+    self->Wrap(thisObj);
+    self->sync = sync;
+    self->members = members;
+    self->cameras.Reset(array);
+    // kept alive with its cameras until close()
+    self->Ref();
+    for (auto i = std::size_t{0}; i < members.size(); ++i) {
+      members[i]->sync = self;
+      members[i]->syncIndex = i;
+      members[i]->Watch();
+    }
+  }
+  
+  void Camera::Sync::Offer(Camera* member, const camera_frame_t& frame, 
+                           int index, std::uint64_t woken) {
+    camera_sync_offer(sync, member->syncIndex, &frame, index);
+    auto set = camera_sync_set_t{};
+    while (sync && camera_sync_take(sync, &set)) {
+      // captures of each camera take the set at its own rate
+      std::vector<Captures> takers(members.size());
+      for (auto i = std::size_t{0}; i < members.size(); ++i) {
+        const auto camera = members[i]->camera;
+        const auto& cframe = set.frames[i].frame;
+        camera_retrieve(camera, &cframe);
+        const auto time = camera_frame_time(camera, &cframe);
+        if (camera_rate_take(&camera->rate, time)) {
+          takers[i] = members[i]->Takers(time);
+        }
+      }
+      camera_sync_release(sync, &set);
+      // the listeners may close the sync, members stay referenced
+      const auto held = members;
+      Emit(set);
+      for (auto i = std::size_t{0}; i < held.size(); ++i) {
+        held[i]->Deliver(takers[i], true, woken);
+      }
+    }
+  }
+  
+  void Camera::Sync::Emit(const camera_sync_set_t& set) {
+    Nan::HandleScope scope;
+    auto thisObj = handle();
+    const auto emit = getValue(thisObj, "emit");
+    if (!emit->IsFunction()) return;
+    auto event = Nan::New<v8::Object>();
+    setValue(event, "timestamp", Nan::New(set.timestamp / 1e6));
+    setValue(event, "skew", Nan::New(set.skew / 1e6));
+    auto sequences = Nan::New<v8::Array>(set.count);
+    for (auto i = std::size_t{0}; i < set.count; ++i) {
+      Nan::Set(sequences, i, Nan::New(set.frames[i].frame.sequence));
+    }
+    setValue(event, "sequences", sequences);
+    v8::Local<v8::Value> argv[] = {propertyName("set"), event};
+    Nan::MakeCallback(thisObj, emit.As<v8::Function>(), 2, argv);
+  }
+  
+  void Camera::Sync::Flush(Camera* member) {
+    if (sync) camera_sync_flush(sync, member->syncIndex);
+  }
+  
+  // releasing is the camera being closed, not watched again
+  void Camera::Sync::Detach(Camera* releasing) {
+    if (!sync) return;
+    camera_sync_delete(sync);
+    sync = nullptr;
+    const auto detached = std::move(members);
+    members.clear();
+    for (auto member: detached) {
+      member->sync = nullptr;
+      if (member != releasing) member->Watch();
+    }
+    cameras.Reset();
+    Unref();
+  }
+  
+  NAN_METHOD(Camera::Sync::Stats) {
+    auto self = Nan::ObjectWrap::Unwrap<Sync>(info.Holder());
+    if (!self->sync) {
+      Nan::ThrowError("sync is closed");
+      return;
+    }
+    auto cstats = camera_sync_stats_t{};
+    camera_sync_stats(self->sync, &cstats);
+    auto obj = Nan::New<v8::Object>();
+    const auto number = [](std::uint64_t value) -> v8::Local<v8::Value> {
+      return Nan::New(static_cast<double>(value));
+    };
+    setValue(obj, "sets", number(cstats.sets));
+    setValue(obj, "dropped", number(cstats.dropped));
+    setValue(obj, "incomplete", number(cstats.incomplete));
+    setValue(obj, "skew", convertHistogram(cstats.skew));
+    auto cameras = Nan::New<v8::Array>(self->members.size());
+    for (auto i = std::uint32_t{0}; i < self->members.size(); ++i) {
+      auto camera = Nan::New<v8::Object>();
+      setValue(camera, "dropped", number(cstats.camera_dropped[i]));
+      setValue(camera, "gaps", number(cstats.gaps[i]));
+      Nan::Set(cameras, i, camera);
+    }
+    setValue(obj, "cameras", cameras);
+    info.GetReturnValue().Set(obj);
+  }
+  
+  NAN_METHOD(Camera::Sync::Close) {
+    auto self = Nan::ObjectWrap::Unwrap<Sync>(info.Holder());
+    self->Detach(nullptr);
+  }
+  
+  NAN_MODULE_INIT(Camera::Sync::Init) {
+    const auto name = Nan::New("Sync").ToLocalChecked();
+    auto ctor = Nan::New<v8::FunctionTemplate>(New);
+    ctor->SetClassName(name);
+    ctor->InstanceTemplate()->SetInternalFieldCount(1);
+    Nan::SetPrototypeMethod(ctor, "stats", Stats);
+    Nan::SetPrototypeMethod(ctor, "close", Close);
+    Nan::Set(target, name, Nan::GetFunction(ctor).ToLocalChecked());
+  }
+  
   
-  Camera::Camera() : camera(nullptr) {}
+  Camera::Camera()
+    : camera(nullptr), isolate(nullptr), poll(nullptr), pollEvents(0), 
+      idle(nullptr), idleTimeout(0), paused(false), thread(nullptr), 
+      async(nullptr), waiting(false), events(false), 
+      watchEvents(false), busy(false), 
+      recorder(nullptr), sync(nullptr), syncIndex(0), nextConsumer(0), 
+      convertGeneration(0), convertHits(0), convertMisses(0) {}
   Camera::~Camera() {
+    if (isolate) node::RemoveEnvironmentCleanupHook(isolate, Cleanup, this);
+    Release();
+  }
+  // a worker may exit with cameras still reachable: close them with it
+  void Camera::Cleanup(void* pointer) {
+    auto self = static_cast<Camera*>(pointer);
+    self->isolate = nullptr;
+    self->Release();
+  }
+  void Camera::Release() {
+    if (sync) sync->Detach(this);
+    waiting = false;
+    StopThread();
+    if (poll) {
+      uv_poll_stop(poll);
+      uv_close(reinterpret_cast<uv_handle_t*>(poll), 
+               [](uv_handle_t* handle) -> void {
+                 delete reinterpret_cast<uv_poll_t*>(handle);
+               });
+      poll = nullptr;
+    }
+    if (idle) {
+      uv_close(reinterpret_cast<uv_handle_t*>(idle), 
+               [](uv_handle_t* handle) -> void {
+                 delete reinterpret_cast<uv_timer_t*>(handle);
+               });
+      idle = nullptr;
+    }
+    formats.Reset();
+    controls.Reset();
+    converted.clear();
+    if (recorder) camera_recorder_delete(recorder, nullptr);
+    recorder = nullptr;
+    if (camera && preEvent) {
+      camera_sink_remove(camera, camera_preevent_sink, preEvent.get());
+    }
+    preEvent.reset();
+    pngs.reset();
+    remapping.reset();
     if (camera) {
       auto ctx = static_cast<LogContext*>(camera->context.pointer);
+      const auto denoise = camera->denoise;
       camera_close(camera);
+      camera_denoise_delete(denoise);
       delete ctx;
+      camera = nullptr;
     }
   }
   
@@ -427,19 +2798,61 @@ namespace {
     auto ctorInst = ctor->InstanceTemplate();
     ctor->SetClassName(name);
     ctorInst->SetInternalFieldCount(1);
+    Nan::SetAccessor(ctorInst, Nan::New("formats").ToLocalChecked(), Formats);
+    Nan::SetAccessor(ctorInst, Nan::New("controls").ToLocalChecked(),
+                     Controls);
     
     Nan::SetPrototypeMethod(ctor, "start", Start);
     Nan::SetPrototypeMethod(ctor, "stop", Stop);
     Nan::SetPrototypeMethod(ctor, "capture", Capture);
     Nan::SetPrototypeMethod(ctor, "frameRaw", FrameRaw);
+    Nan::SetPrototypeMethod(ctor, "frameInfo", FrameInfo);
     Nan::SetPrototypeMethod(ctor, "toYUYV", FrameRaw);
     Nan::SetPrototypeMethod(ctor, "toRGB", FrameYUYVToRGB);
+    Nan::SetPrototypeMethod(ctor, "demosaic", Demosaic);
+    Nan::SetPrototypeMethod(ctor, "samples", Samples);
+    Nan::SetPrototypeMethod(ctor, "normalize", Normalize);
+    Nan::SetPrototypeMethod(ctor, "_toPNGAsync", ToPNGAsync);
+    Nan::SetPrototypeMethod(ctor, "remapSet", RemapSet);
+    Nan::SetPrototypeMethod(ctor, "remap", RemapFrame);
+    Nan::SetPrototypeMethod(ctor, "orientation", Orientation);
+    Nan::SetPrototypeMethod(ctor, "denoise", Denoise);
+    Nan::SetPrototypeMethod(ctor, "stacked", Stacked);
+    Nan::SetPrototypeMethod(ctor, "framePlanes", FramePlanes);
+    Nan::SetPrototypeMethod(ctor, "_frameToSlot", FrameToSlot);
     Nan::SetPrototypeMethod(ctor, "configGet", ConfigGet);
     Nan::SetPrototypeMethod(ctor, "configSet", ConfigSet);
+    Nan::SetPrototypeMethod(ctor, "selectMode", SelectMode);
+    Nan::SetPrototypeMethod(ctor, "getCropBounds", CropBounds);
+    Nan::SetPrototypeMethod(ctor, "getCrop", CropGet);
+    Nan::SetPrototypeMethod(ctor, "setCrop", CropSet);
     Nan::SetPrototypeMethod(ctor, "controlGet", ControlGet);
     Nan::SetPrototypeMethod(ctor, "controlSet", ControlSet);
-    Nan::Set(target, name, Nan::GetFunction(ctor).ToLocalChecked());
+    Nan::SetPrototypeMethod(ctor, "_watchEvents", WatchEvents);
+    Nan::SetPrototypeMethod(ctor, "idlePolicy", IdlePolicy);
+    Nan::SetPrototypeMethod(ctor, "realtime", Realtime);
+    Nan::SetPrototypeMethod(ctor, "rateControl", RateControl);
+    Nan::SetPrototypeMethod(ctor, "_consumerOpen", ConsumerOpen);
+    Nan::SetPrototypeMethod(ctor, "_consumerClose", ConsumerClose);
+    Nan::SetPrototypeMethod(ctor, "_consumerStats", ConsumerStats);
+    Nan::SetPrototypeMethod(ctor, "stats", Stats);
+    Nan::SetPrototypeMethod(ctor, "_startAsync", StartAsync);
+    Nan::SetPrototypeMethod(ctor, "_stopAsync", StopAsync);
+    Nan::SetPrototypeMethod(ctor, "_configSetAsync", ConfigSetAsync);
+    Nan::SetPrototypeMethod(ctor, "recordStart", RecordStart);
+    Nan::SetPrototypeMethod(ctor, "recordStop", RecordStop);
+    Nan::SetPrototypeMethod(ctor, "recordStats", RecordStats);
+    Nan::SetPrototypeMethod(ctor, "preEventStart", PreEventStart);
+    Nan::SetPrototypeMethod(ctor, "preEventStop", PreEventStop);
+    Nan::SetPrototypeMethod(ctor, "preEventStats", PreEventStats);
+    Nan::SetPrototypeMethod(ctor, "dumpPreEvent", DumpPreEvent);
+    Nan::SetMethod(ctor, "_openAsync", OpenAsync);
+    const auto ctorFunc = Nan::GetFunction(ctor).ToLocalChecked();
+    getAddonData(v8::Isolate::GetCurrent())->camera.Reset(ctorFunc);
+    Nan::Set(target, name, ctorFunc);
+    Segment::Init(target);
+    Sync::Init(target);
   }
 }
 
-NODE_MODULE(v4l2camera, Camera::Init)
+NAN_MODULE_WORKER_ENABLED(v4l2camera, Camera::Init)